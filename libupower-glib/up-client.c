@@ -36,6 +36,11 @@
 
 #include "upower.h"
 #include "up-daemon-generated.h"
+#include "up-device-private.h"
+
+#define UP_DEVICES_DBUS_PATH		"/org/freedesktop/UPower/devices"
+#define UP_DISPLAY_DEVICE_DBUS_PATH	UP_DEVICES_DBUS_PATH "/DisplayDevice"
+#define UP_DEVICE_DBUS_INTERFACE	"org.freedesktop.UPower.Device"
 
 static void	up_client_class_init			(UpClientClass	*klass);
 static void	up_client_initable_iface_init		(GInitableIface *iface);
@@ -51,6 +56,13 @@ static void	up_client_finalize			(GObject	*object);
 struct _UpClientPrivate
 {
 	UpExportedDaemon *proxy;
+	/* NULL if the daemon is too old to export its devices this way */
+	GDBusObjectManager *object_manager;
+	/* NULL until the devices were enumerated once, then kept up to
+	 * date by the DeviceAdded and DeviceRemoved signals */
+	GPtrArray *devices;
+	/* bumped whenever the set of devices changes */
+	guint devices_generation;
 };
 
 enum {
@@ -97,6 +109,81 @@ up_client_get_devices (UpClient *client)
 	return array;
 }
 
+/*
+ * up_client_new_device_for_path:
+ *
+ * Returns a new #UpDevice backed by the proxy of the object manager,
+ * without any D-Bus round trip, or %NULL if it does not know the object.
+ */
+static UpDevice *
+up_client_new_device_for_path (UpClient *client, const gchar *object_path)
+{
+	g_autoptr(GDBusInterface) proxy = NULL;
+	UpDevice *device;
+
+	if (client->priv->object_manager == NULL)
+		return NULL;
+
+	proxy = g_dbus_object_manager_get_interface (client->priv->object_manager,
+						     object_path,
+						     UP_DEVICE_DBUS_INTERFACE);
+	if (proxy == NULL)
+		return NULL;
+
+	device = up_device_new ();
+	up_device_set_proxy (device, UP_EXPORTED_DEVICE (proxy));
+	return device;
+}
+
+static gint
+up_client_compare_object_path (gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0 (g_dbus_object_get_object_path (G_DBUS_OBJECT (a)),
+			  g_dbus_object_get_object_path (G_DBUS_OBJECT (b)));
+}
+
+static gpointer
+up_client_ref_device (gconstpointer src, gpointer user_data)
+{
+	return g_object_ref ((gpointer) src);
+}
+
+static GPtrArray *
+up_client_dup_devices (GPtrArray *devices)
+{
+	return g_ptr_array_copy (devices, up_client_ref_device, NULL);
+}
+
+/*
+ * up_client_cache_devices:
+ *
+ * Keeps a copy of the enumerated devices, unless the set of devices
+ * changed since the enumeration started in @generation.
+ */
+static void
+up_client_cache_devices (UpClient *client, GPtrArray *devices, guint generation)
+{
+	if (client->priv->devices != NULL)
+		return;
+	if (generation != client->priv->devices_generation)
+		return;
+	client->priv->devices = up_client_dup_devices (devices);
+}
+
+static gint
+up_client_find_device (UpClient *client, const gchar *object_path)
+{
+	guint i;
+
+	for (i = 0; i < client->priv->devices->len; i++) {
+		UpDevice *device = g_ptr_array_index (client->priv->devices, i);
+
+		if (g_strcmp0 (up_device_get_object_path (device), object_path) == 0)
+			return i;
+	}
+	return -1;
+}
+
 static GPtrArray *
 up_client_get_devices_full (UpClient      *client,
 			    GCancellable  *cancellable,
@@ -106,6 +193,33 @@ up_client_get_devices_full (UpClient      *client,
 	GPtrArray *array;
 	guint i;
 
+	/* all the devices and their properties already came with the
+	 * GetManagedObjects call of the object manager */
+	if (client->priv->object_manager != NULL) {
+		GList *objects;
+		GList *l;
+
+		objects = g_dbus_object_manager_get_objects (client->priv->object_manager);
+		objects = g_list_sort (objects, up_client_compare_object_path);
+
+		array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+		for (l = objects; l != NULL; l = l->next) {
+			const char *object_path = g_dbus_object_get_object_path (l->data);
+			UpDevice *device;
+
+			/* like EnumerateDevices, skip the composite device */
+			if (g_str_equal (object_path, UP_DISPLAY_DEVICE_DBUS_PATH))
+				continue;
+
+			device = up_client_new_device_for_path (client, object_path);
+			if (device != NULL)
+				g_ptr_array_add (array, device);
+		}
+		g_list_free_full (objects, g_object_unref);
+
+		return array;
+	}
+
 	if (up_exported_daemon_call_enumerate_devices_sync (client->priv->proxy,
 							    &devices,
 							    cancellable,
@@ -136,6 +250,11 @@ up_client_get_devices_full (UpClient      *client,
  *
  * Get a copy of the device objects.
  *
+ * Only the first call queries the daemon, the devices are then kept up to
+ * date from the #UpClient::device-added and #UpClient::device-removed
+ * signals, which requires the thread-default main context of the
+ * #UpClient to be running.
+ *
  * Return value: (element-type UpDevice) (transfer full): an array of #UpDevice objects or %NULL on error, free with g_ptr_array_unref()
  *
  * Since: 0.99.8
@@ -145,32 +264,103 @@ up_client_get_devices2 (UpClient *client)
 {
 	g_autoptr(GError) error = NULL;
 	GPtrArray *ret = NULL;
+	guint generation;
 
 	g_return_val_if_fail (UP_IS_CLIENT (client), NULL);
 
+	if (client->priv->devices != NULL)
+		return up_client_dup_devices (client->priv->devices);
+
+	generation = client->priv->devices_generation;
 	ret = up_client_get_devices_full (client, NULL, &error);
 	if (!ret) {
 		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
 			g_warning ("up_client_get_devices failed: %s", error->message);
 		return NULL;
 	}
+	up_client_cache_devices (client, ret, generation);
 	return ret;
 }
 
+typedef struct {
+	GPtrArray	*devices;	/* in the order of EnumerateDevices */
+	guint		 pending;
+	guint		 generation;
+} UpClientGetDevicesData;
+
+static void
+up_client_get_devices_data_free (UpClientGetDevicesData *data)
+{
+	g_ptr_array_unref (data->devices);
+	g_free (data);
+}
+
+static void
+up_client_get_devices_device_cb (GObject      *source_object,
+				 GAsyncResult *res,
+				 gpointer      user_data)
+{
+	GTask *task = G_TASK (user_data);
+	UpClientGetDevicesData *data = g_task_get_task_data (task);
+	UpDevice *device = UP_DEVICE (source_object);
+	g_autoptr(GError) error = NULL;
+
+	/* skip the devices that went away in the meantime */
+	if (!up_device_set_object_path_finish (device, res, &error)) {
+		g_debug ("Failed to get device: %s", error->message);
+		g_ptr_array_remove (data->devices, device);
+	}
+
+	if (--data->pending == 0 && !g_task_return_error_if_cancelled (task)) {
+		up_client_cache_devices (g_task_get_source_object (task),
+					 data->devices, data->generation);
+		g_task_return_pointer (task,
+				       g_ptr_array_ref (data->devices),
+				       (GDestroyNotify) g_ptr_array_unref);
+	}
+	g_object_unref (task);
+}
+
 static void
-get_devices_async_thread (GTask        *task,
-			  gpointer      source_object,
-			  gpointer      task_data,
-			  GCancellable *cancellable)
+up_client_get_devices_enumerate_cb (GObject      *source_object,
+				    GAsyncResult *res,
+				    gpointer      user_data)
 {
+	g_autoptr(GTask) task = G_TASK (user_data);
+	UpClientGetDevicesData *data;
+	g_auto(GStrv) devices = NULL;
 	GError *error = NULL;
-	GPtrArray *array;
+	guint i;
 
-	array = up_client_get_devices_full (UP_CLIENT (source_object), cancellable, &error);
-	if (!array)
+	if (!up_exported_daemon_call_enumerate_devices_finish (UP_EXPORTED_DAEMON (source_object),
+							       &devices, res, &error)) {
 		g_task_return_error (task, error);
-	else
-		g_task_return_pointer (task, array, (GDestroyNotify) g_ptr_array_unref);
+		return;
+	}
+
+	data = g_task_get_task_data (task);
+
+	if (devices[0] == NULL) {
+		up_client_cache_devices (g_task_get_source_object (task),
+					 data->devices, data->generation);
+		g_task_return_pointer (task,
+				       g_ptr_array_ref (data->devices),
+				       (GDestroyNotify) g_ptr_array_unref);
+		return;
+	}
+
+	/* set up all the devices at once, so that this takes a single
+	 * round trip rather than one per device */
+	for (i = 0; devices[i] != NULL; i++)
+		g_ptr_array_add (data->devices, up_device_new ());
+	data->pending = data->devices->len;
+	for (i = 0; devices[i] != NULL; i++) {
+		up_device_set_object_path_async (g_ptr_array_index (data->devices, i),
+						 devices[i],
+						 g_task_get_cancellable (task),
+						 up_client_get_devices_device_cb,
+						 g_object_ref (task));
+	}
 }
 
 /**
@@ -182,6 +372,9 @@ get_devices_async_thread (GTask        *task,
  *
  * Asynchronously fetches the list of #UpDevice objects.
  *
+ * The D-Bus calls are issued on the thread-default main context of the
+ * caller, all devices being set up concurrently.
+ *
  * Since: 0.99.14
  **/
 void
@@ -190,14 +383,42 @@ up_client_get_devices_async (UpClient            *client,
 			     GAsyncReadyCallback  callback,
 			     gpointer             user_data)
 {
-	g_autoptr(GTask) task = NULL;
+	UpClientGetDevicesData *data;
+	GTask *task;
 
 	g_return_if_fail (UP_IS_CLIENT (client));
 
 	task = g_task_new (client, cancellable, callback, user_data);
 	g_task_set_source_tag (task, (gpointer) G_STRFUNC);
 
-	g_task_run_in_thread (task, get_devices_async_thread);
+	if (client->priv->devices != NULL) {
+		g_task_return_pointer (task,
+				       up_client_dup_devices (client->priv->devices),
+				       (GDestroyNotify) g_ptr_array_unref);
+		g_object_unref (task);
+		return;
+	}
+
+	/* the object manager already has all of them */
+	if (client->priv->object_manager != NULL) {
+		GPtrArray *devices;
+
+		devices = up_client_get_devices_full (client, cancellable, NULL);
+		up_client_cache_devices (client, devices, client->priv->devices_generation);
+		g_task_return_pointer (task, devices, (GDestroyNotify) g_ptr_array_unref);
+		g_object_unref (task);
+		return;
+	}
+
+	data = g_new0 (UpClientGetDevicesData, 1);
+	data->devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	data->generation = client->priv->devices_generation;
+	g_task_set_task_data (task, data, (GDestroyNotify) up_client_get_devices_data_free);
+
+	up_exported_daemon_call_enumerate_devices (client->priv->proxy,
+						   cancellable,
+						   up_client_get_devices_enumerate_cb,
+						   task);
 }
 
 /**
@@ -238,8 +459,12 @@ up_client_get_display_device (UpClient *client)
 	gboolean ret;
 	UpDevice *device;
 
+	device = up_client_new_device_for_path (client, UP_DISPLAY_DEVICE_DBUS_PATH);
+	if (device != NULL)
+		return device;
+
 	device = up_device_new ();
-	ret = up_device_set_object_path_sync (device, "/org/freedesktop/UPower/devices/DisplayDevice", NULL, NULL);
+	ret = up_device_set_object_path_sync (device, UP_DISPLAY_DEVICE_DBUS_PATH, NULL, NULL);
 	if (!ret) {
 		g_object_unref (G_OBJECT (device));
 		return NULL;
@@ -349,13 +574,27 @@ up_client_add (UpClient *client, const gchar *object_path)
 	UpDevice *device = NULL;
 	gboolean ret;
 
+	/* the object manager saw the object appear before the signal */
+	device = up_client_new_device_for_path (client, object_path);
+	if (device != NULL)
+		goto emit;
+
 	/* create new device */
 	device = up_device_new ();
 	ret = up_device_set_object_path_sync (device, object_path, NULL, NULL);
 	if (!ret)
 		goto out;
+emit:
 
 	/* add to array */
+	client->priv->devices_generation++;
+	if (client->priv->devices != NULL) {
+		gint idx = up_client_find_device (client, object_path);
+
+		if (idx >= 0)
+			g_ptr_array_remove_index (client->priv->devices, idx);
+		g_ptr_array_add (client->priv->devices, g_object_ref (device));
+	}
 	g_signal_emit (client, signals [UP_CLIENT_DEVICE_ADDED], 0, device);
 out:
 	g_clear_object (&device);
@@ -394,9 +633,43 @@ up_device_added_cb (UpExportedDaemon *proxy, const gchar *object_path, UpClient
 static void
 up_device_removed_cb (UpExportedDaemon *proxy, const gchar *object_path, UpClient *client)
 {
+	client->priv->devices_generation++;
+	if (client->priv->devices != NULL) {
+		gint idx = up_client_find_device (client, object_path);
+
+		if (idx >= 0)
+			g_ptr_array_remove_index (client->priv->devices, idx);
+	}
 	g_signal_emit (client, signals [UP_CLIENT_DEVICE_REMOVED], 0, object_path);
 }
 
+/*
+ * up_client_name_owner_cb:
+ */
+static void
+up_client_name_owner_cb (GObject    *gobject,
+			 GParamSpec *pspec,
+			 UpClient   *client)
+{
+	/* the devices of the previous daemon are gone, enumerate the
+	 * ones of the new daemon on the next call */
+	client->priv->devices_generation++;
+	g_clear_pointer (&client->priv->devices, g_ptr_array_unref);
+}
+
+static GType
+up_client_get_proxy_type (GDBusObjectManagerClient *manager,
+			  const gchar              *object_path,
+			  const gchar              *interface_name,
+			  gpointer                  user_data)
+{
+	if (interface_name == NULL)
+		return G_TYPE_DBUS_OBJECT_PROXY;
+	if (g_str_equal (interface_name, UP_DEVICE_DBUS_INTERFACE))
+		return UP_TYPE_EXPORTED_DEVICE_PROXY;
+	return G_TYPE_DBUS_PROXY;
+}
+
 static void
 up_client_get_property (GObject *object,
 			 guint prop_id,
@@ -530,6 +803,42 @@ up_client_class_init (UpClientClass *klass)
 			      G_TYPE_NONE, 1, G_TYPE_STRING);
 }
 
+/*
+ * up_client_setup:
+ *
+ * Keeps the object manager, if the daemon exports one, and connects
+ * to the daemon once both were created.
+ */
+static gboolean
+up_client_setup (UpClient *client,
+		 GDBusObjectManager *object_manager,
+		 const GError *manager_error,
+		 GError **error)
+{
+	/* fall back to one call per device with older daemons */
+	if (object_manager == NULL) {
+		if (g_error_matches (manager_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_propagate_error (error, g_error_copy (manager_error));
+			g_clear_object (&client->priv->proxy);
+			return FALSE;
+		}
+		g_debug ("Not using the object manager: %s", manager_error->message);
+	}
+	client->priv->object_manager = object_manager;
+
+	/* all callbacks */
+	g_signal_connect (client->priv->proxy, "device-added",
+			  G_CALLBACK (up_device_added_cb), client);
+	g_signal_connect (client->priv->proxy, "device-removed",
+			  G_CALLBACK (up_device_removed_cb), client);
+	g_signal_connect (client->priv->proxy, "notify",
+			  G_CALLBACK (up_client_notify_cb), client);
+	g_signal_connect (client->priv->proxy, "notify::g-name-owner",
+			  G_CALLBACK (up_client_name_owner_cb), client);
+
+	return TRUE;
+}
+
 /*
  * up_client_init:
  * @client: This class instance
@@ -538,6 +847,8 @@ static gboolean
 up_client_initable_init (GInitable *initable, GCancellable *cancellable, GError **error)
 {
 	UpClient *client = UP_CLIENT (initable);
+	GDBusObjectManager *object_manager;
+	g_autoptr(GError) manager_error = NULL;
 	client->priv = up_client_get_instance_private (client);
 
 	/* connect to main interface */
@@ -550,15 +861,17 @@ up_client_initable_init (GInitable *initable, GCancellable *cancellable, GError
 	if (client->priv->proxy == NULL)
 		return FALSE;
 
-	/* all callbacks */
-	g_signal_connect (client->priv->proxy, "device-added",
-			  G_CALLBACK (up_device_added_cb), client);
-	g_signal_connect (client->priv->proxy, "device-removed",
-			  G_CALLBACK (up_device_removed_cb), client);
-	g_signal_connect (client->priv->proxy, "notify",
-			  G_CALLBACK (up_client_notify_cb), client);
-
-	return TRUE;
+	/* fetch all the devices with their properties in one call */
+	object_manager = g_dbus_object_manager_client_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
+									G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
+									"org.freedesktop.UPower",
+									UP_DEVICES_DBUS_PATH,
+									up_client_get_proxy_type,
+									NULL, NULL,
+									cancellable,
+									&manager_error);
+
+	return up_client_setup (client, object_manager, manager_error, error);
 }
 
 static void
@@ -588,6 +901,8 @@ up_client_finalize (GObject *object)
 
 	client = UP_CLIENT (object);
 
+	g_clear_pointer (&client->priv->devices, g_ptr_array_unref);
+	g_clear_object (&client->priv->object_manager);
 	g_clear_object (&client->priv->proxy);
 
 	G_OBJECT_CLASS (up_client_parent_class)->finalize (object);
@@ -636,10 +951,94 @@ up_client_new (void)
 	return client;
 }
 
+static void
+up_client_object_manager_cb (GObject      *source_object,
+			     GAsyncResult *res,
+			     gpointer      user_data)
+{
+	g_autoptr(GTask) task = G_TASK (user_data);
+	UpClient *client = g_task_get_source_object (task);
+	GDBusObjectManager *object_manager;
+	g_autoptr(GError) manager_error = NULL;
+	GError *error = NULL;
+
+	object_manager = g_dbus_object_manager_client_new_for_bus_finish (res, &manager_error);
+	if (!up_client_setup (client, object_manager, manager_error, &error))
+		g_task_return_error (task, error);
+	else
+		g_task_return_boolean (task, TRUE);
+}
+
+static void
+up_client_daemon_proxy_cb (GObject      *source_object,
+			   GAsyncResult *res,
+			   gpointer      user_data)
+{
+	GTask *task = G_TASK (user_data);
+	UpClient *client = g_task_get_source_object (task);
+	GError *error = NULL;
+
+	client->priv->proxy = up_exported_daemon_proxy_new_for_bus_finish (res, &error);
+	if (client->priv->proxy == NULL) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+
+	/* fetch all the devices with their properties in one call */
+	g_dbus_object_manager_client_new_for_bus (G_BUS_TYPE_SYSTEM,
+						  G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
+						  "org.freedesktop.UPower",
+						  UP_DEVICES_DBUS_PATH,
+						  up_client_get_proxy_type,
+						  NULL, NULL,
+						  g_task_get_cancellable (task),
+						  up_client_object_manager_cb,
+						  task);
+}
+
+static void
+up_client_async_initable_init_async (GAsyncInitable      *initable,
+				     int                  io_priority,
+				     GCancellable        *cancellable,
+				     GAsyncReadyCallback  callback,
+				     gpointer             user_data)
+{
+	UpClient *client = UP_CLIENT (initable);
+	GTask *task;
+
+	client->priv = up_client_get_instance_private (client);
+
+	task = g_task_new (initable, cancellable, callback, user_data);
+	g_task_set_source_tag (task, (gpointer) G_STRFUNC);
+	g_task_set_priority (task, io_priority);
+
+	/* connect to main interface, on the main context of the caller
+	 * rather than in a worker thread */
+	up_exported_daemon_proxy_new_for_bus (G_BUS_TYPE_SYSTEM,
+					      G_DBUS_PROXY_FLAGS_NONE,
+					      "org.freedesktop.UPower",
+					      "/org/freedesktop/UPower",
+					      cancellable,
+					      up_client_daemon_proxy_cb,
+					      task);
+}
+
+static gboolean
+up_client_async_initable_init_finish (GAsyncInitable  *initable,
+				      GAsyncResult    *res,
+				      GError         **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, initable), FALSE);
+
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
 static void
 up_client_async_initable_iface_init (GAsyncInitableIface *async_initable_iface)
 {
-  /* Use default */
+	async_initable_iface->init_async = up_client_async_initable_init_async;
+	async_initable_iface->init_finish = up_client_async_initable_init_finish;
 }
 
 static void
@@ -28,15 +28,22 @@
  * when it is changed.
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <glib-object.h>
 #include <string.h>
-
-#include "up-device.h"
-#include "up-device-generated.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gio/gunixfdlist.h>
+
+#include "up-device-private.h"
 #include "up-stats-item.h"
 #include "up-history-item.h"
 
@@ -154,8 +161,6 @@ up_device_set_object_path_sync (UpDevice *device, const gchar *object_path, GCan
 		goto out;
 	}
 
-	g_clear_pointer (&device->priv->offline_props, g_hash_table_unref);
-
 	/* connect to the correct path for all the other methods */
 	proxy_device = up_exported_device_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
 								  G_DBUS_PROXY_FLAGS_NONE,
@@ -166,14 +171,142 @@ up_device_set_object_path_sync (UpDevice *device, const gchar *object_path, GCan
 	if (proxy_device == NULL)
 		return FALSE;
 
+	up_device_set_proxy (device, proxy_device);
+	g_object_unref (proxy_device);
+out:
+	return ret;
+}
+
+static void
+up_device_set_object_path_cb (GObject      *source_object,
+			      GAsyncResult *res,
+			      gpointer      user_data)
+{
+	GTask *task = G_TASK (user_data);
+	UpDevice *device = g_task_get_source_object (task);
+	UpExportedDevice *proxy_device;
+	GError *error = NULL;
+
+	proxy_device = up_exported_device_proxy_new_for_bus_finish (res, &error);
+	if (proxy_device == NULL) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+
+	if (device->priv->proxy_device != NULL) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_EXISTS,
+					 "Object path already set");
+	} else {
+		up_device_set_proxy (device, proxy_device);
+		g_task_return_boolean (task, TRUE);
+	}
+
+	g_object_unref (proxy_device);
+	g_object_unref (task);
+}
+
+/**
+ * up_device_set_object_path_async:
+ * @device: a #UpDevice instance.
+ * @object_path: The UPower object path.
+ * @cancellable: (nullable): a #GCancellable or %NULL
+ * @callback: a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: the data to pass to @callback
+ *
+ * Asynchronously sets the object path of the object and fills up initial
+ * properties. The D-Bus calls are issued on the thread-default main context
+ * of the caller, so that many devices can be set up concurrently.
+ *
+ * Since: 1.91.3
+ **/
+void
+up_device_set_object_path_async (UpDevice            *device,
+				 const gchar         *object_path,
+				 GCancellable        *cancellable,
+				 GAsyncReadyCallback  callback,
+				 gpointer             user_data)
+{
+	GTask *task;
+
+	g_return_if_fail (UP_IS_DEVICE (device));
+	g_return_if_fail (object_path != NULL);
+
+	task = g_task_new (device, cancellable, callback, user_data);
+	g_task_set_source_tag (task, (gpointer) G_STRFUNC);
+
+	if (device->priv->proxy_device != NULL) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_EXISTS,
+					 "Object path already set");
+		g_object_unref (task);
+		return;
+	}
+
+	/* check valid */
+	if (!g_variant_is_object_path (object_path)) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+					 "Object path invalid: %s", object_path);
+		g_object_unref (task);
+		return;
+	}
+
+	up_exported_device_proxy_new_for_bus (G_BUS_TYPE_SYSTEM,
+					      G_DBUS_PROXY_FLAGS_NONE,
+					      "org.freedesktop.UPower",
+					      object_path,
+					      cancellable,
+					      up_device_set_object_path_cb,
+					      task);
+}
+
+/**
+ * up_device_set_object_path_finish:
+ * @device: a #UpDevice instance.
+ * @res: a #GAsyncResult obtained from the #GAsyncReadyCallback passed
+ *     to up_device_set_object_path_async()
+ * @error: return location for error or %NULL
+ *
+ * Finishes an operation started with up_device_set_object_path_async().
+ *
+ * Return value: #TRUE for success, else #FALSE and @error is used
+ *
+ * Since: 1.91.3
+ **/
+gboolean
+up_device_set_object_path_finish (UpDevice      *device,
+				  GAsyncResult  *res,
+				  GError       **error)
+{
+	g_return_val_if_fail (UP_IS_DEVICE (device), FALSE);
+	g_return_val_if_fail (g_task_is_valid (res, device), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/*
+ * up_device_set_proxy:
+ * @device: a #UpDevice instance.
+ * @proxy: the #UpExportedDevice proxy of the D-Bus object.
+ *
+ * Backs the device by a proxy that was already created, for example by
+ * the object manager of #UpClient, which might share it with other
+ * #UpDevice instances.
+ */
+void
+up_device_set_proxy (UpDevice *device, UpExportedDevice *proxy)
+{
+	g_return_if_fail (UP_IS_DEVICE (device));
+	g_return_if_fail (device->priv->proxy_device == NULL);
+
+	g_clear_pointer (&device->priv->offline_props, g_hash_table_unref);
+
 	/* listen to Changed */
-	g_signal_connect (proxy_device, "notify",
+	g_signal_connect (proxy, "notify",
 			  G_CALLBACK (up_device_changed_cb), device);
 
 	/* yay */
-	device->priv->proxy_device = proxy_device;
-out:
-	return ret;
+	device->priv->proxy_device = g_object_ref (proxy);
 }
 
 /**
@@ -542,6 +675,190 @@ out:
 	return array;
 }
 
+/* size of a history record passed by GetHistoryFd */
+#define UP_DEVICE_HISTORY_RECORD_SIZE	16
+
+/*
+ * up_device_get_history_bytes_fallback:
+ *
+ * Packs the result of GetHistory like GetHistoryFd does, for daemons
+ * that do not have the latter.
+ */
+static GBytes *
+up_device_get_history_bytes_fallback (UpDevice *device, const gchar *type, guint timespec, guint resolution, GCancellable *cancellable, GError **error)
+{
+	g_autoptr(GVariant) gva = NULL;
+	g_autoptr(GError) error_local = NULL;
+	GByteArray *array;
+	GVariantIter iter;
+	gdouble value;
+	guint32 time, state;
+
+	if (!up_exported_device_call_get_history_sync (device->priv->proxy_device,
+						       type,
+						       timespec,
+						       resolution,
+						       &gva,
+						       cancellable,
+						       &error_local)) {
+		g_set_error (error, 1, 0, "GetHistory(%s,%i) on %s failed: %s", type, timespec,
+			     up_device_get_object_path (device), error_local->message);
+		return NULL;
+	}
+
+	array = g_byte_array_sized_new (g_variant_n_children (gva) * UP_DEVICE_HISTORY_RECORD_SIZE);
+	g_variant_iter_init (&iter, gva);
+	while (g_variant_iter_next (&iter, "(udu)", &time, &value, &state)) {
+		guint32 time_le = GUINT32_TO_LE (time);
+		guint32 state_le = GUINT32_TO_LE (state);
+		guint64 value_le;
+
+		memcpy (&value_le, &value, sizeof (value_le));
+		value_le = GUINT64_TO_LE (value_le);
+		g_byte_array_append (array, (const guint8 *) &time_le, sizeof (time_le));
+		g_byte_array_append (array, (const guint8 *) &state_le, sizeof (state_le));
+		g_byte_array_append (array, (const guint8 *) &value_le, sizeof (value_le));
+	}
+
+	return g_byte_array_free_to_bytes (array);
+}
+
+#ifdef F_GET_SEALS
+typedef struct {
+	gpointer	 data;
+	gsize		 size;
+} UpDeviceHistoryMapping;
+
+static void
+up_device_history_mapping_free (UpDeviceHistoryMapping *mapping)
+{
+	munmap (mapping->data, mapping->size);
+	g_free (mapping);
+}
+
+/*
+ * up_device_get_history_bytes_memfd:
+ *
+ * Maps the sealed memfd passed by GetHistoryFd, falling back to GetHistory
+ * for daemons that do not have it.
+ */
+static GBytes *
+up_device_get_history_bytes_memfd (UpDevice *device, const gchar *type, guint timespec, guint resolution, GCancellable *cancellable, GError **error)
+{
+	g_autoptr(GVariant) handle = NULL;
+	g_autoptr(GUnixFDList) fd_list = NULL;
+	g_autoptr(GError) error_local = NULL;
+	g_autofree gchar *remote_error = NULL;
+	UpDeviceHistoryMapping *mapping;
+	struct stat st;
+	gpointer data;
+	gint seals;
+	gint fd;
+
+	if (!up_exported_device_call_get_history_fd_sync (device->priv->proxy_device,
+							  type,
+							  timespec,
+							  resolution,
+							  NULL,
+							  &handle,
+							  &fd_list,
+							  cancellable,
+							  &error_local)) {
+		/* older daemons, or ones built without memfd support */
+		remote_error = g_dbus_error_get_remote_error (error_local);
+		if (g_error_matches (error_local, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD) ||
+		    g_strcmp0 (remote_error, "org.freedesktop.UPower.NotSupported") == 0) {
+			return up_device_get_history_bytes_fallback (device, type, timespec, resolution,
+								     cancellable, error);
+		}
+		g_set_error (error, 1, 0, "GetHistoryFd(%s,%i) on %s failed: %s", type, timespec,
+			     up_device_get_object_path (device), error_local->message);
+		return NULL;
+	}
+
+	fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (handle), error);
+	if (fd < 0)
+		return NULL;
+
+	/* a file that can shrink could crash us once mapped */
+	seals = fcntl (fd, F_GET_SEALS);
+	if (seals < 0 ||
+	    (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+		g_set_error_literal (error, 1, 0, "history data is not sealed");
+		close (fd);
+		return NULL;
+	}
+
+	if (fstat (fd, &st) < 0) {
+		g_set_error (error, 1, 0, "failed to read the history data: %s", g_strerror (errno));
+		close (fd);
+		return NULL;
+	}
+	if (st.st_size % UP_DEVICE_HISTORY_RECORD_SIZE != 0) {
+		g_set_error_literal (error, 1, 0, "invalid history data");
+		close (fd);
+		return NULL;
+	}
+	if (st.st_size == 0) {
+		close (fd);
+		return g_bytes_new (NULL, 0);
+	}
+
+	data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (data == MAP_FAILED) {
+		g_set_error (error, 1, 0, "failed to map the history data: %s", g_strerror (errno));
+		return NULL;
+	}
+
+	mapping = g_new0 (UpDeviceHistoryMapping, 1);
+	mapping->data = data;
+	mapping->size = st.st_size;
+	return g_bytes_new_with_free_func (data, st.st_size,
+					   (GDestroyNotify) up_device_history_mapping_free,
+					   mapping);
+}
+#endif
+
+/**
+ * up_device_get_history_bytes_sync:
+ * @device: a #UpDevice instance.
+ * @type: The type of history. Known values are "rate", "charge" and "voltage".
+ * @timespec: the amount of time to look back into time.
+ * @resolution: the resolution of data.
+ * @cancellable: a #GCancellable or %NULL
+ * @error: a #GError, or %NULL.
+ *
+ * Gets the device history as packed records, which avoids creating one
+ * #UpHistoryItem per point for large amounts of data. The data is mapped
+ * from a file descriptor passed by the daemon rather than copied.
+ *
+ * Each record is 16 bytes long and contains, in little endian, the time
+ * in seconds as a #guint32, the state as a #guint32 and the value as a
+ * #gdouble. The records are ordered like the points returned by
+ * up_device_get_history_sync().
+ *
+ * Return value: (transfer full): the records, possibly empty, or %NULL if
+ *               @error is set
+ *
+ * Since: 1.91.3
+ **/
+GBytes *
+up_device_get_history_bytes_sync (UpDevice *device, const gchar *type, guint timespec, guint resolution, GCancellable *cancellable, GError **error)
+{
+	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (device->priv->proxy_device != NULL, NULL);
+
+#ifdef F_GET_SEALS
+	return up_device_get_history_bytes_memfd (device, type, timespec, resolution,
+						  cancellable, error);
+#else
+	/* the file could not be checked to be sealed, so it is never mapped */
+	return up_device_get_history_bytes_fallback (device, type, timespec, resolution,
+						     cancellable, error);
+#endif
+}
+
 /**
  * up_device_get_statistics_sync:
  * @device: a #UpDevice instance.
@@ -83,11 +83,27 @@ GPtrArray	*up_device_get_history_sync		(UpDevice		*device,
 							 guint			 resolution,
 							 GCancellable		*cancellable,
 							 GError			**error);
+GBytes		*up_device_get_history_bytes_sync	(UpDevice		*device,
+							 const gchar		*type,
+							 guint			 timespec,
+							 guint			 resolution,
+							 GCancellable		*cancellable,
+							 GError			**error);
 GPtrArray	*up_device_get_statistics_sync		(UpDevice		*device,
 							 const gchar		*type,
 							 GCancellable		*cancellable,
 							 GError			**error);
 
+/* async versions */
+void		 up_device_set_object_path_async	(UpDevice		*device,
+							 const gchar		*object_path,
+							 GCancellable		*cancellable,
+							 GAsyncReadyCallback	 callback,
+							 gpointer		 user_data);
+gboolean	 up_device_set_object_path_finish	(UpDevice		*device,
+							 GAsyncResult		*res,
+							 GError			**error);
+
 /* accessors */
 const gchar	*up_device_get_object_path		(UpDevice		*device);
 
@@ -26,6 +26,7 @@ import subprocess
 import unittest
 import time
 import re
+import struct
 from output_checker import OutputChecker
 from packaging.version import parse as parse_version
 
@@ -738,6 +739,239 @@ class Tests(dbusmock.DBusTestCase):
         )
         self.stop_daemon()
 
+    def test_object_manager(self):
+        """devices are exported through the ObjectManager interface"""
+
+        self.testbed.add_device(
+            "power_supply", "AC", None, ["type", "Mains", "online", "0"], []
+        )
+        bat0 = self.testbed.add_device(
+            "power_supply",
+            "BAT0",
+            None,
+            [
+                "type",
+                "Battery",
+                "present",
+                "1",
+                "status",
+                "Discharging",
+                "energy_full",
+                "60000000",
+                "energy_full_design",
+                "80000000",
+                "energy_now",
+                "48000000",
+                "voltage_now",
+                "12000000",
+            ],
+            [],
+        )
+
+        self.start_daemon()
+
+        def get_managed_objects():
+            return self.dbus.call_sync(
+                UP,
+                "/org/freedesktop/UPower/devices",
+                "org.freedesktop.DBus.ObjectManager",
+                "GetManagedObjects",
+                None,
+                None,
+                Gio.DBusCallFlags.NO_AUTO_START,
+                -1,
+                None,
+            ).unpack()[0]
+
+        objects = get_managed_objects()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(
+            sorted(objects.keys()), sorted(devs + [UP_DISPLAY_OBJECT_PATH])
+        )
+
+        bat0_up = [d for d in devs if "BAT0" in d][0]
+        props = objects[bat0_up][UP_DEVICE]
+        self.assertEqual(props["Type"], UP_DEVICE_KIND_BATTERY)
+        self.assertEqual(props["NativePath"], "BAT0")
+        self.assertAlmostEqual(props["Percentage"], 80.0)
+        self.assertAlmostEqual(
+            objects[UP_DISPLAY_OBJECT_PATH][UP_DEVICE]["Percentage"], 80.0
+        )
+
+        # removed devices disappear from the object manager as well
+        self.testbed.uevent(bat0, "remove")
+        time.sleep(1)
+        objects = get_managed_objects()
+        self.assertNotIn(bat0_up, objects)
+        self.assertEqual(len(objects), 2)
+
+        self.stop_daemon()
+
+    def test_get_all_devices_state(self):
+        """GetAllDevicesState returns the state of every device"""
+
+        self.testbed.add_device(
+            "power_supply", "AC", None, ["type", "Mains", "online", "0"], []
+        )
+        self.testbed.add_device(
+            "power_supply",
+            "BAT0",
+            None,
+            [
+                "type",
+                "Battery",
+                "present",
+                "1",
+                "status",
+                "Discharging",
+                "energy_full",
+                "60000000",
+                "energy_full_design",
+                "80000000",
+                "energy_now",
+                "48000000",
+                "voltage_now",
+                "12000000",
+            ],
+            [],
+        )
+
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        states = self.proxy.GetAllDevicesState()
+        self.assertEqual(sorted(s[0] for s in states), sorted(devs))
+
+        for state in states:
+            path = state[0]
+            self.assertEqual(state[1], self.get_dbus_dev_property(path, "Type"))
+            self.assertEqual(state[2], self.get_dbus_dev_property(path, "State"))
+            self.assertAlmostEqual(
+                state[3], self.get_dbus_dev_property(path, "Percentage")
+            )
+            self.assertAlmostEqual(state[4], self.get_dbus_dev_property(path, "Energy"))
+            self.assertAlmostEqual(
+                state[5], self.get_dbus_dev_property(path, "EnergyRate")
+            )
+            self.assertEqual(state[6], self.get_dbus_dev_property(path, "TimeToEmpty"))
+            self.assertEqual(state[7], self.get_dbus_dev_property(path, "TimeToFull"))
+            self.assertEqual(state[8], self.get_dbus_dev_property(path, "UpdateTime"))
+
+        bat0 = [s for s in states if s[0].endswith("BAT0")][0]
+        self.assertEqual(bat0[1], UP_DEVICE_KIND_BATTERY)
+        self.assertEqual(bat0[2], UP_DEVICE_STATE_DISCHARGING)
+        self.assertAlmostEqual(bat0[3], 80.0)
+        self.assertAlmostEqual(bat0[4], 48.0)
+
+        self.stop_daemon()
+
+    def test_history_fd(self):
+        """GetHistoryFd returns the same data as GetHistory"""
+
+        self.testbed.add_device(
+            "power_supply",
+            "BAT0",
+            None,
+            [
+                "type",
+                "Battery",
+                "present",
+                "1",
+                "status",
+                "Discharging",
+                "energy_full",
+                "60000000",
+                "energy_full_design",
+                "80000000",
+                "energy_now",
+                "48000000",
+                "voltage_now",
+                "12000000",
+            ],
+            [],
+        )
+
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        history = self.dbus.call_sync(
+            UP,
+            bat0_up,
+            UP_DEVICE,
+            "GetHistory",
+            GLib.Variant("(suu)", ("charge", 0, 0)),
+            None,
+            Gio.DBusCallFlags.NO_AUTO_START,
+            -1,
+            None,
+        ).unpack()[0]
+
+        result, fd_list = self.dbus.call_with_unix_fd_list_sync(
+            UP,
+            bat0_up,
+            UP_DEVICE,
+            "GetHistoryFd",
+            GLib.Variant("(suu)", ("charge", 0, 0)),
+            GLib.VariantType("(h)"),
+            Gio.DBusCallFlags.NO_AUTO_START,
+            -1,
+            None,
+            None,
+        )
+        fd = fd_list.get(result.unpack()[0])
+        with os.fdopen(fd, "rb") as f:
+            data = f.read()
+
+        # packed records of time, state and value
+        self.assertEqual(len(data), 16 * len(history))
+        records = [
+            (time, value, state)
+            for (time, state, value) in struct.iter_unpack("<IId", data)
+        ]
+        self.assertEqual(records, [tuple(h) for h in history])
+
+        self.stop_daemon()
+
+    def test_battery_uevent_values(self):
+        """battery values are read from the uevent file"""
+
+        self.testbed.add_device(
+            "power_supply",
+            "BAT0",
+            None,
+            [
+                "type",
+                "Battery",
+                "present",
+                "1",
+                "energy_full",
+                "60000000",
+                "energy_full_design",
+                "80000000",
+                "voltage_now",
+                "12000000",
+            ],
+            [
+                "POWER_SUPPLY_STATUS",
+                "Discharging",
+                "POWER_SUPPLY_ENERGY_NOW",
+                "48000000",
+            ],
+        )
+
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        self.assertEqual(
+            self.get_dbus_dev_property(bat0_up, "State"), UP_DEVICE_STATE_DISCHARGING
+        )
+        self.assertAlmostEqual(self.get_dbus_dev_property(bat0_up, "Energy"), 48.0)
+        self.assertAlmostEqual(self.get_dbus_dev_property(bat0_up, "Percentage"), 80.0)
+        self.stop_daemon()
+
     def test_nan_percentage_battery_capacity(self):
         """ACPI returns NaN for capacity"""
 
@@ -2945,6 +3179,212 @@ class Tests(dbusmock.DBusTestCase):
         self.assertAlmostEqual(self.get_dbus_dev_property(bat0_up, "EnergyRate"), 0.0)
         self.stop_daemon()
 
+    def test_battery_poll_warning_level(self):
+        """discharging batteries are polled around the next warning level"""
+
+        config = tempfile.NamedTemporaryFile(delete=False, mode="w")
+        config.write("[UPower]\n")
+        config.write("UsePercentageForPolicy=false\n")
+        config.write("TimeLow=1200\n")
+        config.write("TimeCritical=300\n")
+        config.write("TimeAction=120\n")
+        config.close()
+        self.addCleanup(os.unlink, config.name)
+
+        # 1320 seconds to empty, which is 120 seconds above TimeLow
+        bat0 = self.testbed.add_device(
+            "power_supply",
+            "BAT0",
+            None,
+            [
+                "type",
+                "Battery",
+                "present",
+                "1",
+                "status",
+                "Discharging",
+                "energy_full",
+                "60000000",
+                "energy_full_design",
+                "80000000",
+                "energy_now",
+                "4400000",
+                "power_now",
+                "12000000",
+                "voltage_now",
+                "12000000",
+            ],
+            [],
+        )
+
+        self.start_daemon(cfgfile=config.name)
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        # polled again halfway to the low level
+        self.daemon_log.check_line(
+            "Predicted the next warning level change, polling again in 60 seconds",
+            timeout=2,
+        )
+        self.daemon_log.check_line("polling every 60 seconds", timeout=2)
+        self.assertEqual(
+            self.get_dbus_dev_property(bat0_up, "WarningLevel"), UP_DEVICE_LEVEL_NONE
+        )
+
+        # 1080 seconds to empty, the critical level is 780 seconds away
+        self.testbed.set_attribute(bat0, "energy_now", "3600000")
+        self.testbed.uevent(bat0, "change")
+        self.daemon_log.check_line(
+            "Predicted the next warning level change, polling again in 120 seconds",
+            timeout=2,
+        )
+        self.daemon_log.check_line("polling every 120 seconds", timeout=2)
+        self.assertEqual(
+            self.get_dbus_dev_property(bat0_up, "WarningLevel"), UP_DEVICE_LEVEL_LOW
+        )
+
+        self.stop_daemon()
+
+    def test_battery_estimation_restart(self):
+        """the samples for the rate estimation are kept across restarts"""
+
+        energy_now = 48000000
+        bat0 = self.testbed.add_device(
+            "power_supply",
+            "BAT0",
+            None,
+            [
+                "type",
+                "Battery",
+                "present",
+                "1",
+                "status",
+                "Discharging",
+                "energy_full",
+                "60000000",
+                "energy_full_design",
+                "80000000",
+                "energy_now",
+                str(energy_now),
+                "voltage_now",
+                "12000000",
+            ],
+            [],
+        )
+
+        state_dir = tempfile.mkdtemp(prefix="upower-history-")
+        self.start_daemon(history_dir_override=state_dir)
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+        self.assertEqual(self.get_dbus_dev_property(bat0_up, "EnergyRate"), 0.0)
+
+        # discharge at 36W for a few seconds
+        for i in range(4):
+            time.sleep(1)
+            energy_now -= 36.0 * 1000000 / 3600
+            self.testbed.set_attribute(bat0, "energy_now", str(int(energy_now)))
+            self.testbed.uevent(bat0, "change")
+        time.sleep(0.5)
+        self.assertGreater(self.get_dbus_dev_property(bat0_up, "EnergyRate"), 0.0)
+
+        self.stop_daemon()
+        self.daemon_log.check_line_re(r"saved \d+ samples for the estimation to")
+
+        def copy_estimation(src):
+            dst = tempfile.mkdtemp(prefix="upower-history-")
+            for name in os.listdir(src):
+                if name.startswith("estimation-"):
+                    shutil.copy(os.path.join(src, name), dst)
+            return dst
+
+        # the rate is known right away, without new samples
+        state_dir = copy_estimation(state_dir)
+        self.start_daemon(history_dir_override=state_dir)
+        self.daemon_log.check_line_re(
+            r"restored \d+ samples for the estimation from", timeout=2
+        )
+        self.assertGreater(self.get_dbus_dev_property(bat0_up, "EnergyRate"), 0.0)
+        self.stop_daemon()
+
+        # the battery was charged while the daemon was not running
+        self.testbed.set_attribute(bat0, "energy_now", "58000000")
+        state_dir = copy_estimation(state_dir)
+        self.start_daemon(history_dir_override=state_dir)
+        self.daemon_log.check_line("dropping the restored estimation data", timeout=2)
+        self.assertEqual(self.get_dbus_dev_property(bat0_up, "EnergyRate"), 0.0)
+        self.stop_daemon()
+
+    def test_battery_poll_uevents(self):
+        """batteries are polled less often when uevents announce all changes"""
+
+        energy_now = 30000000
+        bat0 = self.testbed.add_device(
+            "power_supply",
+            "BAT0",
+            None,
+            [
+                "type",
+                "Battery",
+                "present",
+                "1",
+                "status",
+                "Charging",
+                "energy_full",
+                "60000000",
+                "energy_full_design",
+                "80000000",
+                "energy_now",
+                str(energy_now),
+                "power_now",
+                "20000000",
+                "voltage_now",
+                "12000000",
+            ],
+            [],
+        )
+
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+        self.daemon_log.check_line("polling every 30 seconds", timeout=2)
+
+        def refresh():
+            self.dbus.call_sync(
+                UP,
+                bat0_up,
+                UP_DEVICE,
+                "Refresh",
+                None,
+                None,
+                Gio.DBusCallFlags.NO_AUTO_START,
+                -1,
+                None,
+            )
+
+        # every change comes with a uevent, and polls find nothing new
+        for i in range(3):
+            energy_now += 100000
+            self.testbed.set_attribute(bat0, "energy_now", str(energy_now))
+            self.testbed.uevent(bat0, "change")
+            time.sleep(0.5)
+        for i in range(10):
+            refresh()
+        self.daemon_log.check_line("polling every 600 seconds", timeout=2)
+
+        # a change that only polling found
+        energy_now += 100000
+        self.testbed.set_attribute(bat0, "energy_now", str(energy_now))
+        refresh()
+        self.daemon_log.check_line(
+            "polling found a change without a uevent (1 so far)", timeout=2
+        )
+        self.daemon_log.check_line("polling every 30 seconds", timeout=2)
+
+        self.stop_daemon()
+
     def test_ups_no_ac(self):
         """UPS properties without AC"""
 
@@ -3750,7 +4190,7 @@ class Tests(dbusmock.DBusTestCase):
 
         # This saves the old history, and then opens a new one
         self.daemon_log.check_line_re(
-            "saved .*/history-time-empty-Fake_Battery-80-001.dat", timeout=1
+            "saved .*/history-Fake_Battery-80-001.bin", timeout=1
         )
         self.daemon_log.check_line("using id: Fake_Battery-90-002", timeout=1)
 
@@ -3763,7 +4203,7 @@ class Tests(dbusmock.DBusTestCase):
 
         # This saves the old history, and does *not* open a new one
         self.daemon_log.check_line_re(
-            "saved .*/history-time-empty-Fake_Battery-90-002.dat", timeout=1
+            "saved .*/history-Fake_Battery-90-002.bin", timeout=1
         )
         self.daemon_log.check_no_line("using id:", wait=1.0)
 
@@ -6040,6 +6480,124 @@ class Tests(dbusmock.DBusTestCase):
         # client.get_devices_async(None, get_devices_cb)
         # ml.run()
 
+    def test_lib_devices_cache(self):
+        """library GI: the device list follows the added and removed signals"""
+
+        self.testbed.add_from_file(
+            os.path.join(edir, "tests/steelseries-headset.device")
+        )
+        card = "/sys/devices/pci0000:00/0000:00:14.0/usb1/1-5/1-5:1.0/sound/card1"
+        self.testbed.set_property(card, "SOUND_INITIALIZED", "1")
+        self.testbed.set_property(card, "SOUND_FORM_FACTOR", "headset")
+        intf = "/sys/devices/pci0000:00/0000:00:14.0/usb1/1-5/1-5:1.3"
+        self.testbed.set_attribute(intf, "wireless_status", "connected")
+
+        self.start_daemon()
+        client = UPowerGlib.Client.new()
+
+        devs = client.get_devices2()
+        self.assertEqual(len(devs), 1)
+        headset = devs[0]
+
+        # the same devices are returned without enumerating them again
+        self.assertIs(client.get_devices2()[0], headset)
+
+        self.testbed.set_attribute(intf, "wireless_status", "disconnected")
+        self.testbed.uevent(intf, "change")
+        self.wait_for_mainloop()
+        self.assertEqual(len(client.get_devices2()), 0)
+
+        self.testbed.set_attribute(intf, "wireless_status", "connected")
+        self.testbed.uevent(intf, "change")
+        self.wait_for_mainloop()
+        devs = client.get_devices2()
+        self.assertEqual(len(devs), 1)
+        self.assertEqual(devs[0].get_object_path(), headset.get_object_path())
+        self.assertAlmostEqual(devs[0].props.percentage, 69.0)
+
+        self.stop_daemon()
+
+    def test_lib_up_device_async(self):
+        """Test up_device_set_object_path_async()"""
+
+        self.testbed.add_device(
+            "power_supply", "AC", None, ["type", "Mains", "online", "1"], []
+        )
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+
+        def set_object_path_cb(obj, res):
+            nonlocal ml
+            self.assertTrue(obj.set_object_path_finish(res))
+            ml.quit()
+
+        device = UPowerGlib.Device.new()
+        ml = GLib.MainLoop()
+        device.set_object_path_async(devs[0], None, set_object_path_cb)
+        ml.run()
+
+        self.assertEqual(device.get_object_path(), devs[0])
+        self.assertEqual(device.props.kind, UP_DEVICE_KIND_LINE_POWER)
+        self.assertEqual(device.props.online, True)
+        self.stop_daemon()
+
+    def test_lib_history_bytes(self):
+        """up_device_get_history_bytes_sync() matches up_device_get_history_sync()"""
+
+        self.testbed.add_device(
+            "power_supply",
+            "BAT0",
+            None,
+            [
+                "type",
+                "Battery",
+                "present",
+                "1",
+                "status",
+                "Discharging",
+                "energy_full",
+                "60000000",
+                "energy_full_design",
+                "80000000",
+                "energy_now",
+                "48000000",
+                "voltage_now",
+                "12000000",
+            ],
+            [],
+        )
+
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+
+        device = UPowerGlib.Device.new()
+        self.assertTrue(device.set_object_path_sync(devs[0], None))
+
+        for timespan, resolution in [(0, 0), (0, 10), (3600, 10)]:
+            items = device.get_history_sync("charge", timespan, resolution, None)
+            data = device.get_history_bytes_sync(
+                "charge", timespan, resolution, None
+            ).get_data()
+
+            # packed records of time, state and value
+            self.assertGreater(len(items), 0)
+            self.assertEqual(len(data), 16 * len(items))
+            records = [
+                (time, value, state)
+                for (time, state, value) in struct.iter_unpack("<IId", data)
+            ]
+            self.assertEqual(
+                records,
+                [
+                    (item.props.time, item.props.value, item.props.state)
+                    for item in items
+                ],
+            )
+
+        self.stop_daemon()
+
     def test_conf_d_support(self):
         """Ensure support for conf.d style directories"""
 
@@ -130,19 +130,15 @@ find_duplicate_device (UpBackend *backend,
 	if (!serial)
 		return NULL;
 
-	array = up_device_list_get_array (backend->priv->device_list);
+	array = up_device_list_lookup_serial (backend->priv->device_list, serial);
 	for (i = 0; i < array->len; i++) {
-		g_autofree char *s = NULL;
 		UpDevice *d;
 
 		d = UP_DEVICE (g_ptr_array_index (array, i));
 		if (d == device)
 			continue;
-		g_object_get (G_OBJECT (d), "serial", &s, NULL);
-		if (s && g_ascii_strcasecmp (s, serial) == 0) {
-			ret = g_object_ref (d);
-			break;
-		}
+		ret = g_object_ref (d);
+		break;
 	}
 	g_ptr_array_unref (array);
 
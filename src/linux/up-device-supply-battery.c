@@ -21,6 +21,7 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
@@ -81,33 +82,154 @@ struct _UpDeviceSupplyBattery
 	gboolean		 charge_threshold_by_charge_type;
 	gboolean		 shown_invalid_voltage_warning;
 	gboolean		 ignore_system_percentage;
+	gboolean		 has_info;
+	UpBatteryInfo		 info;
+	gchar			*vendor;
+	gchar			*model;
+	gchar			*serial;
 };
 
 G_DEFINE_TYPE (UpDeviceSupplyBattery, up_device_supply_battery, UP_TYPE_DEVICE_BATTERY)
 
+/* The values of all attributes as read from the uevent file in one go, the
+ * attributes that are not in there are read one by one. */
+typedef struct {
+	GUdevDevice		*native;
+	GHashTable		*values;	/* attribute name to value */
+} UpSupplySnapshot;
+
+static void
+up_supply_snapshot_init (UpSupplySnapshot *snapshot, GUdevDevice *native)
+{
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	guint i;
+
+	snapshot->native = native;
+	snapshot->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+	filename = g_build_filename (g_udev_device_get_sysfs_path (native), "uevent", NULL);
+	if (!g_file_get_contents (filename, &contents, NULL, NULL))
+		return;
+
+	/* POWER_SUPPLY_ENERGY_NOW=42000000 is the energy_now attribute */
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		const gchar *key = lines[i];
+		gchar *value;
+
+		if (!g_str_has_prefix (key, "POWER_SUPPLY_"))
+			continue;
+		value = strchr (key, '=');
+		if (value == NULL)
+			continue;
+		*value = '\0';
+		key += strlen ("POWER_SUPPLY_");
+		g_hash_table_insert (snapshot->values, g_ascii_strdown (key, -1), g_strdup (value + 1));
+	}
+}
+
+static void
+up_supply_snapshot_clear (UpSupplySnapshot *snapshot)
+{
+	g_clear_pointer (&snapshot->values, g_hash_table_unref);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (UpSupplySnapshot, up_supply_snapshot_clear)
+
+static const gchar *
+up_supply_snapshot_get (UpSupplySnapshot *snapshot, const gchar *key)
+{
+	const gchar *value;
+
+	value = g_hash_table_lookup (snapshot->values, key);
+	if (value != NULL)
+		return value;
+	return g_udev_device_get_sysfs_attr_uncached (snapshot->native, key);
+}
+
+static gboolean
+up_supply_snapshot_has (UpSupplySnapshot *snapshot, const gchar *key)
+{
+	if (g_hash_table_contains (snapshot->values, key))
+		return TRUE;
+	return g_udev_device_has_sysfs_attr (snapshot->native, key);
+}
+
+/* the conversions are the same as the ones of GUdevDevice */
+static gdouble
+up_supply_snapshot_get_double (UpSupplySnapshot *snapshot, const gchar *key)
+{
+	const gchar *value = up_supply_snapshot_get (snapshot, key);
+
+	if (value == NULL)
+		return 0.0;
+	return g_ascii_strtod (value, NULL);
+}
+
+static gint
+up_supply_snapshot_get_int (UpSupplySnapshot *snapshot, const gchar *key)
+{
+	const gchar *value = up_supply_snapshot_get (snapshot, key);
+
+	if (value == NULL)
+		return 0;
+	return strtol (value, NULL, 0);
+}
+
+static gboolean
+up_supply_snapshot_get_boolean (UpSupplySnapshot *snapshot, const gchar *key)
+{
+	g_autofree gchar *value = g_strdup (up_supply_snapshot_get (snapshot, key));
+
+	if (value == NULL)
+		return FALSE;
+	g_strstrip (value);
+	return g_strcmp0 (value, "1") == 0 || g_ascii_strcasecmp (value, "true") == 0;
+}
+
+static char*
+up_supply_snapshot_get_string (UpSupplySnapshot *snapshot, const gchar *key)
+{
+	g_autofree char *value = NULL;
+
+	/* get value, and strip to remove spaces */
+	value = g_strdup (up_supply_snapshot_get (snapshot, key));
+	if (!value)
+		return NULL;
+
+	g_strstrip (value);
+	if (value[0] == '\0')
+		return NULL;
+
+	return g_steal_pointer (&value);
+}
+
 static gdouble
 up_device_supply_battery_get_design_voltage (UpDeviceSupplyBattery *self,
-					     GUdevDevice *native)
+					     UpSupplySnapshot *snapshot)
 {
+	GUdevDevice *native = snapshot->native;
 	gdouble voltage;
 	const gchar *device_type = NULL;
 
 	/* design maximum */
-	voltage = g_udev_device_get_sysfs_attr_as_double_uncached (native, "voltage_max_design") / 1000000.0;
+	voltage = up_supply_snapshot_get_double (snapshot, "voltage_max_design") / 1000000.0;
 	if (voltage > 1.00f) {
 		g_debug ("using max design voltage");
 		return voltage;
 	}
 
 	/* design minimum */
-	voltage = g_udev_device_get_sysfs_attr_as_double_uncached (native, "voltage_min_design") / 1000000.0;
+	voltage = up_supply_snapshot_get_double (snapshot, "voltage_min_design") / 1000000.0;
 	if (voltage > 1.00f) {
 		g_debug ("using min design voltage");
 		return voltage;
 	}
 
 	/* current voltage, alternate form */
-	voltage = g_udev_device_get_sysfs_attr_as_double_uncached (native, "voltage_now") / 1000000.0;
+	voltage = up_supply_snapshot_get_double (snapshot, "voltage_now") / 1000000.0;
 	if (voltage > 1.00f) {
 		g_debug ("using present voltage (alternate)");
 		return voltage;
@@ -136,23 +258,6 @@ up_device_supply_battery_get_design_voltage (UpDeviceSupplyBattery *self,
 	return voltage;
 }
 
-static char*
-get_sysfs_attr_uncached (GUdevDevice *native, const gchar *key)
-{
-	g_autofree char *value = NULL;
-
-	/* get value, and strip to remove spaces */
-	value = g_strdup (g_udev_device_get_sysfs_attr_uncached (native, key));
-	if (!value)
-		return NULL;
-
-	g_strstrip (value);
-	if (value[0] == '\0')
-		return NULL;
-
-	return g_steal_pointer (&value);
-}
-
 static gboolean
 up_device_supply_battery_convert_to_double (const gchar *str_value, gdouble *value)
 {
@@ -380,74 +485,68 @@ up_device_supply_battery_is_charge_threshold_by_charge_type (UpDevice *device) {
 	return FALSE;
 }
 
-static gboolean
-up_device_supply_battery_refresh (UpDevice *device,
-				  UpRefreshReason reason)
+/**
+ * up_device_supply_battery_load_info:
+ *
+ * Reads the attributes that only change when the battery is replaced, or
+ * when the settings of the charge thresholds are changed.
+ **/
+static void
+up_device_supply_battery_load_info (UpDeviceSupplyBattery *self, UpSupplySnapshot *snapshot)
 {
-	UpDeviceSupplyBattery *self = UP_DEVICE_SUPPLY_BATTERY (device);
-	UpDeviceBattery *battery = UP_DEVICE_BATTERY (device);
-	GUdevDevice *native;
-	UpBatteryInfo info = { 0 };
-	UpBatteryValues values = { 0 };
+	UpDevice *device = UP_DEVICE (self);
+	UpBatteryInfo *info = &self->info;
 	g_autofree gchar *vendor = NULL;
 	g_autofree gchar *model = NULL;
 	g_autofree gchar *serial = NULL;
 	g_autofree gchar *technology = NULL;
-	g_autofree gchar *capacity_level = NULL;
-
-	native = G_UDEV_DEVICE (up_device_get_native (device));
 
-	/*
-	 * Reload battery information.
-	 * NOTE: If we assume that a udev event is guaranteed to happen, then
-	 *       we can restrict this to updates other than UP_REFRESH_POLL.
-	 * NOTE: Only energy.full and cycle_count can change for a battery.
-	 */
-	info.present = TRUE;
-	if (g_udev_device_has_sysfs_attr (native, "present"))
-		info.present = g_udev_device_get_sysfs_attr_as_boolean_uncached (native, "present");
-	if (!info.present) {
-		up_device_battery_update_info (battery, &info);
-		return TRUE;
-	}
+	memset (info, 0, sizeof (*info));
+	info->present = TRUE;
 
-	vendor = up_make_safe_string (get_sysfs_attr_uncached (native, "manufacturer"));
-	model = up_make_safe_string (get_sysfs_attr_uncached (native, "model_name"));
-	serial = up_make_safe_string (get_sysfs_attr_uncached (native, "serial_number"));
+	vendor = up_make_safe_string (up_supply_snapshot_get_string (snapshot, "manufacturer"));
+	model = up_make_safe_string (up_supply_snapshot_get_string (snapshot, "model_name"));
+	serial = up_make_safe_string (up_supply_snapshot_get_string (snapshot, "serial_number"));
 
-	info.vendor = vendor;
-	info.model = model;
-	info.serial = serial;
+	g_free (self->vendor);
+	g_free (self->model);
+	g_free (self->serial);
+	self->vendor = g_steal_pointer (&vendor);
+	self->model = g_steal_pointer (&model);
+	self->serial = g_steal_pointer (&serial);
+	info->vendor = self->vendor;
+	info->model = self->model;
+	info->serial = self->serial;
 
-	info.voltage_design = up_device_supply_battery_get_design_voltage (self, native);
-	info.charge_cycles = g_udev_device_get_sysfs_attr_as_int_uncached (native, "cycle_count");
+	info->voltage_design = up_device_supply_battery_get_design_voltage (self, snapshot);
+	info->charge_cycles = up_supply_snapshot_get_int (snapshot, "cycle_count");
 
-	info.units = UP_BATTERY_UNIT_ENERGY;
-	info.energy.full = g_udev_device_get_sysfs_attr_as_double_uncached (native, "energy_full") / 1000000.0;
-	info.energy.design = g_udev_device_get_sysfs_attr_as_double_uncached (native, "energy_full_design") / 1000000.0;
+	info->units = UP_BATTERY_UNIT_ENERGY;
+	info->energy.full = up_supply_snapshot_get_double (snapshot, "energy_full") / 1000000.0;
+	info->energy.design = up_supply_snapshot_get_double (snapshot, "energy_full_design") / 1000000.0;
 
 	/* Assume we couldn't read anything if energy.full is extremely small */
-	if (info.energy.full < 0.01) {
-		info.units = UP_BATTERY_UNIT_CHARGE;
-		info.energy.full = g_udev_device_get_sysfs_attr_as_double_uncached (native, "charge_full") / 1000000.0;
-		info.energy.design = g_udev_device_get_sysfs_attr_as_double_uncached (native, "charge_full_design") / 1000000.0;
+	if (info->energy.full < 0.01) {
+		info->units = UP_BATTERY_UNIT_CHARGE;
+		info->energy.full = up_supply_snapshot_get_double (snapshot, "charge_full") / 1000000.0;
+		info->energy.design = up_supply_snapshot_get_double (snapshot, "charge_full_design") / 1000000.0;
 	}
-	technology = get_sysfs_attr_uncached (native, "technology");
-	info.technology = up_convert_device_technology (technology);
+	technology = up_supply_snapshot_get_string (snapshot, "technology");
+	info->technology = up_convert_device_technology (technology);
 
-	info.voltage_max_design = g_udev_device_get_sysfs_attr_as_double_uncached (native, "voltage_max_design") / 1000000.0;
-	info.voltage_min_design = g_udev_device_get_sysfs_attr_as_double_uncached (native, "voltage_min_design") / 1000000.0;
+	info->voltage_max_design = up_supply_snapshot_get_double (snapshot, "voltage_max_design") / 1000000.0;
+	info->voltage_min_design = up_supply_snapshot_get_double (snapshot, "voltage_min_design") / 1000000.0;
 
-	if (up_device_supply_battery_get_charge_control_limits (native, &info)) {
-		info.charge_control_supported = TRUE;
-		info.charge_control_enabled = FALSE;
+	if (up_device_supply_battery_get_charge_control_limits (snapshot->native, info)) {
+		info->charge_control_supported = TRUE;
+		info->charge_control_enabled = FALSE;
 	} else {
-		info.charge_control_enabled = FALSE;
-		info.charge_control_supported = FALSE;
+		info->charge_control_enabled = FALSE;
+		info->charge_control_supported = FALSE;
 	}
 
 	/* refresh the changes of charge_types */
-	up_device_battery_get_supported_charge_types (device, &info);
+	up_device_battery_get_supported_charge_types (device, info);
 
 	/* Test charge_types attribute, if "Long_Life", "Standard", "Adaptive" or "Fast" are found,
 	 * then set charge_control_supported to TRUE.
@@ -456,10 +555,57 @@ up_device_supply_battery_refresh (UpDevice *device,
 	 * Reviewed-by: Kate Hsuan <hpa@redhat.com> */
 	if (up_device_supply_battery_is_charge_threshold_by_charge_type (device)) {
 		g_debug ("charge_types attribute is found, set charge_control_supported to TRUE");
-		info.charge_control_supported = TRUE;
+		info->charge_control_supported = TRUE;
 		self->charge_threshold_by_charge_type = TRUE;
 	}
 
+	self->has_info = TRUE;
+}
+
+static gboolean
+up_device_supply_battery_refresh (UpDevice *device,
+				  UpRefreshReason reason)
+{
+	UpDeviceSupplyBattery *self = UP_DEVICE_SUPPLY_BATTERY (device);
+	UpDeviceBattery *battery = UP_DEVICE_BATTERY (device);
+	GUdevDevice *native;
+	UpBatteryInfo info = { 0 };
+	UpBatteryValues values = { 0 };
+	g_autofree gchar *capacity_level = NULL;
+	g_autofree gchar *status = NULL;
+	g_auto(UpSupplySnapshot) snapshot = { NULL, };
+
+	native = G_UDEV_DEVICE (up_device_get_native (device));
+
+	/* one read for all the values instead of one for each */
+	up_supply_snapshot_init (&snapshot, native);
+
+	info.present = TRUE;
+	if (up_supply_snapshot_has (&snapshot, "present"))
+		info.present = up_supply_snapshot_get_boolean (&snapshot, "present");
+	if (!info.present) {
+		/* the battery that is inserted next may be another one */
+		self->has_info = FALSE;
+		up_device_battery_update_info (battery, &info);
+		return TRUE;
+	}
+
+	/*
+	 * Reload battery information.
+	 * NOTE: A udev event is sent when it changes, so it is only read
+	 *       again on events and after resuming, not when polling.
+	 * NOTE: Only energy.full and cycle_count can change for a battery.
+	 */
+	if (!self->has_info || (reason != UP_REFRESH_POLL && reason != UP_REFRESH_LINE_POWER))
+		up_device_supply_battery_load_info (self, &snapshot);
+	info = self->info;
+
+	/* the battery wears out */
+	if (info.units == UP_BATTERY_UNIT_ENERGY)
+		info.energy.full = up_supply_snapshot_get_double (&snapshot, "energy_full") / 1000000.0;
+	else
+		info.charge.full = up_supply_snapshot_get_double (&snapshot, "charge_full") / 1000000.0;
+
 	/* NOTE: We used to warn about full > design, but really that is perfectly fine to happen. */
 
 	/* Update the battery information (will only fire events for actual changes) */
@@ -470,11 +616,11 @@ up_device_supply_battery_refresh (UpDevice *device,
 	 */
 	values.units = info.units;
 
-	values.voltage = g_udev_device_get_sysfs_attr_as_double_uncached (native, "voltage_now") / 1000000.0;
+	values.voltage = up_supply_snapshot_get_double (&snapshot, "voltage_now") / 1000000.0;
 	if (values.voltage < 0.01)
-		values.voltage = g_udev_device_get_sysfs_attr_as_double_uncached (native, "voltage_avg") / 1000000.0;
+		values.voltage = up_supply_snapshot_get_double (&snapshot, "voltage_avg") / 1000000.0;
 
-	capacity_level = up_make_safe_string (get_sysfs_attr_uncached (native, "capacity_level"));
+	capacity_level = up_make_safe_string (up_supply_snapshot_get_string (&snapshot, "capacity_level"));
 	values.capacity_level = capacity_level;
 
 	switch (values.units) {
@@ -489,18 +635,18 @@ up_device_supply_battery_refresh (UpDevice *device,
 		 * which's reports energy_now of 15.05 Wh while our calculation
 		 * will be ~16.4Wh by multiplying charge with voltage).
 		 */
-		values.energy.rate = fabs (g_udev_device_get_sysfs_attr_as_double_uncached (native, "current_now") / 1000000.0);
-		values.energy.cur = fabs (g_udev_device_get_sysfs_attr_as_double_uncached (native, "charge_now") / 1000000.0);
+		values.energy.rate = fabs (up_supply_snapshot_get_double (&snapshot, "current_now") / 1000000.0);
+		values.energy.cur = fabs (up_supply_snapshot_get_double (&snapshot, "charge_now") / 1000000.0);
 		break;
 	case UP_BATTERY_UNIT_ENERGY:
-		values.energy.rate = fabs (g_udev_device_get_sysfs_attr_as_double_uncached (native, "power_now") / 1000000.0);
-		values.energy.cur = fabs (g_udev_device_get_sysfs_attr_as_double_uncached (native, "energy_now") / 1000000.0);
+		values.energy.rate = fabs (up_supply_snapshot_get_double (&snapshot, "power_now") / 1000000.0);
+		values.energy.cur = fabs (up_supply_snapshot_get_double (&snapshot, "energy_now") / 1000000.0);
 		if (values.energy.cur < 0.01)
-			values.energy.cur = g_udev_device_get_sysfs_attr_as_double_uncached (native, "energy_avg") / 1000000.0;
+			values.energy.cur = up_supply_snapshot_get_double (&snapshot, "energy_avg") / 1000000.0;
 
 		/* Legacy case: If we have energy units but no power_now, then current_now is in uW. */
 		if (values.energy.rate < 0)
-			values.energy.rate = fabs (g_udev_device_get_sysfs_attr_as_double_uncached (native, "current_now") / 1000000.0);
+			values.energy.rate = fabs (up_supply_snapshot_get_double (&snapshot, "current_now") / 1000000.0);
 		break;
 	default:
 		g_assert_not_reached ();
@@ -512,7 +658,7 @@ up_device_supply_battery_refresh (UpDevice *device,
 	 */
 
 	if (!self->ignore_system_percentage) {
-		values.percentage = g_udev_device_get_sysfs_attr_as_double_uncached (native, "capacity");
+		values.percentage = up_supply_snapshot_get_double (&snapshot, "capacity");
 		if (isnan (values.percentage))
 			values.percentage = 0.0f;
 		values.percentage = CLAMP(values.percentage, 0.0f, 100.0f);
@@ -522,13 +668,14 @@ up_device_supply_battery_refresh (UpDevice *device,
 	 * status = charging but the battery actually discharges when connecting a
 	 * charger. Upower reports the battery is "discharging" when current_now is
 	 * found and is a negative value as long as the battery isn't fully charged.*/
-	values.state = up_device_supply_get_state (native);
+	status = up_supply_snapshot_get_string (&snapshot, "status");
+	values.state = up_device_supply_state_from_string (status);
 
 	if (values.state != UP_DEVICE_STATE_FULLY_CHARGED &&
-	    g_udev_device_get_sysfs_attr_as_double_uncached (native, "current_now") < 0.0)
+	    up_supply_snapshot_get_double (&snapshot, "current_now") < 0.0)
 		values.state = UP_DEVICE_STATE_DISCHARGING;
 
-	values.temperature = g_udev_device_get_sysfs_attr_as_double_uncached (native, "temp") / 10.0;
+	values.temperature = up_supply_snapshot_get_double (&snapshot, "temp") / 10.0;
 
 	up_device_battery_report (battery, &values, reason);
 
@@ -578,6 +725,18 @@ up_device_supply_battery_init (UpDeviceSupplyBattery *self)
 {
 }
 
+static void
+up_device_supply_battery_finalize (GObject *object)
+{
+	UpDeviceSupplyBattery *self = UP_DEVICE_SUPPLY_BATTERY (object);
+
+	g_free (self->vendor);
+	g_free (self->model);
+	g_free (self->serial);
+
+	G_OBJECT_CLASS (up_device_supply_battery_parent_class)->finalize (object);
+}
+
 static void
 up_device_supply_battery_set_property (GObject        *object,
 				       guint           property_id,
@@ -692,6 +851,9 @@ up_device_supply_battery_set_battery_charge_thresholds(UpDevice *device, guint s
 	start_filename = g_build_filename (native_path, "charge_control_start_threshold", NULL);
 	end_filename = g_build_filename (native_path, "charge_control_end_threshold", NULL);
 
+	/* read the limits again on the next refresh */
+	self->has_info = FALSE;
+
 	/* if the charge threshold is controlled by charge_types,
 	 * the charge_types will be set to Long_life when enabling the charge threshold.
 	 * the charge_types will be set to Standard/Adaptive/Fast when disabling the charge threshold. */
@@ -758,6 +920,7 @@ up_device_supply_battery_class_init (UpDeviceSupplyBatteryClass *klass)
 
 	object_class->set_property = up_device_supply_battery_set_property;
 	object_class->get_property = up_device_supply_battery_get_property;
+	object_class->finalize = up_device_supply_battery_finalize;
 	device_class->coldplug = up_device_supply_coldplug;
 	device_class->refresh = up_device_supply_battery_refresh;
 	battery_class->set_battery_charge_thresholds = up_device_supply_battery_set_battery_charge_thresholds;
@@ -167,13 +167,15 @@ out:
 	return value;
 }
 
+/**
+ * up_device_supply_state_from_string:
+ * @status: (nullable): the value of the status attribute
+ **/
 UpDeviceState
-up_device_supply_get_state (GUdevDevice *native)
+up_device_supply_state_from_string (const gchar *status)
 {
 	UpDeviceState state;
-	gchar *status;
 
-	status = up_device_supply_get_string (native, "status");
 	if (status == NULL ||
 	    g_ascii_strcasecmp (status, "unknown") == 0 ||
 	    *status == '\0') {
@@ -193,11 +195,18 @@ up_device_supply_get_state (GUdevDevice *native)
 		state = UP_DEVICE_STATE_UNKNOWN;
 	}
 
-	g_free (status);
-
 	return state;
 }
 
+UpDeviceState
+up_device_supply_get_state (GUdevDevice *native)
+{
+	g_autofree gchar *status = NULL;
+
+	status = up_device_supply_get_string (native, "status");
+	return up_device_supply_state_from_string (status);
+}
+
 static gdouble
 sysfs_get_capacity_level (GUdevDevice   *native,
 			  UpDeviceLevel *level)
@@ -50,6 +50,7 @@ typedef struct
 GType		 up_device_supply_get_type	(void);
 
 UpDeviceState up_device_supply_get_state (GUdevDevice *native);
+UpDeviceState up_device_supply_state_from_string (const gchar *status);
 
 G_END_DECLS
 
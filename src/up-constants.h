@@ -31,6 +31,7 @@ G_BEGIN_DECLS
 #define UP_DAEMON_ESTIMATE_TIMEOUT			   5 /* second */
 #define UP_DAEMON_SHORT_TIMEOUT				  30 /* seconds */
 #define UP_DAEMON_LONG_TIMEOUT				 120 /* seconds */
+#define UP_DAEMON_EVENT_SAFETY_TIMEOUT			 600 /* seconds */
 
 #define UP_DAEMON_DISTRUST_RATE_TIMEOUT			  10 /* second */
 
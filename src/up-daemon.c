@@ -35,6 +35,7 @@
 #include "up-device.h"
 #include "up-device-kbd-backlight.h"
 #include "up-backend.h"
+#include "up-history-writer.h"
 #include "up-daemon.h"
 
 struct UpDaemonPrivate
@@ -45,12 +46,18 @@ struct UpDaemonPrivate
 	UpBackend		*backend;
 	UpDeviceList		*power_devices;
 	UpDeviceList		*kbd_backlight_devices;
+	UpHistoryWriter		*history_writer;
 	guint			 action_timeout_id;
 	guint			 refresh_batteries_id;
 	guint			 warning_level_id;
 	gboolean                 poll_paused;
 	GSource                 *poll_source;
+	GArray			*poll_queue;	/* of UpDaemonPollEntry */
+	GHashTable		*poll_index;	/* device to position in @poll_queue */
+	GArray			*display_entries; /* of UpDaemonDisplayEntry */
+	GHashTable		*display_changed; /* devices to read again */
 	int			 critical_action_lock_fd;
+	GDBusObjectManagerServer *object_manager;
 
 	/* Display battery properties */
 	UpDevice		*display_device;
@@ -87,6 +94,11 @@ static gboolean	up_daemon_get_on_ac_local 	(UpDaemon	*daemon, gboolean *has_ac);
 
 G_DEFINE_TYPE_WITH_PRIVATE (UpDaemon, up_daemon, UP_TYPE_EXPORTED_DAEMON_SKELETON)
 
+/* the device properties the daemon reacts to */
+static GQuark quark_poll_timeout;
+static GQuark quark_last_refresh;
+static GQuark quark_online;
+
 #define UP_DAEMON_ACTION_DELAY				20 /* seconds */
 #define UP_INTERFACE_PREFIX				"org.freedesktop.UPower."
 
@@ -111,24 +123,95 @@ up_daemon_get_number_devices_of_type (UpDaemon *daemon, UpDeviceKind type)
 	guint i;
 	UpDevice *device;
 	GPtrArray *array;
-	UpDeviceKind type_tmp;
 	guint count = 0;
 
-	/* ask each device */
-	array = up_device_list_get_array (daemon->priv->power_devices);
+	/* only look at the devices of that type */
+	array = up_device_list_get_array_of_kind (daemon->priv->power_devices, type);
 	for (i=0; i<array->len; i++) {
 		device = (UpDevice *) g_ptr_array_index (array, i);
-		g_object_get (device,
-			      "type", &type_tmp,
-			      NULL);
-		if (type == type_tmp &&
-		    up_device_get_object_path (device) != NULL)
+		if (up_device_get_object_path (device) != NULL)
 			count++;
 	}
 	g_ptr_array_unref (array);
 	return count;
 }
 
+/* what a device contributes to the display device, in the same order as
+ * @power_devices, so that the properties of the devices that did not change
+ * do not need to be fetched again */
+typedef struct {
+	UpDevice	*device;
+	UpDeviceState	 state;
+	UpDeviceKind	 kind;
+	gboolean	 present;
+	gdouble		 percentage;
+	gdouble		 energy;
+	gdouble		 energy_full;
+	gdouble		 energy_rate;
+	gint64		 time_to_empty;
+	gint64		 time_to_full;
+	gboolean	 power_supply;
+	gboolean	 charge_threshold_enabled;
+} UpDaemonDisplayEntry;
+
+static void
+up_daemon_display_add (UpDaemon *daemon, UpDevice *device)
+{
+	UpDaemonDisplayEntry entry = { NULL, };
+
+	entry.device = g_object_ref (device);
+	g_array_append_val (daemon->priv->display_entries, entry);
+	g_hash_table_add (daemon->priv->display_changed, device);
+}
+
+static void
+up_daemon_display_remove (UpDaemon *daemon, UpDevice *device)
+{
+	GArray *entries = daemon->priv->display_entries;
+	guint i;
+
+	g_hash_table_remove (daemon->priv->display_changed, device);
+	for (i = 0; i < entries->len; i++) {
+		UpDaemonDisplayEntry *entry = &g_array_index (entries, UpDaemonDisplayEntry, i);
+
+		if (entry->device != device)
+			continue;
+		g_object_unref (entry->device);
+		g_array_remove_index (entries, i);
+		return;
+	}
+}
+
+static void
+up_daemon_display_clear (UpDaemon *daemon)
+{
+	GArray *entries = daemon->priv->display_entries;
+	guint i;
+
+	g_hash_table_remove_all (daemon->priv->display_changed);
+	for (i = 0; i < entries->len; i++)
+		g_object_unref (g_array_index (entries, UpDaemonDisplayEntry, i).device);
+	g_array_set_size (entries, 0);
+}
+
+static void
+up_daemon_display_entry_read (UpDaemonDisplayEntry *entry)
+{
+	g_object_get (entry->device,
+		      "is-present", &entry->present,
+		      "type", &entry->kind,
+		      "state", &entry->state,
+		      "percentage", &entry->percentage,
+		      "energy", &entry->energy,
+		      "energy-full", &entry->energy_full,
+		      "energy-rate", &entry->energy_rate,
+		      "time-to-empty", &entry->time_to_empty,
+		      "time-to-full", &entry->time_to_full,
+		      "power-supply", &entry->power_supply,
+		      "charge-threshold-enabled", &entry->charge_threshold_enabled,
+		      NULL);
+}
+
 /**
  * up_daemon_update_display_battery:
  *
@@ -140,7 +223,7 @@ static gboolean
 up_daemon_update_display_battery (UpDaemon *daemon)
 {
 	guint i;
-	GPtrArray *array;
+	GArray *entries = daemon->priv->display_entries;
 
 	UpDeviceKind kind_total = UP_DEVICE_KIND_UNKNOWN;
 	/* Abuse LAST to know if any battery had a state. */
@@ -158,58 +241,36 @@ up_daemon_update_display_battery (UpDaemon *daemon)
 	gboolean state_all_discharging = TRUE;
 	gboolean state_any_discharging = FALSE;
 
-	/* Gather state from each device */
-	array = up_device_list_get_array (daemon->priv->power_devices);
-	for (i = 0; i < array->len; i++) {
-		UpDevice *device;
-
-		UpDeviceState state = UP_DEVICE_STATE_UNKNOWN;
-		UpDeviceKind kind = UP_DEVICE_KIND_UNKNOWN;
-		gboolean present = FALSE;
-		gdouble percentage = 0.0;
-		gdouble energy = 0.0;
-		gdouble energy_full = 0.0;
-		gdouble energy_rate = 0.0;
-		gint64 time_to_empty = 0;
-		gint64 time_to_full = 0;
-		gboolean power_supply = FALSE;
-		gboolean charge_threshold_enabled = FALSE;
-
-		device = g_ptr_array_index (array, i);
-		g_object_get (device,
-			      "is-present", &present,
-			      "type", &kind,
-			      "state", &state,
-			      "percentage", &percentage,
-			      "energy", &energy,
-			      "energy-full", &energy_full,
-			      "energy-rate", &energy_rate,
-			      "time-to-empty", &time_to_empty,
-			      "time-to-full", &time_to_full,
-			      "power-supply", &power_supply,
-			      "charge-threshold-enabled", &charge_threshold_enabled,
-			      NULL);
-
-		if (!present)
+	/* Gather state from each device, only the devices that changed since
+	 * the last time are asked for their properties */
+	for (i = 0; i < entries->len; i++) {
+		UpDaemonDisplayEntry *entry = &g_array_index (entries, UpDaemonDisplayEntry, i);
+		UpDeviceState state;
+
+		if (g_hash_table_remove (daemon->priv->display_changed, entry->device))
+			up_daemon_display_entry_read (entry);
+		state = entry->state;
+
+		if (!entry->present)
 			continue;
 
 		/* When we have a UPS, it's either a desktop, and
 		 * has no batteries, or a laptop, in which case we
 		 * ignore the batteries */
-		if (kind == UP_DEVICE_KIND_UPS) {
-			kind_total = kind;
+		if (entry->kind == UP_DEVICE_KIND_UPS) {
+			kind_total = entry->kind;
 			state_total = state;
-			energy_total = energy;
-			energy_full_total = energy_full;
-			energy_rate_total = energy_rate;
-			time_to_empty_total = time_to_empty;
-			time_to_full_total = time_to_full;
-			percentage_total = percentage;
+			energy_total = entry->energy;
+			energy_full_total = entry->energy_full;
+			energy_rate_total = entry->energy_rate;
+			time_to_empty_total = entry->time_to_empty;
+			time_to_full_total = entry->time_to_full;
+			percentage_total = entry->percentage;
 			is_present_total = TRUE;
 			break;
 		}
-		if (kind != UP_DEVICE_KIND_BATTERY ||
-		    power_supply == FALSE)
+		if (entry->kind != UP_DEVICE_KIND_BATTERY ||
+		    entry->power_supply == FALSE)
 			continue;
 
 		/*
@@ -251,18 +312,18 @@ up_daemon_update_display_battery (UpDaemon *daemon)
 			state_any_discharging = TRUE;
 
 		/* If at least one battery has charge thresholds enabled, propagate that. */
-		charge_threshold_enabled_total = charge_threshold_enabled_total || charge_threshold_enabled;
+		charge_threshold_enabled_total = charge_threshold_enabled_total || entry->charge_threshold_enabled;
 
 		/* sum up composite */
 		kind_total = UP_DEVICE_KIND_BATTERY;
 		is_present_total = TRUE;
-		energy_total += energy;
-		energy_full_total += energy_full;
-		energy_rate_total += energy_rate;
-		time_to_empty_total += time_to_empty;
-		time_to_full_total += time_to_full;
+		energy_total += entry->energy;
+		energy_full_total += entry->energy_full;
+		energy_rate_total += entry->energy_rate;
+		time_to_empty_total += entry->time_to_empty;
+		time_to_full_total += entry->time_to_full;
 		/* Will be recalculated for multiple batteries, no worries */
-		percentage_total += percentage;
+		percentage_total += entry->percentage;
 		num_batteries++;
 	}
 
@@ -282,8 +343,6 @@ up_daemon_update_display_battery (UpDaemon *daemon)
 		percentage_total = percentage_total / num_batteries;
 
 out:
-	g_ptr_array_unref (array);
-
 	/* No battery means LAST state. If we have an UNKNOWN state (with
 	 * a battery) then try to infer one. */
 	if (state_total == UP_DEVICE_STATE_LAST) {
@@ -434,19 +493,11 @@ up_daemon_refresh_battery_devices_idle (UpDaemon *daemon)
 	UpDevice *device;
 
 	/* refresh all devices in array */
-	array = up_device_list_get_array (daemon->priv->power_devices);
+	array = up_device_list_get_power_supply_array (daemon->priv->power_devices);
 	for (i=0; i<array->len; i++) {
-		UpDeviceKind type;
-		gboolean power_supply;
-
 		device = (UpDevice *) g_ptr_array_index (array, i);
 		/* only refresh battery devices */
-		g_object_get (device,
-			      "type", &type,
-			      "power-supply", &power_supply,
-			      NULL);
-		if (type == UP_DEVICE_KIND_BATTERY &&
-		    power_supply)
+		if (up_exported_device_get_type_ (UP_EXPORTED_DEVICE (device)) == UP_DEVICE_KIND_BATTERY)
 			up_device_refresh_internal (device, UP_REFRESH_LINE_POWER);
 	}
 	g_ptr_array_unref (array);
@@ -499,6 +550,47 @@ up_daemon_enumerate_devices (UpExportedDaemon *skeleton,
 	return TRUE;
 }
 
+/**
+ * up_daemon_get_all_devices_state:
+ **/
+static gboolean
+up_daemon_get_all_devices_state (UpExportedDaemon *skeleton,
+				 GDBusMethodInvocation *invocation,
+				 UpDaemon *daemon)
+{
+	GVariantBuilder builder;
+	GPtrArray *array;
+	guint i;
+
+	/* the values that were last published, no need to refresh */
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ouudddxxt)"));
+	array = up_device_list_get_array (daemon->priv->power_devices);
+	for (i = 0; i < array->len; i++) {
+		UpExportedDevice *device = g_ptr_array_index (array, i);
+		const char *object_path;
+
+		object_path = up_device_get_object_path (UP_DEVICE (device));
+		if (object_path == NULL)
+			continue;
+
+		g_variant_builder_add (&builder, "(ouudddxxt)",
+				       object_path,
+				       up_exported_device_get_type_ (device),
+				       up_exported_device_get_state (device),
+				       up_exported_device_get_percentage (device),
+				       up_exported_device_get_energy (device),
+				       up_exported_device_get_energy_rate (device),
+				       up_exported_device_get_time_to_empty (device),
+				       up_exported_device_get_time_to_full (device),
+				       up_exported_device_get_update_time (device));
+	}
+	g_ptr_array_unref (array);
+
+	up_exported_daemon_complete_get_all_devices_state (skeleton, invocation,
+							   g_variant_builder_end (&builder));
+	return TRUE;
+}
+
 static gboolean
 up_daemon_enumerate_kbd_backlights (UpExportedDaemon *skeleton,
 				    GDBusMethodInvocation *invocation,
@@ -578,6 +670,9 @@ up_daemon_register_power_daemon (UpDaemon *daemon,
 		return FALSE;
 	}
 
+	/* export the devices and the ObjectManager interface */
+	g_dbus_object_manager_server_set_connection (daemon->priv->object_manager, connection);
+
 	/* Register the display device */
 	g_initable_init (G_INITABLE (daemon->priv->display_device), NULL, NULL);
 
@@ -630,15 +725,50 @@ out:
 void
 up_daemon_shutdown (UpDaemon *daemon)
 {
+	GPtrArray *array;
+	guint i;
+
 	/* stop accepting new devices and clear backend state */
 	up_backend_unplug (daemon->priv->backend);
 
+	/* keep what the devices learnt for the next start */
+	array = up_device_list_get_array (daemon->priv->power_devices);
+	for (i = 0; i < array->len; i++)
+		up_device_save_state (UP_DEVICE (g_ptr_array_index (array, i)));
+	g_ptr_array_unref (array);
+
 	/* forget about discovered devices */
 	up_device_list_clear (daemon->priv->power_devices);
+	up_daemon_display_clear (daemon);
 	up_device_list_clear (daemon->priv->kbd_backlight_devices);
 
 	/* release UpDaemon reference */
 	g_object_run_dispose (G_OBJECT (daemon->priv->display_device));
+
+	/* write out what has not been saved yet */
+	up_history_writer_flush (daemon->priv->history_writer);
+}
+
+/**
+ * up_daemon_get_object_manager:
+ *
+ * Get the object manager that exports the devices on the bus.
+ **/
+GDBusObjectManagerServer *
+up_daemon_get_object_manager (UpDaemon *daemon)
+{
+	return daemon->priv->object_manager;
+}
+
+/**
+ * up_daemon_get_history_writer:
+ *
+ * Get the writer that saves the history of all devices.
+ **/
+UpHistoryWriter *
+up_daemon_get_history_writer (UpDaemon *daemon)
+{
+	return daemon->priv->history_writer;
 }
 
 /**
@@ -833,6 +963,66 @@ up_daemon_compute_warning_level (UpDaemon      *daemon,
 	g_assert_not_reached ();
 }
 
+/**
+ * up_daemon_get_warning_level_change_time:
+ *
+ * Predicts when the warning level of a discharging device changes next,
+ * assuming that it keeps discharging at the rate that gave @time_to_empty.
+ * This uses the same boundaries as up_daemon_compute_warning_level().
+ *
+ * Returns: the number of seconds, or -1 if it cannot be predicted or the
+ * device is already at the last level.
+ **/
+gint64
+up_daemon_get_warning_level_change_time (UpDaemon      *daemon,
+					 UpDeviceKind   kind,
+					 gboolean       power_supply,
+					 gdouble        percentage,
+					 gint64         time_to_empty)
+{
+	gdouble boundaries[3];
+	guint n_boundaries = G_N_ELEMENTS (boundaries);
+	guint i;
+
+	if (time_to_empty <= 0 || percentage <= 0.0)
+		return -1;
+
+	if (power_supply &&
+	    !daemon->priv->use_percentage_for_policy &&
+	    kind != UP_DEVICE_KIND_MOUSE &&
+	    kind != UP_DEVICE_KIND_KEYBOARD &&
+	    kind != UP_DEVICE_KIND_TOUCHPAD) {
+		/* the time to empty goes down by a second every second */
+		boundaries[0] = daemon->priv->low_time;
+		boundaries[1] = daemon->priv->critical_time;
+		boundaries[2] = daemon->priv->action_time;
+		for (i = 0; i < G_N_ELEMENTS (boundaries); i++) {
+			if (time_to_empty > boundaries[i])
+				return time_to_empty - boundaries[i];
+		}
+		return -1;
+	}
+
+	if (kind == UP_DEVICE_KIND_MOUSE ||
+	    kind == UP_DEVICE_KIND_KEYBOARD ||
+	    kind == UP_DEVICE_KIND_TOUCHPAD) {
+		boundaries[0] = 10.0f;
+		boundaries[1] = 5.0f;
+		n_boundaries = 2;
+	} else {
+		boundaries[0] = daemon->priv->low_percentage;
+		boundaries[1] = daemon->priv->critical_percentage;
+		boundaries[2] = daemon->priv->action_percentage;
+	}
+
+	/* the percentage goes down linearly to zero in @time_to_empty */
+	for (i = 0; i < n_boundaries; i++) {
+		if (percentage > boundaries[i])
+			return time_to_empty * (percentage - boundaries[i]) / percentage;
+	}
+	return -1;
+}
+
 static gboolean
 up_daemon_update_warning_level_idle (UpDaemon *daemon)
 {
@@ -921,31 +1111,198 @@ up_daemon_polkit_is_allowed (UpDaemon *daemon, const gchar *action_id, GDBusMeth
 	return TRUE;
 }
 
+/* the devices that are polled, in a binary min-heap ordered by the time
+ * of their next poll */
+typedef struct {
+	UpDevice	*device;
+	gint64		 poll_time;
+	gint		 timeout;
+} UpDaemonPollEntry;
+
+static inline UpDaemonPollEntry *
+up_daemon_poll_entry (UpDaemon *daemon, guint idx)
+{
+	return &g_array_index (daemon->priv->poll_queue, UpDaemonPollEntry, idx);
+}
+
+/**
+ * up_daemon_poll_swap:
+ **/
+static void
+up_daemon_poll_swap (UpDaemon *daemon, guint a, guint b)
+{
+	UpDaemonPollEntry tmp = *up_daemon_poll_entry (daemon, a);
+
+	*up_daemon_poll_entry (daemon, a) = *up_daemon_poll_entry (daemon, b);
+	*up_daemon_poll_entry (daemon, b) = tmp;
+	g_hash_table_insert (daemon->priv->poll_index, up_daemon_poll_entry (daemon, a)->device, GUINT_TO_POINTER (a));
+	g_hash_table_insert (daemon->priv->poll_index, up_daemon_poll_entry (daemon, b)->device, GUINT_TO_POINTER (b));
+}
+
+/**
+ * up_daemon_poll_sift:
+ *
+ * Moves the entry at @idx to where it belongs after its time changed.
+ **/
+static void
+up_daemon_poll_sift (UpDaemon *daemon, guint idx)
+{
+	GArray *queue = daemon->priv->poll_queue;
+
+	while (idx > 0) {
+		guint parent = (idx - 1) / 2;
+
+		if (up_daemon_poll_entry (daemon, parent)->poll_time <= up_daemon_poll_entry (daemon, idx)->poll_time)
+			break;
+		up_daemon_poll_swap (daemon, parent, idx);
+		idx = parent;
+	}
+
+	for (;;) {
+		guint child = 2 * idx + 1;
+
+		if (child >= queue->len)
+			break;
+		if (child + 1 < queue->len &&
+		    up_daemon_poll_entry (daemon, child + 1)->poll_time < up_daemon_poll_entry (daemon, child)->poll_time)
+			child++;
+		if (up_daemon_poll_entry (daemon, idx)->poll_time <= up_daemon_poll_entry (daemon, child)->poll_time)
+			break;
+		up_daemon_poll_swap (daemon, idx, child);
+		idx = child;
+	}
+}
+
+/**
+ * up_daemon_poll_remove:
+ **/
+static void
+up_daemon_poll_remove (UpDaemon *daemon, UpDevice *device)
+{
+	GArray *queue = daemon->priv->poll_queue;
+	gpointer value;
+	guint idx;
+
+	if (!g_hash_table_lookup_extended (daemon->priv->poll_index, device, NULL, &value))
+		return;
+	idx = GPOINTER_TO_UINT (value);
+	if (idx != queue->len - 1)
+		up_daemon_poll_swap (daemon, idx, queue->len - 1);
+	g_hash_table_remove (daemon->priv->poll_index, device);
+	g_object_unref (up_daemon_poll_entry (daemon, queue->len - 1)->device);
+	g_array_set_size (queue, queue->len - 1);
+	if (idx < queue->len)
+		up_daemon_poll_sift (daemon, idx);
+}
+
+/**
+ * up_daemon_poll_update:
+ *
+ * Puts @device in the queue at the time of its next poll, or takes it out
+ * if it is not polled.
+ **/
+static void
+up_daemon_poll_update (UpDaemon *daemon, UpDevice *device)
+{
+	GArray *queue = daemon->priv->poll_queue;
+	UpDaemonPollEntry *entry;
+	gpointer value;
+	gint timeout;
+	guint idx;
+
+	timeout = up_device_get_poll_timeout (device);
+	if (timeout <= 0) {
+		up_daemon_poll_remove (daemon, device);
+		return;
+	}
+
+	if (g_hash_table_lookup_extended (daemon->priv->poll_index, device, NULL, &value)) {
+		idx = GPOINTER_TO_UINT (value);
+	} else {
+		UpDaemonPollEntry new_entry = { g_object_ref (device), 0, 0 };
+
+		idx = queue->len;
+		g_array_append_val (queue, new_entry);
+		g_hash_table_insert (daemon->priv->poll_index, device, GUINT_TO_POINTER (idx));
+	}
+
+	entry = up_daemon_poll_entry (daemon, idx);
+	entry->timeout = timeout;
+	entry->poll_time = up_device_get_last_refresh (device) + timeout * G_USEC_PER_SEC;
+	up_daemon_poll_sift (daemon, idx);
+}
+
+/**
+ * up_daemon_poll_reschedule:
+ *
+ * Wakes up for the device that is polled next.
+ **/
+static void
+up_daemon_poll_reschedule (UpDaemon *daemon)
+{
+	GArray *queue = daemon->priv->poll_queue;
+
+	if (daemon->priv->poll_paused || queue->len == 0) {
+		g_source_set_ready_time (daemon->priv->poll_source, -1);
+		return;
+	}
+	g_source_set_ready_time (daemon->priv->poll_source,
+				 up_daemon_poll_entry (daemon, 0)->poll_time);
+}
+
+/**
+ * up_daemon_poll_collect:
+ * @start: only entries polled after this time are added
+ * @max_dispatch_timeout: how much earlier than due an entry may be polled
+ *
+ * Adds the devices below @idx in the queue that are polled now. The
+ * subtrees that are entirely later than that are skipped.
+ **/
+static void
+up_daemon_poll_collect (UpDaemon *daemon, guint idx, gint64 now, gint64 start,
+			gint max_dispatch_timeout, GPtrArray *devices)
+{
+	UpDaemonPollEntry *entry;
+	gint64 dispatch_time;
+
+	if (idx >= daemon->priv->poll_queue->len)
+		return;
+	entry = up_daemon_poll_entry (daemon, idx);
+	if (entry->poll_time > now + max_dispatch_timeout * G_USEC_PER_SEC / 2)
+		return;
+
+	dispatch_time = entry->poll_time - MIN(entry->timeout, max_dispatch_timeout) * G_USEC_PER_SEC / 2;
+	if (entry->poll_time > start && now >= dispatch_time)
+		g_ptr_array_add (devices, g_object_ref (entry->device));
+
+	up_daemon_poll_collect (daemon, 2 * idx + 1, now, start, max_dispatch_timeout, devices);
+	up_daemon_poll_collect (daemon, 2 * idx + 2, now, start, max_dispatch_timeout, devices);
+}
+
 /**
  * up_daemon_device_changed_cb:
  **/
 static void
 up_daemon_device_changed_cb (UpDevice *device, GParamSpec *pspec, UpDaemon *daemon)
 {
-	UpDeviceKind type;
-	const char *prop;
+	GQuark prop;
 
 	g_return_if_fail (UP_IS_DAEMON (daemon));
 	g_return_if_fail (UP_IS_DEVICE (device));
 
-	prop = g_param_spec_get_name (pspec);
-	if (!daemon->priv->poll_paused &&
-	    ((g_strcmp0 (prop, "poll-timeout") == 0) ||
-	     (g_strcmp0 (prop, "last-refresh") == 0))) {
-		g_source_set_ready_time (daemon->priv->poll_source, 0);
+	prop = g_param_spec_get_name_quark (pspec);
+	if (prop == quark_poll_timeout || prop == quark_last_refresh) {
+		up_daemon_poll_update (daemon, device);
+		up_daemon_poll_reschedule (daemon);
 		return;
 	}
 
+	/* only this device needs to be looked at again for the display device */
+	g_hash_table_add (daemon->priv->display_changed, device);
+
 	/* refresh battery devices when AC state changes */
-	g_object_get (device,
-		      "type", &type,
-		      NULL);
-	if (type == UP_DEVICE_KIND_LINE_POWER && g_strcmp0 (prop, "online") == 0) {
+	if (prop == quark_online &&
+	    up_exported_device_get_type_ (UP_EXPORTED_DEVICE (device)) == UP_DEVICE_KIND_LINE_POWER) {
 		/* refresh now */
 		up_daemon_refresh_battery_devices (daemon);
 	}
@@ -961,7 +1318,6 @@ up_daemon_poll_dispatch (GSource *source, GSourceFunc callback, gpointer user_da
 	g_autoptr(GPtrArray) array = NULL;
 	guint i;
 	UpDevice *device;
-	gint64 ready_time = G_MAXINT64;
 	gint64 now = g_source_get_time (priv->poll_source);
 	gint max_dispatch_timeout = 0;
 
@@ -971,47 +1327,29 @@ up_daemon_poll_dispatch (GSource *source, GSourceFunc callback, gpointer user_da
 	if (daemon->priv->poll_paused)
 		return G_SOURCE_CONTINUE;
 
-	/* Find the earliest device that needs a refresh. */
-	array = up_device_list_get_array (priv->power_devices);
+	/* Find the devices that need a refresh, they are at the top of the
+	 * queue. */
+	array = g_ptr_array_new_with_free_func (g_object_unref);
+	up_daemon_poll_collect (daemon, 0, now, G_MININT64, 0, array);
 	for (i = 0; i < array->len; i += 1) {
-		gint timeout;
-		gint64 last_refresh;
-		gint64 poll_time;
-		gint64 dispatch_time;
 		device = (UpDevice *) g_ptr_array_index (array, i);
-		g_object_get (device,
-			      "poll-timeout", &timeout,
-			      "last-refresh", &last_refresh,
-			      NULL);
-
-		if (timeout <= 0)
-			continue;
-
-		poll_time = last_refresh + timeout * G_USEC_PER_SEC;
-
-		/* Allow dispatching early if another device got dispatched.
-		 * i.e. device polling will synchronize eventually.
-		 */
-		dispatch_time = poll_time - MIN(timeout, max_dispatch_timeout) * G_USEC_PER_SEC / 2;
-
-		if (now >= dispatch_time) {
-			g_debug ("up_daemon_poll_dispatch: refreshing %s", up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)));
-			up_device_refresh_internal (device, UP_REFRESH_POLL);
-			max_dispatch_timeout = MAX(max_dispatch_timeout, timeout);
+		max_dispatch_timeout = MAX(max_dispatch_timeout, up_device_get_poll_timeout (device));
+	}
 
-			/* We'll wake up again immediately and then
-			 * calculate the correct time to re-poll. */
-		}
+	/* Allow dispatching early if another device got dispatched.
+	 * i.e. device polling will synchronize eventually.
+	 */
+	if (max_dispatch_timeout > 0)
+		up_daemon_poll_collect (daemon, 0, now, now, max_dispatch_timeout, array);
 
-		ready_time = MIN(ready_time, poll_time);
+	/* Refreshing moves the devices further down in the queue. */
+	for (i = 0; i < array->len; i += 1) {
+		device = (UpDevice *) g_ptr_array_index (array, i);
+		g_debug ("up_daemon_poll_dispatch: refreshing %s", up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)));
+		up_device_refresh_internal (device, UP_REFRESH_POLL);
 	}
 
-	if (ready_time == G_MAXINT64)
-		ready_time = -1;
-
-	/* Set the ready time (if it was not modified externally) */
-	if (g_source_get_ready_time (priv->poll_source) == -1)
-		g_source_set_ready_time (priv->poll_source, ready_time);
+	up_daemon_poll_reschedule (daemon);
 
 	return G_SOURCE_CONTINUE;
 }
@@ -1098,10 +1436,12 @@ up_daemon_device_added_cb (UpBackend *backend, GObject *device, UpDaemon *daemon
 		/* power_supply */
 		/* add to device list */
 		up_device_list_insert (priv->power_devices, device);
+		up_daemon_display_add (daemon, UP_DEVICE (device));
 
 		/* connect, so we get changes */
 		g_signal_connect (device, "notify",
 				  G_CALLBACK (up_daemon_device_changed_cb), daemon);
+		up_daemon_poll_update (daemon, UP_DEVICE (device));
 
 		/* emit */
 		object_path = up_device_get_object_path (UP_DEVICE (device));
@@ -1112,7 +1452,7 @@ up_daemon_device_added_cb (UpBackend *backend, GObject *device, UpDaemon *daemon
 		}
 
 		/* Ensure we poll the new device if needed */
-		g_source_set_ready_time (daemon->priv->poll_source, 0);
+		up_daemon_poll_reschedule (daemon);
 
 		g_debug ("emitting added: %s", object_path);
 		up_daemon_update_warning_level (daemon);
@@ -1150,6 +1490,8 @@ up_daemon_device_removed_cb (UpBackend *backend, UpDevice *device, UpDaemon *dae
 	if (UP_IS_DEVICE (device)) {
 		/* remove from list (device remains valid during the function call) */
 		up_device_list_remove (priv->power_devices, device);
+		up_daemon_poll_remove (daemon, device);
+		up_daemon_display_remove (daemon, device);
 		object_path = up_device_get_object_path (device);
 	} else if (UP_IS_DEVICE_KBD_BACKLIGHT (device)) {
 		/* remove from list (device remains valid during the function call) */
@@ -1233,8 +1575,14 @@ up_daemon_init (UpDaemon *daemon)
 	daemon->priv->config = up_config_new ();
 	daemon->priv->power_devices = up_device_list_new ();
 	daemon->priv->kbd_backlight_devices = up_device_list_new ();
+	daemon->priv->history_writer = up_history_writer_new ();
 	daemon->priv->display_device = up_device_new (daemon, NULL);
 	daemon->priv->poll_source = g_source_new (&poll_source_funcs, sizeof (GSource));
+	daemon->priv->poll_queue = g_array_new (FALSE, FALSE, sizeof (UpDaemonPollEntry));
+	daemon->priv->poll_index = g_hash_table_new (g_direct_hash, g_direct_equal);
+	daemon->priv->display_entries = g_array_new (FALSE, FALSE, sizeof (UpDaemonDisplayEntry));
+	daemon->priv->display_changed = g_hash_table_new (g_direct_hash, g_direct_equal);
+	daemon->priv->object_manager = g_dbus_object_manager_server_new ("/org/freedesktop/UPower/devices");
 
 	g_source_set_callback (daemon->priv->poll_source, NULL, daemon, NULL);
 	g_source_set_name (daemon->priv->poll_source, "up-device-poll");
@@ -1259,6 +1607,8 @@ up_daemon_init (UpDaemon *daemon)
 
 	g_signal_connect (daemon, "handle-enumerate-devices",
 			  G_CALLBACK (up_daemon_enumerate_devices), daemon);
+	g_signal_connect (daemon, "handle-get-all-devices-state",
+			  G_CALLBACK (up_daemon_get_all_devices_state), daemon);
 	g_signal_connect (daemon, "handle-enumerate-kbd_backlights",
 				G_CALLBACK (up_daemon_enumerate_kbd_backlights), daemon);
 	g_signal_connect (daemon, "handle-get-critical-action",
@@ -1296,6 +1646,10 @@ up_daemon_class_init (UpDaemonClass *klass)
 {
 	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	object_class->finalize = up_daemon_finalize;
+
+	quark_poll_timeout = g_quark_from_static_string ("poll-timeout");
+	quark_last_refresh = g_quark_from_static_string ("last-refresh");
+	quark_online = g_quark_from_static_string ("online");
 }
 
 /**
@@ -1306,6 +1660,7 @@ up_daemon_finalize (GObject *object)
 {
 	UpDaemon *daemon = UP_DAEMON (object);
 	UpDaemonPrivate *priv = daemon->priv;
+	guint i;
 
 	g_clear_handle_id (&priv->action_timeout_id, g_source_remove);
 	g_clear_handle_id (&priv->refresh_batteries_id, g_source_remove);
@@ -1317,10 +1672,20 @@ up_daemon_finalize (GObject *object)
 	}
 
 	g_clear_pointer (&daemon->priv->poll_source, g_source_destroy);
-
+	for (i = 0; i < priv->poll_queue->len; i++)
+		g_object_unref (up_daemon_poll_entry (daemon, i)->device);
+	g_array_unref (priv->poll_queue);
+	g_hash_table_unref (priv->poll_index);
+	up_daemon_display_clear (daemon);
+	g_array_unref (priv->display_entries);
+	g_hash_table_unref (priv->display_changed);
+
+	g_object_unref (priv->object_manager);
 	g_object_unref (priv->power_devices);
 	g_object_unref (priv->kbd_backlight_devices);
 	g_object_unref (priv->display_device);
+	up_history_writer_flush (priv->history_writer);
+	g_object_unref (priv->history_writer);
 	g_object_unref (priv->polkit);
 	g_object_unref (priv->config);
 	g_object_unref (priv->backend);
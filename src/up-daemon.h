@@ -25,6 +25,7 @@
 
 #include "up-types.h"
 #include "up-device-list.h"
+#include "up-history-writer.h"
 
 G_BEGIN_DECLS
 
@@ -66,6 +67,8 @@ UpDaemon	*up_daemon_new			(void);
 guint		 up_daemon_get_number_devices_of_type (UpDaemon	*daemon,
 						 UpDeviceKind		 type);
 UpDeviceList	*up_daemon_get_device_list	(UpDaemon		*daemon);
+UpHistoryWriter	*up_daemon_get_history_writer	(UpDaemon		*daemon);
+GDBusObjectManagerServer *up_daemon_get_object_manager (UpDaemon		*daemon);
 gboolean	 up_daemon_startup		(UpDaemon		*daemon,
 						 GDBusConnection 	*connection);
 void		 up_daemon_shutdown		(UpDaemon		*daemon);
@@ -83,6 +86,11 @@ UpDeviceLevel	 up_daemon_compute_warning_level(UpDaemon		*daemon,
 						 gboolean		 power_supply,
 						 gdouble		 percentage,
 						 gint64			 time_to_empty);
+gint64		 up_daemon_get_warning_level_change_time (UpDaemon	*daemon,
+						 UpDeviceKind		 kind,
+						 gboolean		 power_supply,
+						 gdouble		 percentage,
+						 gint64			 time_to_empty);
 const gchar	*up_daemon_get_charge_icon	(UpDaemon		*daemon,
 						 gdouble		 percentage,
 						 UpDeviceLevel		 battery_level,
@@ -19,6 +19,8 @@
  */
 
 #include <string.h>
+#include <math.h>
+#include <glib/gstdio.h>
 
 #include "up-constants.h"
 #include "up-config.h"
@@ -26,6 +28,29 @@
 
 /* Chosen to be quite big, in case there was a lot of re-polling */
 #define MAX_ESTIMATION_POINTS 15
+/* Number of samples (including the current one) needed for a rate estimate */
+#define MIN_ESTIMATION_POINTS 3
+/* Below this, the estimated rate is not trusted and we keep re-polling */
+#define MIN_ESTIMATION_CONFIDENCE 0.5
+/* After samples over this many seconds the rate is shown even if they do
+ * not agree on it, e.g. as the energy only changes in coarse steps */
+#define MIN_ESTIMATION_SPAN 15
+/* Saved estimation data older than this is not used anymore */
+#define MAX_ESTIMATION_AGE (10 * 60) /* seconds */
+/* Saved estimation data is dropped if the energy is off by more than this */
+#define MAX_ESTIMATION_ENERGY_ERROR 0.05 /* of energy_full */
+#define ESTIMATION_GROUP "Estimation"
+/* Changes that uevents announced and polls in a row that found nothing
+ * new, before the polling backs off to a safety net */
+#define MIN_ANNOUNCED_CHANGES 3
+#define MIN_QUIET_POLLS 10
+/* Give up on the uevents after polls found this many changes they missed */
+#define MAX_MISSED_CHANGES 3
+
+enum {
+	PROP_0,
+	PROP_RATE_CONFIDENCE
+};
 
 typedef struct {
 	UpBatteryValues hw_data[MAX_ESTIMATION_POINTS];
@@ -48,11 +73,22 @@ typedef struct {
 
 	gboolean trust_power_measurement;
 	gint64 last_power_discontinuity;
+	gdouble rate_confidence;	/* 0 without a rate, 1 if measured */
+	gboolean estimation_restored;	/* not checked against a sample yet */
 
 	/* dynamic values */
 	gint64 fast_repoll_until;
 	gboolean repoll_needed;
 
+	/* whether uevents tell us about all changes */
+	gboolean has_last_values;
+	UpDeviceState last_state;
+	gdouble last_percentage;
+	gdouble last_energy;
+	guint announced_changes;
+	guint quiet_polls;
+	guint missed_changes;
+
 	/* state path */
 	const char *state_dir;
 } UpDeviceBatteryPrivate;
@@ -95,62 +131,162 @@ up_device_battery_charge_to_energy (UpDeviceBattery *self, gdouble charge)
 	return priv->voltage_design * charge;
 }
 
-static void
-up_device_battery_estimate_power (UpDeviceBattery *self, UpBatteryValues *cur)
+/**
+ * up_device_battery_fit_line:
+ * @x: the time of each sample in hours, the newest one being the largest
+ * @y: the energy of each sample in Wh
+ * @n: the number of samples
+ * @slope: (out): the rate in W
+ * @confidence: (out): how much the samples agree on @slope, from 0 to 1
+ *
+ * Fits a line through the samples. Older samples are given less weight,
+ * so that the rate follows changes in the power usage. The weights decay
+ * over the time span of the samples, down to 1/e for the oldest one.
+ *
+ * Returns: %FALSE if there are not enough samples
+ **/
+gboolean
+up_device_battery_fit_line (const gdouble *x,
+			    const gdouble *y,
+			    guint          n,
+			    gdouble       *slope,
+			    gdouble       *confidence)
+{
+	gdouble w[MAX_ESTIMATION_POINTS + 1];
+	gdouble sw = 0.0, sx = 0.0, sy = 0.0;
+	gdouble sxx = 0.0, sxy = 0.0, ssres = 0.0;
+	gdouble mx, my, var_slope, x_min, x_max;
+	guint i;
+
+	if (n < MIN_ESTIMATION_POINTS || n > G_N_ELEMENTS (w))
+		return FALSE;
+
+	x_min = x_max = x[0];
+	for (i = 1; i < n; i++) {
+		x_min = MIN (x_min, x[i]);
+		x_max = MAX (x_max, x[i]);
+	}
+	if (x_max <= x_min)
+		return FALSE;
+
+	/* relative to the first energy, so that equal ones give no slope */
+	for (i = 0; i < n; i++) {
+		w[i] = exp ((x[i] - x_max) / (x_max - x_min));
+		sw += w[i];
+		sx += w[i] * x[i];
+		sy += w[i] * (y[i] - y[0]);
+	}
+	mx = sx / sw;
+	my = sy / sw;
+	for (i = 0; i < n; i++) {
+		sxx += w[i] * (x[i] - mx) * (x[i] - mx);
+		sxy += w[i] * (x[i] - mx) * (y[i] - y[0] - my);
+	}
+	if (sxx <= 0.0)
+		return FALSE;
+
+	*slope = sxy / sxx;
+	for (i = 0; i < n; i++) {
+		gdouble res = y[i] - y[0] - (my + *slope * (x[i] - mx));
+		ssres += w[i] * res * res;
+	}
+
+	/* The confidence is one minus the relative standard error of the
+	 * slope, it is zero when the energy did not change at all. */
+	var_slope = (ssres / sw * n / (n - 2)) / (n * sxx / sw);
+	if (*slope == 0.0)
+		*confidence = 0.0;
+	else
+		*confidence = CLAMP (1.0 - sqrt (var_slope) / ABS (*slope), 0.0, 1.0);
+
+	return TRUE;
+}
+
+/**
+ * up_device_battery_fit_rate:
+ * @span: (out): the time between the oldest sample used and @cur, in seconds
+ *
+ * Fits a line through the energy of the current sample and of the samples
+ * in the ring buffer since the state last changed.
+ *
+ * Returns: %FALSE if there are not enough samples yet
+ **/
+static gboolean
+up_device_battery_fit_rate (UpDeviceBattery *self,
+			    UpBatteryValues *cur,
+			    gdouble         *rate,
+			    gdouble         *confidence,
+			    gdouble         *span)
 {
 	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
-	UpDeviceState reported_state;
-	UpBatteryValues *ref = NULL;
-	gdouble energy_rate = 0.0;
-	gint64 ref_td = 999 * G_USEC_PER_SEC; /* We need to be able to do math with this */
+	gdouble x[MAX_ESTIMATION_POINTS + 1];
+	gdouble y[MAX_ESTIMATION_POINTS + 1];
+	guint n = 0;
 	gint i;
 
-	/* Same item, but it is copied in already. */
-	g_assert (cur->ts_us != priv->hw_data[priv->hw_data_last].ts_us);
-	reported_state = cur->state;
-
-	if (cur->state != UP_DEVICE_STATE_CHARGING &&
-	    cur->state != UP_DEVICE_STATE_DISCHARGING &&
-	    cur->state != UP_DEVICE_STATE_UNKNOWN)
-		return;
+	x[n] = 0.0;
+	y[n] = cur->energy.cur;
+	n++;
 
 	for (i = 0; i < priv->hw_data_len; i++) {
 		int pos = (priv->hw_data_last - i + G_N_ELEMENTS (priv->hw_data)) % G_N_ELEMENTS (priv->hw_data);
-		gint64 td;
 
 		/* Stop searching if the hardware state changed. */
-		if (priv->hw_data[pos].state != reported_state)
+		if (priv->hw_data[pos].state != cur->state)
 			break;
 
-		td = cur->ts_us - priv->hw_data[pos].ts_us;
-		/* At least 15 seconds worth of data. */
-		if (td < 15 * G_USEC_PER_SEC)
-			continue;
+		/* hours before the current sample */
+		x[n] = -(cur->ts_us - priv->hw_data[pos].ts_us) / ((gdouble) 3600 * G_USEC_PER_SEC);
+		y[n] = priv->hw_data[pos].energy.cur;
+		n++;
+	}
+	*span = -x[n - 1] * 3600;
 
-		/* Stop searching if the new reference is further away from the long timeout. */
-		if (ABS(UP_DAEMON_LONG_TIMEOUT * G_USEC_PER_SEC - ABS (td)) > ABS(UP_DAEMON_SHORT_TIMEOUT * G_USEC_PER_SEC - ref_td))
-			break;
+	/* energy is in Wh, rate in W */
+	return up_device_battery_fit_line (x, y, n, rate, confidence);
+}
 
-		ref_td = td;
-		ref = &priv->hw_data[pos];
-	}
+static void
+up_device_battery_estimate_power (UpDeviceBattery *self, UpBatteryValues *cur)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	gdouble energy_rate = 0.0;
+	gdouble confidence = 0.0;
+	gdouble span = 0.0;
+
+	/* Same item, but it is copied in already. */
+	g_assert (cur->ts_us != priv->hw_data[priv->hw_data_last].ts_us);
+
+	priv->rate_confidence = 0.0;
+
+	if (cur->state != UP_DEVICE_STATE_CHARGING &&
+	    cur->state != UP_DEVICE_STATE_DISCHARGING &&
+	    cur->state != UP_DEVICE_STATE_UNKNOWN)
+		return;
 
 	/* We rely solely on battery reports here, with dynamic power
-	 * usage (in particular during resume), lets just wait for a
-	 * bit longer before reporting anything to the user.
+	 * usage (in particular during resume), lets just wait until the
+	 * samples agree on a rate before reporting anything to the user.
 	 *
 	 * Alternatively, we could assume that some old estimate for the
 	 * energy rate remains stable and do a time estimate based on that.
-	 *
-	 * For now, this is better than what we used to do.
 	 */
-	if (!ref) {
+	if (!up_device_battery_fit_rate (self, cur, &energy_rate, &confidence, &span)) {
 		priv->repoll_needed = TRUE;
 		return;
 	}
 
-	/* energy is in Wh, rate in W */
-	energy_rate = (cur->energy.cur - ref->energy.cur) / (ref_td / ((gdouble) 3600 * G_USEC_PER_SEC));
+	g_debug ("Estimated a %fW rate with a confidence of %.2f over %.0f seconds",
+		 energy_rate, confidence, span);
+	if (confidence < MIN_ESTIMATION_CONFIDENCE) {
+		/* more samples help, but only for a while */
+		if (span < MIN_ESTIMATION_SPAN) {
+			priv->repoll_needed = TRUE;
+			return;
+		}
+		g_debug ("The samples do not agree on the rate, using it anyway");
+	}
+	priv->rate_confidence = confidence;
 
 	/* Try to guess charge/discharge state based on rate.
 	 * Note that the history is discarded when the AC is plugged, as such
@@ -181,18 +317,150 @@ up_device_battery_estimate_power (UpDeviceBattery *self, UpBatteryValues *cur)
 	cur->energy.rate = energy_rate;
 }
 
+/**
+ * up_device_battery_get_predictive_timeout:
+ *
+ * Picks the poll timeout of a discharging battery from when its warning
+ * level is expected to change next: polls up to @max_timeout apart while
+ * that is far away, and a poll right after it when it is close.
+ *
+ * Returns: the timeout in seconds, or 0 if it cannot be predicted.
+ **/
+static gint
+up_device_battery_get_predictive_timeout (UpDeviceBattery *self,
+					  UpDaemon        *daemon,
+					  UpBatteryValues *values,
+					  gint64           time_to_empty,
+					  gint             max_timeout)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	UpExportedDevice *skeleton = UP_EXPORTED_DEVICE (self);
+	gint64 change_time;
+
+	/* only trust good estimates */
+	if (priv->rate_confidence < MIN_ESTIMATION_CONFIDENCE)
+		return 0;
+
+	change_time = up_daemon_get_warning_level_change_time (daemon,
+							       up_exported_device_get_type_ (skeleton),
+							       up_exported_device_get_power_supply (skeleton),
+							       values->percentage,
+							       time_to_empty);
+	if (change_time < 0)
+		return 0;
+
+	if (change_time <= UP_DAEMON_SHORT_TIMEOUT)
+		return MAX (change_time + 1, UP_DAEMON_ESTIMATE_TIMEOUT);
+
+	return CLAMP (change_time / 2, UP_DAEMON_SHORT_TIMEOUT, max_timeout);
+}
+
+/**
+ * up_device_battery_learn_events:
+ *
+ * Compares the values with the ones of the last refresh, to learn whether
+ * the driver sends a uevent for every change, or whether polling finds
+ * changes that no uevent announced. This is learnt again for every state,
+ * as drivers may only send uevents while charging, or only on a change of
+ * the state itself.
+ **/
+static void
+up_device_battery_learn_events (UpDeviceBattery *self,
+				UpBatteryValues *values,
+				UpRefreshReason  reason)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	gboolean changed;
+
+	changed = values->state != priv->last_state ||
+		  ABS (values->percentage - priv->last_percentage) > UP_DAEMON_EPSILON ||
+		  ABS (values->energy.cur - priv->last_energy) > UP_DAEMON_EPSILON;
+
+	if (priv->has_last_values && values->state != priv->last_state) {
+		priv->announced_changes = 0;
+		priv->quiet_polls = 0;
+		priv->missed_changes = 0;
+	}
+
+	if (priv->has_last_values && changed) {
+		if (reason == UP_REFRESH_EVENT) {
+			priv->announced_changes++;
+		} else if (reason == UP_REFRESH_POLL) {
+			priv->missed_changes++;
+			priv->quiet_polls = 0;
+			g_debug ("polling found a change without a uevent (%u so far)",
+				 priv->missed_changes);
+		}
+	} else if (priv->has_last_values && reason == UP_REFRESH_POLL) {
+		priv->quiet_polls++;
+	}
+
+	priv->has_last_values = TRUE;
+	priv->last_state = values->state;
+	priv->last_percentage = values->percentage;
+	priv->last_energy = values->energy.cur;
+}
+
+static gboolean
+up_device_battery_events_reliable (UpDeviceBattery *self)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+
+	return priv->missed_changes < MAX_MISSED_CHANGES &&
+	       priv->announced_changes >= MIN_ANNOUNCED_CHANGES &&
+	       priv->quiet_polls >= MIN_QUIET_POLLS;
+}
+
 static void
 up_device_battery_update_poll_frequency (UpDeviceBattery *self,
-					 UpDeviceState    state,
+					 UpBatteryValues *values,
+					 gint64           time_to_empty,
 					 UpRefreshReason  reason)
 {
 	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	UpExportedDevice *skeleton = UP_EXPORTED_DEVICE (self);
+	UpDeviceState state = values->state;
+	UpDaemon *daemon = NULL;
 	gint slow_poll_timeout;
+	gboolean events_reliable;
 
 	if (priv->disable_battery_poll)
 		return;
 
 	slow_poll_timeout = priv->repoll_needed ? UP_DAEMON_ESTIMATE_TIMEOUT : UP_DAEMON_SHORT_TIMEOUT;
+
+	/* The driver tells us about every change, only poll as a safety net */
+	events_reliable = up_device_battery_events_reliable (self);
+	if (!priv->repoll_needed && events_reliable)
+		slow_poll_timeout = UP_DAEMON_EVENT_SAFETY_TIMEOUT;
+
+	if (!priv->repoll_needed && state == UP_DEVICE_STATE_DISCHARGING)
+		daemon = up_device_get_daemon (UP_DEVICE (self));
+	if (daemon != NULL) {
+		UpDeviceLevel warning_level;
+		gint predictive_timeout;
+
+		/* the exported warning level is only updated after the refresh */
+		warning_level = up_daemon_compute_warning_level (daemon,
+								 state,
+								 up_exported_device_get_type_ (skeleton),
+								 up_exported_device_get_power_supply (skeleton),
+								 values->percentage,
+								 time_to_empty);
+
+		/* Also with uevents, as the warning level may change without one */
+		predictive_timeout = up_device_battery_get_predictive_timeout (self, daemon, values, time_to_empty,
+									       MAX (slow_poll_timeout, UP_DAEMON_LONG_TIMEOUT));
+		if (predictive_timeout > 0) {
+			g_debug ("Predicted the next warning level change, polling again in %d seconds",
+				 predictive_timeout);
+			slow_poll_timeout = predictive_timeout;
+		} else if (warning_level == UP_DEVICE_LEVEL_LOW || warning_level == UP_DEVICE_LEVEL_CRITICAL) {
+			/* already low, but no idea when the next level is reached */
+			slow_poll_timeout = MIN (slow_poll_timeout, UP_DAEMON_LONG_TIMEOUT);
+		}
+		g_object_unref (daemon);
+	}
 	priv->repoll_needed = FALSE;
 
 	/* We start fast-polling if the reason to update was not a normal POLL
@@ -218,8 +486,10 @@ up_device_battery_update_poll_frequency (UpDeviceBattery *self,
 		/* Not fast-repolling, check poll timeout is as expected */
 		gint poll_timeout;
 		g_object_get (self, "poll-timeout", &poll_timeout, NULL);
-		if (poll_timeout != slow_poll_timeout)
+		if (poll_timeout != slow_poll_timeout) {
+			g_debug ("polling every %d seconds", slow_poll_timeout);
 			g_object_set (self, "poll-timeout", slow_poll_timeout, NULL);
+		}
 
 	} else if (priv->fast_repoll_until < g_get_monotonic_time ()) {
 		g_debug ("unknown_poll: stopping fast repoll (giving up)");
@@ -228,6 +498,46 @@ up_device_battery_update_poll_frequency (UpDeviceBattery *self,
 	}
 }
 
+/**
+ * up_device_battery_check_restored_estimation:
+ *
+ * Drops the samples restored from a previous instance of the daemon if the
+ * first new sample does not continue them, e.g. because the battery was
+ * charged by the firmware while the daemon was not running.
+ **/
+static void
+up_device_battery_check_restored_estimation (UpDeviceBattery *self, UpBatteryValues *cur)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	UpBatteryValues *last;
+	gdouble expected;
+	gdouble hours;
+
+	if (!priv->estimation_restored)
+		return;
+	priv->estimation_restored = FALSE;
+	if (priv->hw_data_len == 0)
+		return;
+
+	/* assume the last rate was kept up */
+	last = &priv->hw_data[priv->hw_data_last];
+	hours = (cur->ts_us - last->ts_us) / ((gdouble) 3600 * G_USEC_PER_SEC);
+	expected = last->energy.cur;
+	if (last->state == UP_DEVICE_STATE_DISCHARGING)
+		expected -= last->energy.rate * hours;
+	else if (last->state == UP_DEVICE_STATE_CHARGING)
+		expected += last->energy.rate * hours;
+
+	if (ABS (cur->energy.cur - expected) <= priv->energy_full * MAX_ESTIMATION_ENERGY_ERROR)
+		return;
+
+	g_debug ("dropping the restored estimation data, the energy is %.2f Wh instead of %.2f Wh",
+		 cur->energy.cur, expected);
+	priv->hw_data_len = 0;
+	priv->trust_power_measurement = FALSE;
+	priv->rate_confidence = 0.0;
+}
+
 void
 up_device_battery_report (UpDeviceBattery *self,
 			  UpBatteryValues *values,
@@ -316,6 +626,8 @@ up_device_battery_report (UpDeviceBattery *self,
 	if (values->percentage <= 0)
 		values->percentage = values->energy.cur / priv->energy_full * 100;
 
+	up_device_battery_check_restored_estimation (self, values);
+
 	/* NOTE: We used to do more for the UNKNOWN state. However, some of the
 	 * logic relies on only one battery device to be present. Plus, it
 	 * requires knowing the AC state.
@@ -342,6 +654,7 @@ up_device_battery_report (UpDeviceBattery *self,
 		/* QUIRK: Do not trust readings after a discontinuity happened */
 		if (priv->last_power_discontinuity + UP_DAEMON_DISTRUST_RATE_TIMEOUT * G_USEC_PER_SEC > values->ts_us)
 			values->energy.rate = 0.0;
+		priv->rate_confidence = values->energy.rate > 0.01 ? 1.0 : 0.0;
 	} else {
 		up_device_battery_estimate_power (self, values);
 	}
@@ -396,7 +709,8 @@ up_device_battery_report (UpDeviceBattery *self,
 		      "update-time", (guint64) g_get_real_time () / G_USEC_PER_SEC,
 		      NULL);
 
-	up_device_battery_update_poll_frequency (self, values->state, reason);
+	up_device_battery_learn_events (self, values, reason);
+	up_device_battery_update_poll_frequency (self, values, time_to_empty, reason);
 }
 
 static gboolean
@@ -429,6 +743,161 @@ up_device_battery_get_state_dir (UpDeviceBattery *self)
 	return priv->state_dir;
 }
 
+static gchar *
+up_device_battery_get_estimation_filename (UpDeviceBattery *self)
+{
+	g_autofree gchar *id = NULL;
+	g_autofree gchar *basename = NULL;
+
+	id = up_device_get_id (UP_DEVICE (self));
+	if (id == NULL)
+		return NULL;
+
+	basename = g_strdup_printf ("estimation-%s.ini", id);
+	return g_build_filename (up_device_battery_get_state_dir (self), basename, NULL);
+}
+
+/**
+ * up_device_battery_save_estimation:
+ *
+ * Saves the samples used for estimating the rate, so that a restarted
+ * daemon does not need to wait for new ones.
+ **/
+static void
+up_device_battery_save_estimation (UpDeviceBattery *self)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	g_autoptr(GKeyFile) keyfile = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *filename = NULL;
+	gdouble ages[MAX_ESTIMATION_POINTS];
+	gdouble energies[MAX_ESTIMATION_POINTS];
+	gdouble rates[MAX_ESTIMATION_POINTS];
+	gint states[MAX_ESTIMATION_POINTS];
+	gint64 now = g_get_monotonic_time ();
+	gint i;
+
+	if (!priv->present || priv->hw_data_len == 0)
+		return;
+
+	filename = up_device_battery_get_estimation_filename (self);
+	if (filename == NULL)
+		return;
+
+	/* oldest sample first */
+	for (i = 0; i < priv->hw_data_len; i++) {
+		int pos = (priv->hw_data_last - (priv->hw_data_len - 1 - i) + G_N_ELEMENTS (priv->hw_data)) % G_N_ELEMENTS (priv->hw_data);
+
+		ages[i] = (gdouble) (now - priv->hw_data[pos].ts_us) / G_USEC_PER_SEC;
+		energies[i] = priv->hw_data[pos].energy.cur;
+		rates[i] = priv->hw_data[pos].energy.rate;
+		states[i] = priv->hw_data[pos].state;
+	}
+
+	keyfile = g_key_file_new ();
+	g_key_file_set_int64 (keyfile, ESTIMATION_GROUP, "SavedAt", g_get_real_time ());
+	g_key_file_set_double (keyfile, ESTIMATION_GROUP, "EnergyFull", priv->energy_full);
+	g_key_file_set_boolean (keyfile, ESTIMATION_GROUP, "TrustPowerMeasurement", priv->trust_power_measurement);
+	g_key_file_set_double (keyfile, ESTIMATION_GROUP, "RateConfidence", priv->rate_confidence);
+	g_key_file_set_double_list (keyfile, ESTIMATION_GROUP, "Ages", ages, priv->hw_data_len);
+	g_key_file_set_double_list (keyfile, ESTIMATION_GROUP, "Energies", energies, priv->hw_data_len);
+	g_key_file_set_double_list (keyfile, ESTIMATION_GROUP, "Rates", rates, priv->hw_data_len);
+	g_key_file_set_integer_list (keyfile, ESTIMATION_GROUP, "States", states, priv->hw_data_len);
+
+	if (!g_key_file_save_to_file (keyfile, filename, &error))
+		g_debug ("failed to save the estimation data: %s", error->message);
+	else
+		g_debug ("saved %d samples for the estimation to %s", priv->hw_data_len, filename);
+}
+
+/**
+ * up_device_battery_load_estimation:
+ *
+ * Restores the samples saved by a previous instance of the daemon, if they
+ * are recent enough to still say something about the battery and were
+ * saved for a battery of the same capacity. The file is removed, as the
+ * samples are only useful once.
+ **/
+static void
+up_device_battery_load_estimation (UpDeviceBattery *self)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	g_autoptr(GKeyFile) keyfile = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gdouble *ages = NULL;
+	g_autofree gdouble *energies = NULL;
+	g_autofree gdouble *rates = NULL;
+	g_autofree gint *states = NULL;
+	gsize n_ages, n_energies, n_rates, n_states;
+	gint64 now = g_get_monotonic_time ();
+	gint64 age;
+	gdouble energy_full;
+	gsize i;
+
+	filename = up_device_battery_get_estimation_filename (self);
+	if (filename == NULL)
+		return;
+
+	keyfile = g_key_file_new ();
+	if (!g_key_file_load_from_file (keyfile, filename, G_KEY_FILE_NONE, &error)) {
+		g_debug ("failed to load the estimation data: %s", error->message);
+		return;
+	}
+	g_unlink (filename);
+
+	age = g_get_real_time () - g_key_file_get_int64 (keyfile, ESTIMATION_GROUP, "SavedAt", NULL);
+	if (age < 0 || age > MAX_ESTIMATION_AGE * G_USEC_PER_SEC) {
+		g_debug ("ignoring the estimation data in %s, it is too old", filename);
+		return;
+	}
+
+	ages = g_key_file_get_double_list (keyfile, ESTIMATION_GROUP, "Ages", &n_ages, NULL);
+	energies = g_key_file_get_double_list (keyfile, ESTIMATION_GROUP, "Energies", &n_energies, NULL);
+	rates = g_key_file_get_double_list (keyfile, ESTIMATION_GROUP, "Rates", &n_rates, NULL);
+	states = g_key_file_get_integer_list (keyfile, ESTIMATION_GROUP, "States", &n_states, NULL);
+	if (ages == NULL || energies == NULL || rates == NULL || states == NULL ||
+	    n_ages == 0 || n_ages > MAX_ESTIMATION_POINTS ||
+	    n_energies != n_ages || n_rates != n_ages || n_states != n_ages) {
+		g_debug ("ignoring the invalid estimation data in %s", filename);
+		return;
+	}
+
+	/* a different battery, or the firmware recalibrated it */
+	energy_full = g_key_file_get_double (keyfile, ESTIMATION_GROUP, "EnergyFull", NULL);
+	if (ABS (energy_full - priv->energy_full) > priv->energy_full * MAX_ESTIMATION_ENERGY_ERROR) {
+		g_debug ("ignoring the estimation data in %s, saved for %.2f Wh instead of %.2f Wh",
+			 filename, energy_full, priv->energy_full);
+		return;
+	}
+	for (i = 0; i < n_ages; i++) {
+		if (energies[i] < 0.0 || energies[i] > energy_full * (1.0 + MAX_ESTIMATION_ENERGY_ERROR)) {
+			g_debug ("ignoring the estimation data in %s, an energy is out of range", filename);
+			return;
+		}
+	}
+
+	priv->hw_data_len = 0;
+	for (i = 0; i < n_ages; i++) {
+		UpBatteryValues *values;
+
+		priv->hw_data_last = (priv->hw_data_last + 1) % G_N_ELEMENTS (priv->hw_data);
+		priv->hw_data_len = MIN (priv->hw_data_len + 1, G_N_ELEMENTS (priv->hw_data));
+		values = &priv->hw_data[priv->hw_data_last];
+		memset (values, 0, sizeof (*values));
+		values->ts_us = now - age - (gint64) (ages[i] * G_USEC_PER_SEC);
+		values->state = states[i];
+		values->units = UP_BATTERY_UNIT_ENERGY;
+		values->energy.cur = energies[i];
+		values->energy.rate = rates[i];
+	}
+	priv->trust_power_measurement = g_key_file_get_boolean (keyfile, ESTIMATION_GROUP, "TrustPowerMeasurement", NULL);
+	priv->rate_confidence = g_key_file_get_double (keyfile, ESTIMATION_GROUP, "RateConfidence", NULL);
+	priv->estimation_restored = TRUE;
+
+	g_debug ("restored %d samples for the estimation from %s", priv->hw_data_len, filename);
+}
+
 static gboolean
 up_device_battery_get_battery_charge_threshold_config(UpDeviceBattery *self)
 {
@@ -519,9 +988,10 @@ up_device_battery_update_info (UpDeviceBattery *self, UpBatteryInfo *info)
 		gdouble energy_full;
 		gdouble energy_design;
 		gint charge_cycles;
+		gboolean plugged = !priv->present;
 
 		/* See above, we have a (new) battery plugged in. */
-		if (!priv->present) {
+		if (plugged) {
 			/* Set up battery charging threshold when a new battery was plugged in */
 			up_device_battery_recover_battery_charging_threshold (self, info, &charge_threshold_enabled);
 
@@ -587,11 +1057,18 @@ up_device_battery_update_info (UpDeviceBattery *self, UpBatteryInfo *info)
 			              NULL);
 		}
 
+		/* The ID is only known now, continue from where the last
+		 * instance of the daemon left off */
+		if (plugged)
+			up_device_battery_load_estimation (self);
+
 		/* NOTE: Assume a normal refresh will follow immediately (do not update timestamp). */
 	} else {
 		priv->present = FALSE;
 		priv->trust_power_measurement = FALSE;
 		priv->hw_data_len = 0;
+		priv->rate_confidence = 0.0;
+		priv->estimation_restored = FALSE;
 		priv->units = UP_BATTERY_UNIT_UNDEFINED;
 
 		g_object_set (self,
@@ -728,10 +1205,44 @@ up_device_battery_init (UpDeviceBattery *self)
 			  G_CALLBACK (up_device_battery_set_charge_threshold), self);
 }
 
+static void
+up_device_battery_save_state (UpDevice *device)
+{
+	up_device_battery_save_estimation (UP_DEVICE_BATTERY (device));
+}
+
+static void
+up_device_battery_get_property (GObject    *object,
+				guint       property_id,
+				GValue     *value,
+				GParamSpec *pspec)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (UP_DEVICE_BATTERY (object));
+
+	switch (property_id) {
+	case PROP_RATE_CONFIDENCE:
+		g_value_set_double (value, priv->rate_confidence);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+	}
+}
+
 static void
 up_device_battery_class_init (UpDeviceBatteryClass *klass)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	UpDeviceClass *device_class = UP_DEVICE_CLASS (klass);
 
+	object_class->get_property = up_device_battery_get_property;
 	device_class->get_on_battery = up_device_battery_get_on_battery;
+	device_class->save_state = up_device_battery_save_state;
+
+	/* how much the samples agree on the estimated energy rate, for
+	 * debugging; 1 if the rate is measured and 0 without a rate */
+	g_object_class_install_property (object_class, PROP_RATE_CONFIDENCE,
+					 g_param_spec_double ("rate-confidence",
+							      "Rate confidence",
+							      "Confidence in the energy rate",
+							      0.0, 1.0, 0.0, G_PARAM_READABLE));
 }
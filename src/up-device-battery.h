@@ -104,5 +104,6 @@ typedef struct {
 
 void up_device_battery_update_info (UpDeviceBattery *self, UpBatteryInfo *info);
 void up_device_battery_report (UpDeviceBattery *self, UpBatteryValues *values, UpRefreshReason reason);
+gboolean up_device_battery_fit_line (const gdouble *x, const gdouble *y, guint n, gdouble *slope, gdouble *confidence);
 
 G_END_DECLS
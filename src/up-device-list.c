@@ -36,10 +36,100 @@ struct UpDeviceListPrivate
 {
 	GPtrArray		*array;
 	GHashTable		*map_native_path_to_device;
+	GHashTable		*map_device_to_entry;
+	/* indexes of the power devices, kept in sync when the devices change */
+	GPtrArray		*kind_index[UP_DEVICE_KIND_LAST];
+	GHashTable		*serial_index;		/* lowercase serial to GPtrArray */
+	GPtrArray		*power_supply_index;
 };
 
+/* what a device is currently indexed under */
+typedef struct {
+	gchar			*native_path;
+	UpDeviceKind		 kind;
+	gchar			*serial;
+	gboolean		 power_supply;
+} UpDeviceListEntry;
+
 G_DEFINE_TYPE_WITH_PRIVATE (UpDeviceList, up_device_list, G_TYPE_OBJECT)
 
+static void
+up_device_list_entry_free (UpDeviceListEntry *entry)
+{
+	g_free (entry->native_path);
+	g_free (entry->serial);
+	g_free (entry);
+}
+
+/**
+ * up_device_list_unindex:
+ *
+ * Removes a power device from the indexes it is in.
+ **/
+static void
+up_device_list_unindex (UpDeviceList *list, UpDevice *device, UpDeviceListEntry *entry)
+{
+	GPtrArray *array;
+
+	if (entry->kind < UP_DEVICE_KIND_LAST)
+		g_ptr_array_remove (list->priv->kind_index[entry->kind], device);
+
+	if (entry->serial != NULL) {
+		array = g_hash_table_lookup (list->priv->serial_index, entry->serial);
+		g_ptr_array_remove (array, device);
+		if (array->len == 0)
+			g_hash_table_remove (list->priv->serial_index, entry->serial);
+		g_clear_pointer (&entry->serial, g_free);
+	}
+
+	if (entry->power_supply)
+		g_ptr_array_remove (list->priv->power_supply_index, device);
+}
+
+/**
+ * up_device_list_index:
+ *
+ * Adds a power device to the indexes for its current properties.
+ **/
+static void
+up_device_list_index (UpDeviceList *list, UpDevice *device, UpDeviceListEntry *entry)
+{
+	UpExportedDevice *skeleton = UP_EXPORTED_DEVICE (device);
+	const gchar *serial;
+	GPtrArray *array;
+
+	entry->kind = up_exported_device_get_type_ (skeleton);
+	if (entry->kind < UP_DEVICE_KIND_LAST)
+		g_ptr_array_add (list->priv->kind_index[entry->kind], device);
+
+	serial = up_exported_device_get_serial (skeleton);
+	if (serial != NULL) {
+		entry->serial = g_ascii_strdown (serial, -1);
+		array = g_hash_table_lookup (list->priv->serial_index, entry->serial);
+		if (array == NULL) {
+			array = g_ptr_array_new ();
+			g_hash_table_insert (list->priv->serial_index, g_strdup (entry->serial), array);
+		}
+		g_ptr_array_add (array, device);
+	}
+
+	entry->power_supply = up_exported_device_get_power_supply (skeleton);
+	if (entry->power_supply)
+		g_ptr_array_add (list->priv->power_supply_index, device);
+}
+
+static void
+up_device_list_device_changed_cb (UpDevice *device, GParamSpec *pspec, UpDeviceList *list)
+{
+	UpDeviceListEntry *entry;
+
+	entry = g_hash_table_lookup (list->priv->map_device_to_entry, device);
+	g_return_if_fail (entry != NULL);
+
+	up_device_list_unindex (list, device, entry);
+	up_device_list_index (list, device, entry);
+}
+
 /**
  * up_device_list_lookup:
  *
@@ -66,6 +156,70 @@ up_device_list_lookup (UpDeviceList *list, GObject *native)
 	return g_object_ref (device);
 }
 
+/**
+ * up_device_list_lookup_serial:
+ *
+ * Finds the power devices with the @serial, ignoring the case.
+ *
+ * Return value: the devices, free with g_ptr_array_unref()
+ **/
+GPtrArray *
+up_device_list_lookup_serial (UpDeviceList *list, const gchar *serial)
+{
+	g_autofree gchar *key = NULL;
+	GPtrArray *array;
+
+	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), NULL);
+	g_return_val_if_fail (serial != NULL, NULL);
+
+	key = g_ascii_strdown (serial, -1);
+	array = g_hash_table_lookup (list->priv->serial_index, key);
+	if (array == NULL)
+		return g_ptr_array_new_with_free_func (g_object_unref);
+	array = g_ptr_array_copy (array, (GCopyFunc) g_object_ref, NULL);
+	g_ptr_array_set_free_func (array, g_object_unref);
+	return array;
+}
+
+/**
+ * up_device_list_get_array_of_kind:
+ *
+ * Gets the power devices of one kind, without resolving the kind of all of them.
+ *
+ * Return value: the array, free with g_ptr_array_unref()
+ **/
+GPtrArray *
+up_device_list_get_array_of_kind (UpDeviceList *list, UpDeviceKind kind)
+{
+	GPtrArray *array;
+
+	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), NULL);
+	g_return_val_if_fail (kind < UP_DEVICE_KIND_LAST, NULL);
+
+	array = g_ptr_array_copy (list->priv->kind_index[kind], (GCopyFunc) g_object_ref, NULL);
+	g_ptr_array_set_free_func (array, g_object_unref);
+	return array;
+}
+
+/**
+ * up_device_list_get_power_supply_array:
+ *
+ * Gets the power devices that power the whole system.
+ *
+ * Return value: the array, free with g_ptr_array_unref()
+ **/
+GPtrArray *
+up_device_list_get_power_supply_array (UpDeviceList *list)
+{
+	GPtrArray *array;
+
+	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), NULL);
+
+	array = g_ptr_array_copy (list->priv->power_supply_index, (GCopyFunc) g_object_ref, NULL);
+	g_ptr_array_set_free_func (array, g_object_unref);
+	return array;
+}
+
 /**
  * up_device_list_insert:
  *
@@ -77,6 +231,7 @@ up_device_list_insert (UpDeviceList *list, gpointer device)
 {
 	GObject *native;
 	const gchar *native_path;
+	UpDeviceListEntry *entry;
 
 	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), FALSE);
 	g_return_val_if_fail (device != NULL, FALSE);
@@ -95,21 +250,22 @@ up_device_list_insert (UpDeviceList *list, gpointer device)
 	g_hash_table_insert (list->priv->map_native_path_to_device,
 			     g_strdup (native_path), g_object_ref (device));
 	g_ptr_array_add (list->priv->array, g_object_ref (device));
-	g_debug ("added %s", native_path);
-	return TRUE;
-}
 
-/**
- * up_device_list_remove_cb:
- **/
-static gboolean
-up_device_list_remove_cb (gpointer key, gpointer value, gpointer user_data)
-{
-	if (value == user_data) {
-		g_debug ("removed %s", (char *) key);
-		return TRUE;
+	entry = g_new0 (UpDeviceListEntry, 1);
+	entry->native_path = g_strdup (native_path);
+	g_hash_table_insert (list->priv->map_device_to_entry, device, entry);
+	if (UP_IS_DEVICE (device)) {
+		up_device_list_index (list, UP_DEVICE (device), entry);
+		g_signal_connect (device, "notify::type",
+				  G_CALLBACK (up_device_list_device_changed_cb), list);
+		g_signal_connect (device, "notify::serial",
+				  G_CALLBACK (up_device_list_device_changed_cb), list);
+		g_signal_connect (device, "notify::power-supply",
+				  G_CALLBACK (up_device_list_device_changed_cb), list);
 	}
-	return FALSE;
+
+	g_debug ("added %s", native_path);
+	return TRUE;
 }
 
 /**
@@ -118,12 +274,24 @@ up_device_list_remove_cb (gpointer key, gpointer value, gpointer user_data)
 gboolean
 up_device_list_remove (UpDeviceList *list, gpointer device)
 {
+	UpDeviceListEntry *entry;
+
 	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), FALSE);
 	g_return_val_if_fail (device != NULL, FALSE);
 
 	/* remove the device from the db */
-	g_hash_table_foreach_remove (list->priv->map_native_path_to_device,
-				     up_device_list_remove_cb, device);
+	entry = g_hash_table_lookup (list->priv->map_device_to_entry, device);
+	if (entry != NULL) {
+		if (UP_IS_DEVICE (device)) {
+			g_signal_handlers_disconnect_by_func (device, up_device_list_device_changed_cb, list);
+			up_device_list_unindex (list, UP_DEVICE (device), entry);
+		}
+		if (g_hash_table_lookup (list->priv->map_native_path_to_device, entry->native_path) == device) {
+			g_debug ("removed %s", entry->native_path);
+			g_hash_table_remove (list->priv->map_native_path_to_device, entry->native_path);
+		}
+		g_hash_table_remove (list->priv->map_device_to_entry, device);
+	}
 	g_ptr_array_remove (list->priv->array, device);
 
 	/* we're removed the last instance? */
@@ -144,8 +312,21 @@ up_device_list_remove (UpDeviceList *list, gpointer device)
 void
 up_device_list_clear (UpDeviceList *list)
 {
+	GHashTableIter iter;
+	gpointer device;
+	guint i;
+
 	g_return_if_fail (UP_IS_DEVICE_LIST (list));
 
+	g_hash_table_iter_init (&iter, list->priv->map_device_to_entry);
+	while (g_hash_table_iter_next (&iter, &device, NULL))
+		g_signal_handlers_disconnect_by_func (device, up_device_list_device_changed_cb, list);
+	g_hash_table_remove_all (list->priv->map_device_to_entry);
+	for (i = 0; i < UP_DEVICE_KIND_LAST; i++)
+		g_ptr_array_set_size (list->priv->kind_index[i], 0);
+	g_hash_table_remove_all (list->priv->serial_index);
+	g_ptr_array_set_size (list->priv->power_supply_index, 0);
+
 	g_hash_table_remove_all (list->priv->map_native_path_to_device);
 	g_ptr_array_set_size (list->priv->array, 0);
 }
@@ -182,9 +363,18 @@ up_device_list_class_init (UpDeviceListClass *klass)
 static void
 up_device_list_init (UpDeviceList *list)
 {
+	guint i;
+
 	list->priv = up_device_list_get_instance_private (list);
 	list->priv->array = g_ptr_array_new_with_free_func (g_object_unref);
 	list->priv->map_native_path_to_device = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+	list->priv->map_device_to_entry = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+								 NULL, (GDestroyNotify) up_device_list_entry_free);
+	for (i = 0; i < UP_DEVICE_KIND_LAST; i++)
+		list->priv->kind_index[i] = g_ptr_array_new ();
+	list->priv->serial_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+							  g_free, (GDestroyNotify) g_ptr_array_unref);
+	list->priv->power_supply_index = g_ptr_array_new ();
 }
 
 /**
@@ -195,11 +385,18 @@ static void
 up_device_list_finalize (GObject *object)
 {
 	UpDeviceList *list;
+	guint i;
 
 	g_return_if_fail (UP_IS_DEVICE_LIST (object));
 
 	list = UP_DEVICE_LIST (object);
 
+	up_device_list_clear (list);
+	for (i = 0; i < UP_DEVICE_KIND_LAST; i++)
+		g_ptr_array_unref (list->priv->kind_index[i]);
+	g_hash_table_unref (list->priv->serial_index);
+	g_ptr_array_unref (list->priv->power_supply_index);
+	g_hash_table_unref (list->priv->map_device_to_entry);
 	g_ptr_array_unref (list->priv->array);
 	g_hash_table_unref (list->priv->map_native_path_to_device);
 
@@ -55,12 +55,17 @@ UpDeviceList	*up_device_list_new			(void);
 
 GObject		*up_device_list_lookup			(UpDeviceList		*list,
 							 GObject		*native);
+GPtrArray	*up_device_list_lookup_serial		(UpDeviceList		*list,
+							 const gchar		*serial);
 gboolean	 up_device_list_insert			(UpDeviceList		*list,
 							 gpointer		 device);
 gboolean	 up_device_list_remove			(UpDeviceList		*list,
 							 gpointer		 device);
 void		 up_device_list_clear			(UpDeviceList		*list);
 GPtrArray	*up_device_list_get_array		(UpDeviceList		*list);
+GPtrArray	*up_device_list_get_array_of_kind	(UpDeviceList		*list,
+							 UpDeviceKind		 kind);
+GPtrArray	*up_device_list_get_power_supply_array	(UpDeviceList		*list);
 
 G_END_DECLS
 
@@ -19,19 +19,27 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <glib/gi18n-lib.h>
 #include <glib-object.h>
+#include <gio/gunixfdlist.h>
 
 #include "up-native.h"
 #include "up-device.h"
 #include "up-history.h"
-#include "up-history-item.h"
 #include "up-stats-item.h"
 
 typedef struct
@@ -50,8 +58,20 @@ typedef struct
 	 * its value is "disconnected"
 	 * See https://www.kernel.org/doc/html/latest/driver-api/usb/usb.html#c.usb_interface */
 	gboolean		disconnected;
+
+	/* TRUE while in up_device_refresh_internal(), the updates that
+	 * depend on the changed properties are only done once at the end */
+	gboolean		refreshing;
+	guint			pending_updates;
 } UpDevicePrivate;
 
+typedef enum {
+	UP_DEVICE_UPDATE_HISTORY_ID	= 1 << 0,
+	UP_DEVICE_UPDATE_ICON_NAME	= 1 << 1,
+	UP_DEVICE_UPDATE_WARNING_LEVEL	= 1 << 2,
+	UP_DEVICE_UPDATE_HISTORY	= 1 << 3,
+} UpDeviceUpdate;
+
 static void up_device_initable_iface_init (GInitableIface *iface);
 
 G_DEFINE_TYPE_EXTENDED (UpDevice, up_device, UP_TYPE_EXPORTED_DEVICE_SKELETON, 0,
@@ -71,9 +91,25 @@ enum {
 
 static GParamSpec *properties[N_PROPS];
 
-#define UP_DEVICES_DBUS_PATH "/org/freedesktop/UPower/devices"
+/* The properties of the exported interface that other properties depend on */
+enum {
+  EXPORTED_PROP_TYPE,
+  EXPORTED_PROP_IS_PRESENT,
+  EXPORTED_PROP_VENDOR,
+  EXPORTED_PROP_MODEL,
+  EXPORTED_PROP_SERIAL,
+  EXPORTED_PROP_POWER_SUPPLY,
+  EXPORTED_PROP_TIME_TO_EMPTY,
+  EXPORTED_PROP_STATE,
+  EXPORTED_PROP_PERCENTAGE,
+  EXPORTED_PROP_BATTERY_LEVEL,
+  EXPORTED_PROP_UPDATE_TIME,
+  N_EXPORTED_PROPS
+};
+
+static GParamSpec *exported_properties[N_EXPORTED_PROPS];
 
-static gchar * up_device_get_id (UpDevice *device);
+#define UP_DEVICES_DBUS_PATH "/org/freedesktop/UPower/devices"
 
 /* This needs to be called when one of those properties changes:
  * state
@@ -178,6 +214,8 @@ ensure_history (UpDevice *device)
 		return;
 
 	priv->history = up_history_new ();
+	if (priv->daemon != NULL)
+		up_history_set_writer (priv->history, up_daemon_get_history_writer (priv->daemon));
 	id = up_device_get_id (device);
 	if (id)
 		up_history_set_id (priv->history, id);
@@ -216,12 +254,33 @@ update_history (UpDevice *device)
 	up_history_set_voltage_data (priv->history, up_exported_device_get_voltage (skeleton));
 }
 
+static void
+up_device_run_updates (UpDevice *device, guint updates)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	g_autofree gchar *id = NULL;
+
+	if (updates & UP_DEVICE_UPDATE_HISTORY_ID) {
+		/* Clearing the history object for lazily loading when device id was changed. */
+		id = up_device_get_id (device);
+		if (priv->history != NULL &&
+		    !up_history_is_device_id_equal (priv->history, id))
+			g_clear_object (&priv->history);
+	}
+	if (updates & UP_DEVICE_UPDATE_ICON_NAME)
+		update_icon_name (device);
+	if (updates & UP_DEVICE_UPDATE_WARNING_LEVEL)
+		update_warning_level (device);
+	if (updates & UP_DEVICE_UPDATE_HISTORY)
+		update_history (device);
+}
+
 static void
 up_device_notify (GObject *object, GParamSpec *pspec)
 {
 	UpDevice *device = UP_DEVICE (object);
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
-	g_autofree gchar *id = NULL;
+	guint updates = 0;
 
 	/* Not finished setting up the object? */
 	if (priv->daemon == NULL)
@@ -229,32 +288,28 @@ up_device_notify (GObject *object, GParamSpec *pspec)
 
 	G_OBJECT_CLASS (up_device_parent_class)->notify (object, pspec);
 
-	id = up_device_get_id (device);
-
-	if (g_strcmp0 (pspec->name, "type") == 0 ||
-	    g_strcmp0 (pspec->name, "is-present") == 0) {
-		update_icon_name (device);
-		/* Clearing the history object for lazily loading when device id was changed. */
-		if (priv->history != NULL &&
-		    !up_history_is_device_id_equal (priv->history, id))
-			g_clear_object (&priv->history);
-	} else if (g_strcmp0 (pspec->name, "vendor") == 0 ||
-		   g_strcmp0 (pspec->name, "model") == 0 ||
-		   g_strcmp0 (pspec->name, "serial") == 0) {
-		if (priv->history != NULL &&
-		    !up_history_is_device_id_equal (priv->history, id))
-			g_clear_object (&priv->history);
-	} else if (g_strcmp0 (pspec->name, "power-supply") == 0 ||
-		   g_strcmp0 (pspec->name, "time-to-empty") == 0) {
-		update_warning_level (device);
-	} else if (g_strcmp0 (pspec->name, "state") == 0 ||
-		   g_strcmp0 (pspec->name, "percentage") == 0 ||
-		   g_strcmp0 (pspec->name, "battery-level") == 0) {
-		update_warning_level (device);
-		update_icon_name (device);
-	} else if (g_strcmp0 (pspec->name, "update-time") == 0) {
-		update_history (device);
+	if (pspec == exported_properties[EXPORTED_PROP_TYPE] ||
+	    pspec == exported_properties[EXPORTED_PROP_IS_PRESENT]) {
+		updates = UP_DEVICE_UPDATE_HISTORY_ID | UP_DEVICE_UPDATE_ICON_NAME;
+	} else if (pspec == exported_properties[EXPORTED_PROP_VENDOR] ||
+		   pspec == exported_properties[EXPORTED_PROP_MODEL] ||
+		   pspec == exported_properties[EXPORTED_PROP_SERIAL]) {
+		updates = UP_DEVICE_UPDATE_HISTORY_ID;
+	} else if (pspec == exported_properties[EXPORTED_PROP_POWER_SUPPLY] ||
+		   pspec == exported_properties[EXPORTED_PROP_TIME_TO_EMPTY]) {
+		updates = UP_DEVICE_UPDATE_WARNING_LEVEL;
+	} else if (pspec == exported_properties[EXPORTED_PROP_STATE] ||
+		   pspec == exported_properties[EXPORTED_PROP_PERCENTAGE] ||
+		   pspec == exported_properties[EXPORTED_PROP_BATTERY_LEVEL]) {
+		updates = UP_DEVICE_UPDATE_WARNING_LEVEL | UP_DEVICE_UPDATE_ICON_NAME;
+	} else if (pspec == exported_properties[EXPORTED_PROP_UPDATE_TIME]) {
+		updates = UP_DEVICE_UPDATE_HISTORY;
 	}
+
+	if (priv->refreshing)
+		priv->pending_updates |= updates;
+	else if (updates != 0)
+		up_device_run_updates (device, updates);
 }
 
 /**
@@ -293,6 +348,22 @@ up_device_get_online (UpDevice *device, gboolean *online)
 	return klass->get_online (device, online);
 }
 
+/**
+ * up_device_save_state:
+ *
+ * Writes out what the device wants to keep across restarts of the daemon.
+ **/
+void
+up_device_save_state (UpDevice *device)
+{
+	UpDeviceClass *klass = UP_DEVICE_GET_CLASS (device);
+
+	g_return_if_fail (UP_IS_DEVICE (device));
+
+	if (klass->save_state != NULL)
+		klass->save_state (device);
+}
+
 /**
  * up_device_get_id:
  *
@@ -300,7 +371,7 @@ up_device_get_online (UpDevice *device, gboolean *online)
  * Note: The caller of the method takes ownership of the returned data, and is
  * responsible for freeing it.
  **/
-static gchar *
+gchar *
 up_device_get_id (UpDevice *device)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
@@ -403,6 +474,32 @@ up_device_get_daemon (UpDevice *device)
 	return g_object_ref (priv->daemon);
 }
 
+/**
+ * up_device_get_poll_timeout:
+ *
+ * Same as the "poll-timeout" property, without the GValue.
+ **/
+gint
+up_device_get_poll_timeout (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	return priv->poll_timeout;
+}
+
+/**
+ * up_device_get_last_refresh:
+ *
+ * Same as the "last-refresh" property, without the GValue.
+ **/
+gint64
+up_device_get_last_refresh (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	return priv->last_refresh;
+}
+
 /**
  * up_device_polkit_is_allowed
  **/
@@ -424,17 +521,23 @@ up_device_export_skeleton (UpDevice *device,
 			   const gchar *object_path)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
-	GError *error = NULL;
-
-	g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (device),
-					  g_dbus_interface_skeleton_get_connection (G_DBUS_INTERFACE_SKELETON (priv->daemon)),
-					  object_path,
-					  &error);
-
-	if (error != NULL) {
-		g_critical ("error registering device on system bus: %s", error->message);
-		g_error_free (error);
+	GDBusObjectManagerServer *manager;
+	g_autoptr(GDBusObject) existing = NULL;
+	g_autoptr(GDBusObjectSkeleton) object = NULL;
+
+	/* export through the object manager, so that clients can fetch
+	 * all the devices and their properties in a single call */
+	manager = up_daemon_get_object_manager (priv->daemon);
+	existing = g_dbus_object_manager_get_object (G_DBUS_OBJECT_MANAGER (manager), object_path);
+	if (existing != NULL) {
+		g_critical ("error registering device on system bus: %s is already exported",
+			    object_path);
+		return;
 	}
+
+	object = g_dbus_object_skeleton_new (object_path);
+	g_dbus_object_skeleton_add_interface (object, G_DBUS_INTERFACE_SKELETON (device));
+	g_dbus_object_manager_server_export (manager, object);
 }
 
 static gchar *
@@ -479,8 +582,11 @@ up_device_compute_object_path (UpDevice *device)
 gboolean
 up_device_register (UpDevice *device)
 {
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
 	g_autofree char *computed_object_path = NULL;
 
+	if (priv->daemon == NULL)
+		return FALSE;
 	if (g_dbus_interface_skeleton_get_object_path (G_DBUS_INTERFACE_SKELETON (device)) != NULL)
 		return FALSE;
 	computed_object_path = up_device_compute_object_path (device);
@@ -492,11 +598,16 @@ up_device_register (UpDevice *device)
 void
 up_device_unregister (UpDevice *device)
 {
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
 	g_autofree char *object_path = NULL;
 
+	if (priv->daemon == NULL)
+		return;
+
 	object_path = g_strdup (g_dbus_interface_skeleton_get_object_path (G_DBUS_INTERFACE_SKELETON (device)));
 	if (object_path != NULL) {
-		g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (device));
+		g_dbus_object_manager_server_unexport (up_daemon_get_object_manager (priv->daemon),
+						       object_path);
 		g_debug ("Unexported UpDevice with path %s", object_path);
 	}
 }
@@ -578,36 +689,53 @@ up_device_initable_iface_init (GInitableIface *iface)
   iface->init = up_device_initable_init;
 }
 
-static gboolean
-up_device_get_statistics (UpExportedDevice *skeleton,
-			  GDBusMethodInvocation *invocation,
-			  const gchar *type,
-			  UpDevice *device)
+/* a GetStatistics or GetHistory call waiting for the history to be loaded */
+typedef struct {
+	UpDevice		*device;
+	GDBusMethodInvocation	*invocation;
+	UpHistoryType		 type;
+	gboolean		 charging;
+	guint			 timespan;
+	guint			 resolution;
+	gboolean		 use_fd;
+} UpDeviceHistoryRequest;
+
+static UpDeviceHistoryRequest *
+up_device_history_request_new (UpDevice *device, GDBusMethodInvocation *invocation)
 {
-	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpDeviceHistoryRequest *request = g_new0 (UpDeviceHistoryRequest, 1);
+
+	request->device = g_object_ref (device);
+	request->invocation = g_object_ref (invocation);
+	return request;
+}
+
+static void
+up_device_history_request_free (UpDeviceHistoryRequest *request)
+{
+	g_object_unref (request->device);
+	g_object_unref (request->invocation);
+	g_free (request);
+}
+
+static void
+up_device_get_statistics_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	UpHistory *history = UP_HISTORY (source_object);
+	UpDeviceHistoryRequest *request = user_data;
 	GPtrArray *array = NULL;
 	UpStatsItem *item;
 	guint i;
 	GVariantBuilder builder;
 
-	if (!up_exported_device_get_has_statistics (skeleton)) {
-		g_dbus_method_invocation_return_error_literal (invocation,
-							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
-							       "device does not support getting stats");
-		goto out;
-	}
-
-	ensure_history (device);
+	up_history_load_finish (history, res, NULL);
 
 	/* get the correct data */
-	if (g_strcmp0 (type, "charging") == 0)
-		array = up_history_get_profile_data (priv->history, TRUE);
-	else if (g_strcmp0 (type, "discharging") == 0)
-		array = up_history_get_profile_data (priv->history, FALSE);
+	array = up_history_get_profile_data (history, request->charging);
 
 	/* maybe the device doesn't support histories */
 	if (array == NULL) {
-		g_dbus_method_invocation_return_error_literal (invocation,
+		g_dbus_method_invocation_return_error_literal (request->invocation,
 							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
 							       "device has no statistics");
 		goto out;
@@ -615,7 +743,7 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 
 	/* always 101 items of data */
 	if (array->len != 101) {
-		g_dbus_method_invocation_return_error (invocation,
+		g_dbus_method_invocation_return_error (request->invocation,
 						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
 						       "statistics invalid as have %i items", array->len);
 		goto out;
@@ -630,35 +758,212 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 				       up_stats_item_get_accuracy (item));
 	}
 
-	up_exported_device_complete_get_statistics (skeleton, invocation,
+	up_exported_device_complete_get_statistics (UP_EXPORTED_DEVICE (request->device),
+						    request->invocation,
 						    g_variant_builder_end (&builder));
 out:
 	if (array != NULL)
 		g_ptr_array_unref (array);
-	return TRUE;
+	up_device_history_request_free (request);
 }
 
 static gboolean
-up_device_get_history (UpExportedDevice *skeleton,
-		       GDBusMethodInvocation *invocation,
-		       const gchar *type_string,
-		       guint timespan,
-		       guint resolution,
-		       UpDevice *device)
+up_device_get_statistics (UpExportedDevice *skeleton,
+			  GDBusMethodInvocation *invocation,
+			  const gchar *type,
+			  UpDevice *device)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
-	GPtrArray *array = NULL;
-	UpHistoryItem *item;
-	guint i;
-	UpHistoryType type = UP_HISTORY_TYPE_UNKNOWN;
+	UpDeviceHistoryRequest *request;
+
+	if (!up_exported_device_get_has_statistics (skeleton)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting stats");
+		return TRUE;
+	}
+
+	/* something recognized */
+	if (g_strcmp0 (type, "charging") != 0 && g_strcmp0 (type, "discharging") != 0) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no statistics");
+		return TRUE;
+	}
+
+	ensure_history (device);
+
+	/* the history is read from disk in the background */
+	request = up_device_history_request_new (device, invocation);
+	request->charging = g_strcmp0 (type, "charging") == 0;
+	up_history_load_async (priv->history, NULL, up_device_get_statistics_cb, request);
+	return TRUE;
+}
+
+/* one element of the GetHistoryFd data, in little endian */
+typedef struct {
+	guint32			 time;
+	guint32			 state;
+	guint64			 value;	/* bits of the gdouble */
+} UpDeviceHistoryRecord;
+
+G_STATIC_ASSERT (sizeof (UpDeviceHistoryRecord) == 16);
+
+static void
+up_device_history_add_record_cb (guint time, gdouble value, UpDeviceState state, gpointer user_data)
+{
+	UpDeviceHistoryRecord record;
+	guint64 bits;
+
+	memcpy (&bits, &value, sizeof (bits));
+	record.time = GUINT32_TO_LE (time);
+	record.state = GUINT32_TO_LE (state);
+	record.value = GUINT64_TO_LE (bits);
+	g_array_append_val (user_data, record);
+}
+
+static void
+up_device_history_add_variant_cb (guint time, gdouble value, UpDeviceState state, gpointer user_data)
+{
+	g_variant_builder_add (user_data, "(udu)", time, value, state);
+}
+
+/**
+ * up_device_history_to_memfd:
+ *
+ * Writes the history records to a sealed memfd, so that clients can map
+ * it rather than unpack one GVariant per point.
+ *
+ * Return value: the file descriptor, or -1 with @error set
+ **/
+static gint
+up_device_history_to_memfd (GArray *records, GError **error)
+{
+#ifdef HAVE_MEMFD_CREATE
+	gpointer data;
+	gsize size;
+	gint fd;
+
+	fd = memfd_create ("upower-history", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		goto error;
+
+	size = records->len * sizeof (UpDeviceHistoryRecord);
+	if (size > 0) {
+		if (ftruncate (fd, size) < 0)
+			goto error;
+		data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+			goto error;
+		memcpy (data, records->data, size);
+		munmap (data, size);
+	}
+
+	/* the client can map it without fearing changes */
+	if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		goto error;
+
+	return fd;
+
+error:
+	g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		     "Failed to create the history memfd: %s", g_strerror (errno));
+	if (fd >= 0)
+		close (fd);
+	return -1;
+#else
+	g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			     "Passing the history as a file descriptor is not supported");
+	return -1;
+#endif
+}
+
+static void
+up_device_get_history_fd_complete (UpDeviceHistoryRequest *request, GArray *records)
+{
+	g_autoptr(GUnixFDList) fd_list = NULL;
+	g_autoptr(GError) error = NULL;
+	gint fd;
+
+	fd = up_device_history_to_memfd (records, &error);
+	if (fd < 0) {
+		g_dbus_method_invocation_return_error_literal (request->invocation,
+							       UP_DAEMON_ERROR,
+							       g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED) ?
+							       UP_DAEMON_ERROR_NOT_SUPPORTED : UP_DAEMON_ERROR_GENERAL,
+							       error->message);
+		return;
+	}
+
+	fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+	up_exported_device_complete_get_history_fd (UP_EXPORTED_DEVICE (request->device),
+						    request->invocation,
+						    fd_list,
+						    g_variant_new_handle (0));
+}
+
+static void
+up_device_get_history_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	UpHistory *history = UP_HISTORY (source_object);
+	UpDeviceHistoryRequest *request = user_data;
+	g_autoptr(GArray) records = NULL;
 	GVariantBuilder builder;
+	gboolean ret;
+
+	up_history_load_finish (history, res, NULL);
+
+	/* the points are added as they are found, without an object for each */
+	if (request->use_fd) {
+		records = g_array_new (FALSE, FALSE, sizeof (UpDeviceHistoryRecord));
+		ret = up_history_foreach_data (history, request->type, request->timespan, request->resolution,
+					       up_device_history_add_record_cb, records);
+	} else {
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(udu)"));
+		ret = up_history_foreach_data (history, request->type, request->timespan, request->resolution,
+					       up_device_history_add_variant_cb, &builder);
+	}
+
+	/* maybe the device doesn't have any history */
+	if (!ret) {
+		if (!request->use_fd)
+			g_variant_builder_clear (&builder);
+		g_dbus_method_invocation_return_error_literal (request->invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		goto out;
+	}
+
+	if (request->use_fd) {
+		up_device_get_history_fd_complete (request, records);
+		goto out;
+	}
+
+	up_exported_device_complete_get_history (UP_EXPORTED_DEVICE (request->device),
+						 request->invocation,
+						 g_variant_builder_end (&builder));
+out:
+	up_device_history_request_free (request);
+}
+
+static void
+up_device_start_history_request (UpDevice *device,
+				 GDBusMethodInvocation *invocation,
+				 const gchar *type_string,
+				 guint timespan,
+				 guint resolution,
+				 gboolean use_fd)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpDeviceHistoryRequest *request;
+	UpHistoryType type = UP_HISTORY_TYPE_UNKNOWN;
 
 	/* doesn't even try to support this */
-	if (!up_exported_device_get_has_history (skeleton)) {
+	if (!up_exported_device_get_has_history (UP_EXPORTED_DEVICE (device))) {
 		g_dbus_method_invocation_return_error_literal (invocation,
 							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
 							       "device does not support getting history");
-		goto out;
+		return;
 	}
 
 	/* get the correct data */
@@ -673,36 +978,49 @@ up_device_get_history (UpExportedDevice *skeleton,
 	else if (g_strcmp0 (type_string, "voltage") == 0)
 		type = UP_HISTORY_TYPE_VOLTAGE;
 
-	/* something recognized */
-	if (type != UP_HISTORY_TYPE_UNKNOWN) {
-		ensure_history (device);
-		array = up_history_get_data (priv->history, type, timespan, resolution);
-	}
-
-	/* maybe the device doesn't have any history */
-	if (array == NULL) {
+	/* nothing recognized */
+	if (type == UP_HISTORY_TYPE_UNKNOWN) {
 		g_dbus_method_invocation_return_error_literal (invocation,
 							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
 							       "device has no history");
-		goto out;
+		return;
 	}
 
-	/* copy data to dbus struct */
-	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(udu)"));
-	for (i = 0; i < array->len; i++) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		g_variant_builder_add (&builder, "(udu)",
-				       up_history_item_get_time (item),
-				       up_history_item_get_value (item),
-				       up_history_item_get_state (item));
-	}
+	ensure_history (device);
 
-	up_exported_device_complete_get_history (skeleton, invocation,
-						 g_variant_builder_end (&builder));
+	/* the history is read from disk in the background */
+	request = up_device_history_request_new (device, invocation);
+	request->type = type;
+	request->timespan = timespan;
+	request->resolution = resolution;
+	request->use_fd = use_fd;
+	up_history_load_async (priv->history, NULL, up_device_get_history_cb, request);
+}
 
-out:
-	if (array != NULL)
-		g_ptr_array_unref (array);
+static gboolean
+up_device_get_history (UpExportedDevice *skeleton,
+		       GDBusMethodInvocation *invocation,
+		       const gchar *type_string,
+		       guint timespan,
+		       guint resolution,
+		       UpDevice *device)
+{
+	up_device_start_history_request (device, invocation, type_string,
+					 timespan, resolution, FALSE);
+	return TRUE;
+}
+
+static gboolean
+up_device_get_history_fd (UpExportedDevice *skeleton,
+			  GDBusMethodInvocation *invocation,
+			  GUnixFDList *fd_list,
+			  const gchar *type_string,
+			  guint timespan,
+			  guint resolution,
+			  UpDevice *device)
+{
+	up_device_start_history_request (device, invocation, type_string,
+					 timespan, resolution, TRUE);
 	return TRUE;
 }
 
@@ -729,8 +1047,20 @@ up_device_refresh_internal (UpDevice *device, UpRefreshReason reason)
 	if (klass->refresh == NULL)
 		goto out;
 
-	/* do the refresh, and change the property */
+	/* do the refresh, the notifications are only sent once all the
+	 * properties have their new value */
+	priv->refreshing = TRUE;
+	g_object_freeze_notify (G_OBJECT (device));
 	ret = klass->refresh (device, reason);
+	g_object_thaw_notify (G_OBJECT (device));
+	priv->refreshing = FALSE;
+
+	up_device_run_updates (device, priv->pending_updates);
+	priv->pending_updates = 0;
+
+	/* all the changes go out in a single PropertiesChanged signal */
+	g_dbus_interface_skeleton_flush (G_DBUS_INTERFACE_SKELETON (device));
+
 	priv->last_refresh = g_get_monotonic_time ();
 	g_object_notify_by_pspec (G_OBJECT (device), properties[PROP_LAST_REFRESH]);
 
@@ -785,6 +1115,8 @@ up_device_init (UpDevice *device)
 
 	g_signal_connect (device, "handle-get-history",
 			  G_CALLBACK (up_device_get_history), device);
+	g_signal_connect (device, "handle-get-history-fd",
+			  G_CALLBACK (up_device_get_history_fd), device);
 	g_signal_connect (device, "handle-get-statistics",
 			  G_CALLBACK (up_device_get_statistics), device);
 }
@@ -923,6 +1255,18 @@ up_device_class_init (UpDeviceClass *klass)
 		                      G_PARAM_STATIC_STRINGS | G_PARAM_WRITABLE | G_PARAM_READABLE);
 
 	g_object_class_install_properties (object_class, N_PROPS, properties);
+
+	exported_properties[EXPORTED_PROP_TYPE] = g_object_class_find_property (object_class, "type");
+	exported_properties[EXPORTED_PROP_IS_PRESENT] = g_object_class_find_property (object_class, "is-present");
+	exported_properties[EXPORTED_PROP_VENDOR] = g_object_class_find_property (object_class, "vendor");
+	exported_properties[EXPORTED_PROP_MODEL] = g_object_class_find_property (object_class, "model");
+	exported_properties[EXPORTED_PROP_SERIAL] = g_object_class_find_property (object_class, "serial");
+	exported_properties[EXPORTED_PROP_POWER_SUPPLY] = g_object_class_find_property (object_class, "power-supply");
+	exported_properties[EXPORTED_PROP_TIME_TO_EMPTY] = g_object_class_find_property (object_class, "time-to-empty");
+	exported_properties[EXPORTED_PROP_STATE] = g_object_class_find_property (object_class, "state");
+	exported_properties[EXPORTED_PROP_PERCENTAGE] = g_object_class_find_property (object_class, "percentage");
+	exported_properties[EXPORTED_PROP_BATTERY_LEVEL] = g_object_class_find_property (object_class, "battery-level");
+	exported_properties[EXPORTED_PROP_UPDATE_TIME] = g_object_class_find_property (object_class, "update-time");
 }
 
 UpDevice *
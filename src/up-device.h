@@ -54,6 +54,7 @@ struct _UpDeviceClass
 						 gboolean	*on_battery);
 	gboolean	 (*get_online)		(UpDevice	*device,
 						 gboolean	*online);
+	void		 (*save_state)		(UpDevice	*device);
 };
 
 GType		 up_device_get_type		(void);
@@ -62,11 +63,15 @@ UpDevice	*up_device_new			(UpDaemon	*daemon,
 
 UpDaemon	*up_device_get_daemon		(UpDevice	*device);
 GObject		*up_device_get_native		(UpDevice	*device);
+gint		 up_device_get_poll_timeout	(UpDevice	*device);
+gint64		 up_device_get_last_refresh	(UpDevice	*device);
 const gchar	*up_device_get_object_path	(UpDevice	*device);
+gchar		*up_device_get_id		(UpDevice	*device);
 gboolean	 up_device_get_on_battery	(UpDevice	*device,
 						 gboolean	*on_battery);
 gboolean	 up_device_get_online		(UpDevice	*device,
 						 gboolean	*online);
+void		 up_device_save_state		(UpDevice	*device);
 const gchar	*up_device_get_state_dir_override (UpDevice *device);
 gboolean	 up_device_polkit_is_allowed	(UpDevice	*device,
 						 GDBusMethodInvocation *invocation);
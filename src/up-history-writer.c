@@ -0,0 +1,198 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2026 The UPower contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "up-history-writer.h"
+
+/* Collects the histories of all devices that have data to save, so that
+ * they get written out together instead of each on its own timer. */
+struct _UpHistoryWriter
+{
+	GObject			 parent;
+	GPtrArray		*histories;	/* not referenced */
+	GSource			*save_source;
+};
+
+G_DEFINE_TYPE (UpHistoryWriter, up_history_writer, G_TYPE_OBJECT)
+
+/**
+ * up_history_writer_take:
+ *
+ * Return value: the queued histories, referenced so that they stay alive
+ * while being saved, as saving may queue again
+ **/
+static GPtrArray *
+up_history_writer_take (UpHistoryWriter *writer)
+{
+	g_autoptr(GPtrArray) queued = NULL;
+	GPtrArray *histories;
+	guint i;
+
+	g_clear_pointer (&writer->save_source, g_source_destroy);
+	queued = g_steal_pointer (&writer->histories);
+	writer->histories = g_ptr_array_new ();
+
+	histories = g_ptr_array_new_full (queued->len, g_object_unref);
+	for (i = 0; i < queued->len; i++)
+		g_ptr_array_add (histories, g_object_ref (g_ptr_array_index (queued, i)));
+	return histories;
+}
+
+/**
+ * up_history_writer_save_cb:
+ **/
+static gboolean
+up_history_writer_save_cb (UpHistoryWriter *writer)
+{
+	g_autoptr(GPtrArray) histories = NULL;
+	guint i;
+
+	/* written in the background */
+	histories = up_history_writer_take (writer);
+	g_debug ("saving %u histories", histories->len);
+	for (i = 0; i < histories->len; i++)
+		up_history_start_save (g_ptr_array_index (histories, i));
+	return FALSE;
+}
+
+/**
+ * up_history_writer_queue:
+ * @timeout: the maximum number of seconds until @history is saved
+ *
+ * Marks @history as having data to save. All queued histories are saved
+ * together, as soon as the shortest timeout of any of them expires.
+ **/
+void
+up_history_writer_queue (UpHistoryWriter *writer, UpHistory *history, guint timeout)
+{
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	if (!g_ptr_array_find (writer->histories, history, NULL))
+		g_ptr_array_add (writer->histories, history);
+
+	/* we already have one saved, clear it if it will fire earlier */
+	if (writer->save_source) {
+		guint64 ready = g_source_get_ready_time (writer->save_source);
+
+		if (ready > g_source_get_time (writer->save_source) + timeout * G_USEC_PER_SEC) {
+			g_clear_pointer (&writer->save_source, g_source_destroy);
+		} else {
+			g_debug ("deferring as earlier timeout is already queued");
+			return;
+		}
+	}
+
+	/* nothing scheduled */
+	g_debug ("saving in %i seconds", timeout);
+	writer->save_source = g_timeout_source_new_seconds (timeout);
+	g_source_set_name (writer->save_source, "[upower] up_history_writer_save_cb");
+	g_source_attach (writer->save_source, NULL);
+	g_source_set_callback (writer->save_source,
+			       (GSourceFunc) up_history_writer_save_cb, writer,
+			       NULL);
+}
+
+/**
+ * up_history_writer_remove:
+ *
+ * Forgets about @history, which has to be done before it is finalized.
+ **/
+void
+up_history_writer_remove (UpHistoryWriter *writer, UpHistory *history)
+{
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+
+	g_ptr_array_remove (writer->histories, history);
+	if (writer->histories->len == 0)
+		g_clear_pointer (&writer->save_source, g_source_destroy);
+}
+
+/**
+ * up_history_writer_flush:
+ *
+ * Saves all queued histories now, waiting until they are written.
+ **/
+void
+up_history_writer_flush (UpHistoryWriter *writer)
+{
+	g_autoptr(GPtrArray) histories = NULL;
+	guint i;
+
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+
+	if (writer->histories->len == 0) {
+		g_clear_pointer (&writer->save_source, g_source_destroy);
+		return;
+	}
+
+	histories = up_history_writer_take (writer);
+	g_debug ("saving %u histories", histories->len);
+	for (i = 0; i < histories->len; i++)
+		up_history_save_data (g_ptr_array_index (histories, i));
+}
+
+/**
+ * up_history_writer_init:
+ **/
+static void
+up_history_writer_init (UpHistoryWriter *writer)
+{
+	writer->histories = g_ptr_array_new ();
+}
+
+/**
+ * up_history_writer_finalize:
+ **/
+static void
+up_history_writer_finalize (GObject *object)
+{
+	UpHistoryWriter *writer = UP_HISTORY_WRITER (object);
+
+	g_clear_pointer (&writer->save_source, g_source_destroy);
+	g_ptr_array_unref (writer->histories);
+
+	G_OBJECT_CLASS (up_history_writer_parent_class)->finalize (object);
+}
+
+/**
+ * up_history_writer_class_init:
+ **/
+static void
+up_history_writer_class_init (UpHistoryWriterClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = up_history_writer_finalize;
+}
+
+/**
+ * up_history_writer_new:
+ *
+ * Return value: a new UpHistoryWriter object.
+ **/
+UpHistoryWriter *
+up_history_writer_new (void)
+{
+	return g_object_new (UP_TYPE_HISTORY_WRITER, NULL);
+}
@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2026 The UPower contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "up-history.h"
+
+G_BEGIN_DECLS
+
+#define UP_TYPE_HISTORY_WRITER	(up_history_writer_get_type ())
+
+G_DECLARE_FINAL_TYPE (UpHistoryWriter, up_history_writer, UP, HISTORY_WRITER, GObject)
+
+UpHistoryWriter	*up_history_writer_new			(void);
+void		 up_history_writer_queue		(UpHistoryWriter	*writer,
+							 UpHistory		*history,
+							 guint			 timeout);
+void		 up_history_writer_remove		(UpHistoryWriter	*writer,
+							 UpHistory		*history);
+void		 up_history_writer_flush		(UpHistoryWriter	*writer);
+
+G_END_DECLS
@@ -23,21 +23,174 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include "up-history.h"
+#include "up-history-writer.h"
 #include "up-stats-item.h"
 #include "up-history-item.h"
 
 static void	up_history_finalize	(GObject		*object);
+static void	up_history_request_load	(UpHistory		*history);
+static void	up_history_finish_task	(UpHistory		*history);
 
 #define UP_HISTORY_SAVE_INTERVAL	(10*60)		/* seconds */
 #define UP_HISTORY_SAVE_INTERVAL_LOW_POWER	5	/* seconds */
 #define UP_HISTORY_LOW_POWER_PERCENT	10
 #define UP_HISTORY_DEFAULT_MAX_DATA_AGE	(7*24*60*60)	/* seconds */
 
+/* all series of a device are stored in one file, as a log of chunks that
+ * each hold the fixed size records of one series; a save appends a chunk
+ * for every series with new samples in a single write */
+#define UP_HISTORY_FILE_HEADER		"UPHDEV01"
+#define UP_HISTORY_FILE_HEADER_SIZE	8
+#define UP_HISTORY_CHUNK_PROFILE	0x100
+#define UP_HISTORY_CHUNK_PROFILE_DELTA	0x101	/* added to the bins */
+
+/* older versions used one file per series */
+#define UP_HISTORY_SERIES_FILE_HEADER	"UPHLOG01"
+#define UP_HISTORY_PROFILE_FILE_HEADER	"UPHPRF01"
+
+/* on-disk chunk header, all fields are little-endian */
+typedef struct {
+	guint32			 type;		/* a UpHistoryType */
+	guint32			 len;		/* records that follow */
+} UpHistoryChunk;
+
+G_STATIC_ASSERT (sizeof (UpHistoryChunk) == 8);
+
+/* on-disk record, all fields are little-endian */
+typedef struct {
+	guint32			 time;
+	guint32			 state;
+	guint64			 value;		/* bits of a gdouble */
+} UpHistoryRecord;
+
+G_STATIC_ASSERT (sizeof (UpHistoryRecord) == 16);
+
+/* the samples recorded since the log was loaded are kept column-wise in a
+ * ring buffer that can hold one sample per UP_HISTORY_SAMPLE_INTERVAL for
+ * the maximum data age, after which the oldest samples get dropped */
+#define UP_HISTORY_SAMPLE_INTERVAL	30		/* seconds */
+#define UP_HISTORY_MIN_CAPACITY		1024
+#define UP_HISTORY_INITIAL_ALLOC	64
+
+typedef struct {
+	guint32			*time;
+	gdouble			*value;
+	guint8			*state;
+	guint			 alloc;		/* allocated entries */
+	guint			 head;		/* position of the oldest entry */
+	guint			 len;
+} UpHistoryRing;
+
+/* to answer requests over long timespans, the samples are also summed up
+ * in buckets of fixed widths; each level is UP_HISTORY_LEVEL_FACTOR times
+ * coarser than the one before */
+#define UP_HISTORY_LEVELS		5
+#define UP_HISTORY_LEVEL_WIDTH		60		/* seconds */
+#define UP_HISTORY_LEVEL_FACTOR		4
+
+typedef struct {
+	guint32			 start;		/* aligned to the level width */
+	guint32			 count;
+	guint64			 time_sum;
+	gdouble			 value_sum;
+	UpDeviceState		 state;
+} UpHistoryBucket;
+
+typedef struct {
+	guint			 time;
+	gdouble			 value;
+	UpDeviceState		 state;
+} UpHistoryPoint;
+
+typedef struct {
+	GMappedFile		*mapped;	/* the log as it was loaded */
+	const UpHistoryRecord	*mapped_data;
+	guint			 mapped_len;
+	UpHistoryRing		 data;		/* samples added since */
+	guint			 capacity;	/* maximum size of @data */
+	guint			 saved_len;	/* samples of @data already in the log */
+	guint			 added;		/* samples added so far, wraps around */
+	guint			 dropped;	/* unsaved samples dropped */
+	gboolean		 unsorted;	/* the clock went backwards */
+	GArray			*levels[UP_HISTORY_LEVELS];
+	guint			 levels_len;	/* samples in the buckets */
+} UpHistorySeries;
+
+/* the time spent in each percentage step is summed up as the charge samples
+ * are recorded, and stored in chunks of their own that are not culled */
+#define UP_HISTORY_PROFILE_BINS		101
+
+typedef struct {
+	guint64			 time_sum;
+	guint32			 count;
+	gboolean		 changed;	/* not saved yet */
+} UpHistoryProfileBin;
+
+/* on-disk bin, all fields are little-endian */
+typedef struct {
+	guint32			 bin;		/* the charging bins come first */
+	guint32			 count;
+	guint64			 time_sum;
+} UpHistoryProfileRecord;
+
+G_STATIC_ASSERT (sizeof (UpHistoryProfileRecord) == sizeof (UpHistoryRecord));
+
+typedef struct {
+	UpHistoryProfileBin	 charging[UP_HISTORY_PROFILE_BINS];
+	UpHistoryProfileBin	 discharging[UP_HISTORY_PROFILE_BINS];
+	guint			 oldbin;
+	gboolean		 have_last;	/* @last_state is valid */
+	UpDeviceState		 last_state;
+	gboolean		 have_old;	/* start of the current step */
+	guint			 old_time;
+	gdouble			 old_value;
+} UpHistoryProfile;
+
+/* the contents of the files, read in a worker thread */
+typedef struct {
+	gchar			*dir;
+	gchar			*id;
+	GMappedFile		*mapped[UP_HISTORY_TYPE_UNKNOWN];
+	const UpHistoryRecord	*mapped_data[UP_HISTORY_TYPE_UNKNOWN];
+	guint			 mapped_len[UP_HISTORY_TYPE_UNKNOWN];
+	GByteArray		*records[UP_HISTORY_TYPE_UNKNOWN];	/* following the mapped ones */
+	UpHistoryProfile	 profile;
+	gboolean		 complete;	/* no incomplete chunk at the end */
+	gboolean		 legacy;
+} UpHistoryLoad;
+
+/* a snapshot of the data to write, written in a worker thread */
+typedef struct {
+	gchar			*filename;
+	GByteArray		*buffer;
+	gboolean		 rewrite;
+	gboolean		 unloaded;	/* appended without knowing the file */
+	gsize			 max_size;	/* when to load the file to cull it */
+	gsize			 size;		/* of the file before appending */
+	UpHistoryProfile	 profile_delta;	/* restored if not written */
+	GStrv			 legacy_files;	/* to remove once rewritten */
+	guint			 added[UP_HISTORY_TYPE_UNKNOWN];
+	UpHistoryLoad		*load;		/* the rewritten file */
+	GError			*error;
+} UpHistorySave;
+
+static const gchar *up_history_type_names[] = {
+	[UP_HISTORY_TYPE_CHARGE] = "charge",
+	[UP_HISTORY_TYPE_RATE] = "rate",
+	[UP_HISTORY_TYPE_TIME_FULL] = "time-full",
+	[UP_HISTORY_TYPE_TIME_EMPTY] = "time-empty",
+	[UP_HISTORY_TYPE_VOLTAGE] = "voltage",
+};
+
 struct UpHistoryPrivate
 {
 	gchar			*id;
@@ -47,12 +200,22 @@ struct UpHistoryPrivate
 	gdouble			 percentage_last;
 	gdouble			 voltage_last;
 	UpDeviceState		 state;
-	GPtrArray		*data_rate;
-	GPtrArray		*data_charge;
-	GPtrArray		*data_time_full;
-	GPtrArray		*data_time_empty;
-	GPtrArray		*data_voltage;
+	UpHistorySeries		 series[UP_HISTORY_TYPE_UNKNOWN];
+	UpHistoryProfile	 profile;
+	gboolean		 rewrite;	/* file has to be written from scratch */
+	gboolean		 legacy;	/* loaded from the files of older versions */
+	gboolean		 loaded;	/* the files have been read */
+	gboolean		 loading;	/* the files are read in a thread */
+	gboolean		 load_pending;	/* load once done saving */
+	GPtrArray		*load_waiters;
+	gboolean		 saving;	/* a snapshot is written in a thread */
+	gboolean		 save_again;	/* save once done loading or saving */
+	GTask			*task;		/* the load or save in a thread */
+	GMutex			 task_lock;
+	GCond			 task_cond;
+	gboolean		 task_done;	/* the thread is done with @task */
 	GSource			*save_source;
+	UpHistoryWriter		*writer;
 	guint			 max_data_age;
 	gchar			*dir;
 };
@@ -65,27 +228,456 @@ enum {
 G_DEFINE_TYPE_WITH_PRIVATE (UpHistory, up_history, G_TYPE_OBJECT)
 
 /**
- * up_history_set_max_data_age:
+ * up_history_record_set:
  **/
-void
-up_history_set_max_data_age (UpHistory *history, guint max_data_age)
+static void
+up_history_record_set (UpHistoryRecord *record, guint time, gdouble value, UpDeviceState state)
 {
-	history->priv->max_data_age = max_data_age;
+	union {
+		gdouble	 d;
+		guint64	 u;
+	} value_bits;
+
+	value_bits.d = value;
+	record->time = GUINT32_TO_LE (time);
+	record->state = GUINT32_TO_LE (state);
+	record->value = GUINT64_TO_LE (value_bits.u);
+}
+
+/**
+ * up_history_record_get_time:
+ **/
+static inline guint
+up_history_record_get_time (const UpHistoryRecord *record)
+{
+	return GUINT32_FROM_LE (record->time);
+}
+
+/**
+ * up_history_record_get_value:
+ **/
+static inline gdouble
+up_history_record_get_value (const UpHistoryRecord *record)
+{
+	union {
+		gdouble	 d;
+		guint64	 u;
+	} value;
+
+	value.u = GUINT64_FROM_LE (record->value);
+	return value.d;
+}
+
+/**
+ * up_history_record_get_state:
+ **/
+static inline UpDeviceState
+up_history_record_get_state (const UpHistoryRecord *record)
+{
+	return GUINT32_FROM_LE (record->state);
+}
+
+/**
+ * up_history_new_item:
+ **/
+static UpHistoryItem *
+up_history_new_item (guint time, gdouble value, UpDeviceState state)
+{
+	UpHistoryItem *item;
+
+	item = up_history_item_new ();
+	up_history_item_set_time (item, time);
+	up_history_item_set_value (item, value);
+	up_history_item_set_state (item, state);
+	return item;
+}
+
+/**
+ * up_history_ring_pos:
+ **/
+static inline guint
+up_history_ring_pos (const UpHistoryRing *ring, guint idx)
+{
+	return (ring->head + idx) % ring->alloc;
+}
+
+/**
+ * up_history_ring_resize:
+ *
+ * Reallocates the ring with room for @alloc entries, dropping the oldest
+ * ones if they do not fit.
+ **/
+static void
+up_history_ring_resize (UpHistoryRing *ring, guint alloc)
+{
+	guint32 *time;
+	gdouble *value;
+	guint8 *state;
+	guint len;
+	guint skip;
+	guint i;
+
+	len = MIN (ring->len, alloc);
+	skip = ring->len - len;
+	time = g_new (guint32, alloc);
+	value = g_new (gdouble, alloc);
+	state = g_new (guint8, alloc);
+	for (i = 0; i < len; i++) {
+		guint pos = up_history_ring_pos (ring, skip + i);
+
+		time[i] = ring->time[pos];
+		value[i] = ring->value[pos];
+		state[i] = ring->state[pos];
+	}
+	g_free (ring->time);
+	g_free (ring->value);
+	g_free (ring->state);
+	ring->time = time;
+	ring->value = value;
+	ring->state = state;
+	ring->alloc = alloc;
+	ring->head = 0;
+	ring->len = len;
+}
+
+/**
+ * up_history_ring_clear:
+ **/
+static void
+up_history_ring_clear (UpHistoryRing *ring)
+{
+	g_clear_pointer (&ring->time, g_free);
+	g_clear_pointer (&ring->value, g_free);
+	g_clear_pointer (&ring->state, g_free);
+	ring->alloc = 0;
+	ring->head = 0;
+	ring->len = 0;
+}
+
+/**
+ * up_history_ring_to_records:
+ * @start: the first entry to convert
+ * @buffer: the #GByteArray to append to
+ *
+ * Appends the on-disk representation of the entries to @buffer.
+ **/
+static void
+up_history_ring_to_records (const UpHistoryRing *ring, guint start, GByteArray *buffer)
+{
+	UpHistoryRecord record;
+	guint i;
+
+	for (i = start; i < ring->len; i++) {
+		guint pos = up_history_ring_pos (ring, i);
+
+		up_history_record_set (&record, ring->time[pos], ring->value[pos], ring->state[pos]);
+		g_byte_array_append (buffer, (const guint8 *) &record, sizeof (record));
+	}
+}
+
+/**
+ * up_history_series_get_length:
+ **/
+static guint
+up_history_series_get_length (UpHistorySeries *series)
+{
+	return series->mapped_len + series->data.len;
+}
+
+/**
+ * up_history_series_get_time:
+ *
+ * Returns the time of the sample at @idx, the samples loaded from disk are
+ * read straight from the mapped log.
+ **/
+static guint
+up_history_series_get_time (UpHistorySeries *series, guint idx)
+{
+	if (idx < series->mapped_len)
+		return up_history_record_get_time (&series->mapped_data[idx]);
+	return series->data.time[up_history_ring_pos (&series->data, idx - series->mapped_len)];
+}
+
+/**
+ * up_history_series_get_value:
+ **/
+static gdouble
+up_history_series_get_value (UpHistorySeries *series, guint idx)
+{
+	if (idx < series->mapped_len)
+		return up_history_record_get_value (&series->mapped_data[idx]);
+	return series->data.value[up_history_ring_pos (&series->data, idx - series->mapped_len)];
+}
+
+/**
+ * up_history_series_get_state:
+ **/
+static UpDeviceState
+up_history_series_get_state (UpHistorySeries *series, guint idx)
+{
+	if (idx < series->mapped_len)
+		return up_history_record_get_state (&series->mapped_data[idx]);
+	return series->data.state[up_history_ring_pos (&series->data, idx - series->mapped_len)];
+}
+
+/**
+ * up_history_level_get_width:
+ **/
+static guint
+up_history_level_get_width (guint level)
+{
+	guint width = UP_HISTORY_LEVEL_WIDTH;
+
+	while (level-- > 0)
+		width *= UP_HISTORY_LEVEL_FACTOR;
+	return width;
+}
+
+/**
+ * up_history_series_levels_add:
+ *
+ * Adds a sample to the last bucket of each level, or starts a new bucket if
+ * the sample is outside of it or the state changed.
+ **/
+static void
+up_history_series_levels_add (UpHistorySeries *series, guint time, gdouble value, UpDeviceState state)
+{
+	UpHistoryBucket *last;
+	UpHistoryBucket bucket;
+	guint width;
+	guint start;
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_LEVELS; i++) {
+		GArray *level = series->levels[i];
+
+		width = up_history_level_get_width (i);
+		start = time - time % width;
+		last = NULL;
+		if (level->len > 0)
+			last = &g_array_index (level, UpHistoryBucket, level->len - 1);
+
+		/* the clock going backwards does not unsort the buckets */
+		if (last != NULL && start < last->start)
+			start = last->start;
+
+		if (last != NULL && last->start == start && last->state == state) {
+			last->count++;
+			last->time_sum += time;
+			last->value_sum += value;
+			continue;
+		}
+		bucket.start = start;
+		bucket.count = 1;
+		bucket.time_sum = time;
+		bucket.value_sum = value;
+		bucket.state = state;
+		g_array_append_val (level, bucket);
+	}
+}
+
+/**
+ * up_history_series_levels_update:
+ *
+ * Adds all samples to the buckets that have not been added yet. The buckets
+ * are only created when they are needed first, after that they are kept up
+ * to date as samples arrive.
+ **/
+static void
+up_history_series_levels_update (UpHistorySeries *series)
+{
+	guint length;
+	guint i;
+
+	if (series->levels[0] == NULL) {
+		for (i = 0; i < UP_HISTORY_LEVELS; i++)
+			series->levels[i] = g_array_new (FALSE, FALSE, sizeof (UpHistoryBucket));
+		series->levels_len = 0;
+	}
+
+	length = up_history_series_get_length (series);
+	for (i = series->levels_len; i < length; i++) {
+		up_history_series_levels_add (series,
+					      up_history_series_get_time (series, i),
+					      up_history_series_get_value (series, i),
+					      up_history_series_get_state (series, i));
+	}
+	series->levels_len = length;
+}
+
+/**
+ * up_history_series_levels_clear:
+ **/
+static void
+up_history_series_levels_clear (UpHistorySeries *series)
+{
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_LEVELS; i++)
+		g_clear_pointer (&series->levels[i], g_array_unref);
+	series->levels_len = 0;
+}
+
+/**
+ * up_history_series_get_point:
+ * @level: the buckets to use, or %NULL for the samples
+ *
+ * Gets a bucket, or a single sample as if it were one.
+ **/
+static void
+up_history_series_get_point (UpHistorySeries *series, GArray *level, guint idx, UpHistoryBucket *point)
+{
+	if (level != NULL) {
+		*point = g_array_index (level, UpHistoryBucket, idx);
+		return;
+	}
+	point->start = up_history_series_get_time (series, idx);
+	point->count = 1;
+	point->time_sum = point->start;
+	point->value_sum = up_history_series_get_value (series, idx);
+	point->state = up_history_series_get_state (series, idx);
+}
+
+/**
+ * up_history_series_add:
+ **/
+static void
+up_history_series_add (UpHistorySeries *series, guint time, gdouble value, UpDeviceState state)
+{
+	UpHistoryRing *ring = &series->data;
+	guint length;
+	guint pos;
+
+	/* the clock can be set backwards, which the searches have to know */
+	length = up_history_series_get_length (series);
+	if (length > 0 && time < up_history_series_get_time (series, length - 1))
+		series->unsorted = TRUE;
+
+	if (ring->len == ring->alloc && ring->alloc < series->capacity) {
+		up_history_ring_resize (ring, MIN (MAX (ring->alloc * 2, UP_HISTORY_INITIAL_ALLOC),
+						   series->capacity));
+	}
+
+	/* full, drop the oldest samples, but only once they were saved */
+	while (ring->len >= series->capacity && series->saved_len > 0) {
+		ring->head = up_history_ring_pos (ring, 1);
+		ring->len--;
+		series->saved_len--;
+		if (series->levels_len > series->mapped_len)
+			series->levels_len--;
+	}
+
+	/* the writer is behind, keep the samples until they are saved, but
+	 * never more than twice the capacity */
+	if (ring->len >= 2 * series->capacity) {
+		if (series->dropped++ % series->capacity == 0)
+			g_warning ("dropping unsaved samples over twice the capacity of %u, %u so far",
+				   series->capacity, series->dropped);
+		ring->head = up_history_ring_pos (ring, 1);
+		ring->len--;
+		if (series->levels_len > series->mapped_len)
+			series->levels_len--;
+	} else if (ring->len == ring->alloc) {
+		g_debug ("keeping %u unsaved samples over the capacity of %u",
+			 ring->len - series->saved_len, series->capacity);
+		up_history_ring_resize (ring, MIN (MAX (ring->alloc * 2, UP_HISTORY_INITIAL_ALLOC),
+						   2 * series->capacity));
+	}
+
+	pos = up_history_ring_pos (ring, ring->len);
+	ring->time[pos] = time;
+	ring->value[pos] = value;
+	ring->state[pos] = state;
+	ring->len++;
+	series->added++;
+
+	/* keep the buckets up to date once they exist */
+	if (series->levels[0] != NULL && series->levels_len + 1 == up_history_series_get_length (series)) {
+		up_history_series_levels_add (series, time, value, state);
+		series->levels_len++;
+	}
+}
+
+/**
+ * up_history_series_set_capacity:
+ **/
+static void
+up_history_series_set_capacity (UpHistorySeries *series, guint capacity)
+{
+	guint keep;
+
+	series->capacity = capacity;
+
+	/* the samples that were not saved yet are kept */
+	keep = MAX (capacity, series->data.len - series->saved_len);
+	if (series->data.alloc <= keep)
+		return;
+
+	/* the dropped samples cannot be appended anymore */
+	if (series->data.len > keep) {
+		guint dropped = series->data.len - keep;
+
+		series->saved_len -= dropped;
+		if (series->levels_len > series->mapped_len)
+			series->levels_len -= MIN (series->levels_len - series->mapped_len, dropped);
+	}
+	up_history_ring_resize (&series->data, keep);
 }
 
 /**
- * up_history_array_copy_cb:
+ * up_history_series_set_mapped:
+ * @mapped: (nullable): the mapped file that holds @data
+ * @data: the records
+ * @len: the number of records
+ *
+ * Makes @data the only contents of the series.
  **/
 static void
-up_history_array_copy_cb (UpHistoryItem *item, GPtrArray *dest)
+up_history_series_set_mapped (UpHistorySeries *series, GMappedFile *mapped, const UpHistoryRecord *data, guint len)
+{
+	guint i;
+
+	g_clear_pointer (&series->mapped, g_mapped_file_unref);
+	series->mapped_data = NULL;
+	series->mapped_len = 0;
+	up_history_ring_clear (&series->data);
+	series->saved_len = 0;
+	series->unsorted = FALSE;
+	up_history_series_levels_clear (series);
+
+	if (mapped == NULL)
+		return;
+	series->mapped = g_mapped_file_ref (mapped);
+	series->mapped_data = data;
+	series->mapped_len = len;
+	for (i = 1; i < len && !series->unsorted; i++) {
+		if (up_history_record_get_time (&data[i]) < up_history_record_get_time (&data[i - 1]))
+			series->unsorted = TRUE;
+	}
+}
+
+/**
+ * up_history_set_max_data_age:
+ **/
+void
+up_history_set_max_data_age (UpHistory *history, guint max_data_age)
 {
-	g_ptr_array_add (dest, g_object_ref (item));
+	guint i;
+
+	history->priv->max_data_age = max_data_age;
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		up_history_series_set_capacity (&history->priv->series[i],
+						MAX (max_data_age / UP_HISTORY_SAMPLE_INTERVAL,
+						     UP_HISTORY_MIN_CAPACITY));
+	}
 }
 
 /**
- * up_history_array_limit_resolution:
- * @array: The data we have for a specific graph
- * @max_num: The max desired points
+ * up_history_series_limit_resolution:
+ * @series: The data we have for a specific graph
+ * @level: The buckets to use, or %NULL for the samples
+ * @start: The first sample or bucket to use
+ * @max_num: The max desired points, or 0 for all
  *
  * We need to reduce the number of data points else the graph will take a long
  * time to plot accuracy we don't need at the larger scales.
@@ -114,41 +706,48 @@ up_history_array_copy_cb (UpHistoryItem *item, GPtrArray *dest)
  * 1 = 15,90
  * 2 = 41,70
  * 3 = 85,30
+ *
+ * The points are passed to @func with the most recent first.
  **/
-static GPtrArray *
-up_history_array_limit_resolution (GPtrArray *array, guint max_num)
+static void
+up_history_series_limit_resolution (UpHistorySeries *series, GArray *level, guint start, guint max_num,
+				    UpHistoryDataFunc func, gpointer user_data)
 {
-	UpHistoryItem *item;
-	UpHistoryItem *item_new;
+	UpHistoryBucket point;
 	guint length;
+	guint end;
 	guint i;
 	guint64 last;
 	guint64 first;
-	GPtrArray *new;
+	guint added = 0;
 	UpDeviceState state = UP_DEVICE_STATE_UNKNOWN;
 	guint64 time_s = 0;
 	gdouble value = 0;
 	guint64 count = 0;
 	guint step = 1;
 
-	new = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	g_debug ("length of array (before) %i", array->len);
+	end = level != NULL ? level->len : up_history_series_get_length (series);
+	length = end - start;
+	g_debug ("length of array (before) %i", length);
 
 	/* check length */
-	length = array->len;
 	if (length == 0)
-		goto out;
-	if (length < max_num) {
+		return;
+	if (max_num == 0 || length < max_num) {
 		/* need to copy array */
-		g_ptr_array_foreach (array, (GFunc) up_history_array_copy_cb, new);
-		goto out;
+		for (i = 0; i < length; i++) {
+			up_history_series_get_point (series, level, end - 1 - i, &point);
+			func (point.time_sum / point.count, point.value_sum / point.count,
+			      point.state, user_data);
+		}
+		return;
 	}
 
 	/* last element */
-	item = (UpHistoryItem *) g_ptr_array_index (array, length-1);
-	last = up_history_item_get_time (item);
-	item = (UpHistoryItem *) g_ptr_array_index (array, 0);
-	first = up_history_item_get_time (item);
+	up_history_series_get_point (series, level, start, &point);
+	last = point.time_sum / point.count;
+	up_history_series_get_point (series, level, end - 1, &point);
+	first = MAX (point.time_sum / point.count, last);
 
 	/* Reduces the number of points to a pre-set level using a time
 	 * division algorithm so we don't keep diluting the previous
@@ -156,213 +755,328 @@ up_history_array_limit_resolution (GPtrArray *array, guint max_num)
 	for (i = 0; i < length; i++) {
 		guint64 preset;
 
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
+		up_history_series_get_point (series, level, end - 1 - i, &point);
 		preset = first - ((first - last) * (guint64) step) / max_num;
 
 		/* if state changed or we went over the preset do a new point */
 		if (count > 0 &&
-		    (up_history_item_get_time (item) < preset ||
-		     up_history_item_get_state (item) != state)) {
-			item_new = up_history_item_new ();
-			up_history_item_set_time (item_new, time_s / count);
-			up_history_item_set_value (item_new, value / count);
-			up_history_item_set_state (item_new, state);
-			g_ptr_array_add (new, item_new);
+		    (point.time_sum / point.count < preset ||
+		     point.state != state)) {
+			func (time_s / count, value / count, state, user_data);
+			added++;
 
 			step++;
-			time_s = up_history_item_get_time (item);
-			value = up_history_item_get_value (item);
-			state = up_history_item_get_state (item);
-			count = 1;
+			time_s = point.time_sum;
+			value = point.value_sum;
+			state = point.state;
+			count = point.count;
 		} else {
-			count++;
-			time_s += up_history_item_get_time (item);
-			value += up_history_item_get_value (item);
+			count += point.count;
+			time_s += point.time_sum;
+			value += point.value_sum;
 		}
 	}
 
 	/* only add if nonzero */
 	if (count > 0) {
-		item_new = up_history_item_new ();
-		up_history_item_set_time (item_new, time_s / count);
-		up_history_item_set_value (item_new, value / count);
-		up_history_item_set_state (item_new, state);
-		g_ptr_array_add (new, item_new);
+		func (time_s / count, value / count, state, user_data);
+		added++;
 	}
 
 	/* check length */
-	g_debug ("length of array (after) %i", new->len);
-out:
-	return new;
+	g_debug ("length of array (after) %i", added);
 }
 
 /**
- * up_history_copy_array_timespan:
+ * up_history_series_find_time:
+ *
+ * Returns the index of the first sample that is not older than @time, or
+ * the length of the series if there is none. The samples are sorted by time
+ * so this is a binary search, unless the clock went backwards; then it is
+ * the first of the newest samples that are not older than @time.
  **/
-static GPtrArray *
-up_history_copy_array_timespan (const GPtrArray *array, guint timespan)
+static guint
+up_history_series_find_time (UpHistorySeries *series, guint64 time)
 {
-	guint i;
-	UpHistoryItem *item;
-	GPtrArray *array_new;
-	gint64 time_now;
-
-	/* no data */
-	if (array->len == 0)
-		return NULL;
+	guint low = 0;
+	guint high;
+
+	high = up_history_series_get_length (series);
+	if (series->unsorted) {
+		while (high > 0 && up_history_series_get_time (series, high - 1) >= time)
+			high--;
+		return high;
+	}
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
 
-	/* no limit on data */
-	if (timespan == 0) {
-		array_new = g_ptr_array_ref ((GPtrArray *) array);
-		goto out;
+		if (up_history_series_get_time (series, mid) < time)
+			low = mid + 1;
+		else
+			high = mid;
 	}
+	return low;
+}
 
-	/* new data */
-	array_new = g_ptr_array_new ();
-	time_now = g_get_real_time ();
-	g_debug ("limiting data to last %i seconds", timespan);
+/**
+ * up_history_level_find_time:
+ *
+ * Returns the index of the first bucket that contains samples that are not
+ * older than @time, or the length of the level if there is none.
+ **/
+static guint
+up_history_level_find_time (GArray *level, guint width, guint64 time)
+{
+	guint low = 0;
+	guint high = level->len;
 
-	/* treat the timespan like a range, and search backwards */
-	timespan *= 0.95f;
-	for (i=array->len-1; i>0; i--) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		if ((time_now / 1000000) - up_history_item_get_time (item) < timespan)
-			g_ptr_array_add (array_new, g_object_ref (item));
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+
+		if (g_array_index (level, UpHistoryBucket, mid).start + width <= time)
+			low = mid + 1;
+		else
+			high = mid;
 	}
-out:
-	return array_new;
+	return low;
 }
 
 /**
- * up_history_get_data:
+ * up_history_series_foreach:
+ * @func: called for each point, the most recent first
  **/
-GPtrArray *
-up_history_get_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution)
+static void
+up_history_series_foreach (UpHistorySeries *series, guint timespan, guint resolution,
+			   UpHistoryDataFunc func, gpointer user_data)
 {
-	GPtrArray *array;
-	GPtrArray *array_resolution;
-	const GPtrArray *array_data = NULL;
+	guint length;
+	guint start = 0;
+	guint64 span;
+	guint64 time_start;
+	gint i;
 
-	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+	length = up_history_series_get_length (series);
 
-	if (history->priv->id == NULL)
-		return NULL;
+	/* only return a certain time, treating the timespan like a range */
+	if (timespan > 0) {
+		guint64 time_now = g_get_real_time () / G_USEC_PER_SEC;
+		guint64 range = timespan * 0.95f;
 
-	if (type == UP_HISTORY_TYPE_CHARGE)
-		array_data = history->priv->data_charge;
-	else if (type == UP_HISTORY_TYPE_RATE)
-		array_data = history->priv->data_rate;
-	else if (type == UP_HISTORY_TYPE_TIME_FULL)
-		array_data = history->priv->data_time_full;
-	else if (type == UP_HISTORY_TYPE_TIME_EMPTY)
-		array_data = history->priv->data_time_empty;
-	else if (type == UP_HISTORY_TYPE_VOLTAGE)
-		array_data = history->priv->data_voltage;
+		g_debug ("limiting data to last %i seconds", timespan);
+		if (time_now >= range)
+			start = up_history_series_find_time (series, time_now - range + 1);
+	}
 
-	/* not recognized */
-	if (array_data == NULL)
-		return NULL;
+	/* few enough samples to use them all */
+	if (resolution == 0 || length - start < resolution) {
+		up_history_series_limit_resolution (series, NULL, start, resolution, func, user_data);
+		return;
+	}
 
-	/* only return a certain time */
-	array = up_history_copy_array_timespan (array_data, timespan);
-	if (array == NULL)
-		return NULL;
+	/* use the coarsest buckets that still have the requested resolution,
+	 * so that the cost does not depend on the number of samples */
+	time_start = up_history_series_get_time (series, start);
+	span = timespan;
+	if (span == 0 && up_history_series_get_time (series, length - 1) > time_start)
+		span = up_history_series_get_time (series, length - 1) - time_start;
+	for (i = UP_HISTORY_LEVELS - 1; i >= 0; i--) {
+		guint width = up_history_level_get_width (i);
+
+		if (width > span / resolution)
+			continue;
+		up_history_series_levels_update (series);
+		g_debug ("using buckets of %u seconds", width);
+		up_history_series_limit_resolution (series, series->levels[i],
+						    up_history_level_find_time (series->levels[i], width, time_start),
+						    resolution, func, user_data);
+		return;
+	}
 
 	/* only add a certain number of points */
-	array_resolution = up_history_array_limit_resolution (array, resolution);
-	g_ptr_array_unref (array);
+	up_history_series_limit_resolution (series, NULL, start, resolution, func, user_data);
+}
+
+/**
+ * up_history_add_point_cb:
+ **/
+static void
+up_history_add_point_cb (guint time, gdouble value, UpDeviceState state, gpointer user_data)
+{
+	UpHistoryPoint point;
 
-	return array_resolution;
+	point.time = time;
+	point.value = value;
+	point.state = state;
+	g_array_append_val (user_data, point);
 }
 
 /**
- * up_history_get_profile_data:
+ * up_history_foreach_data:
+ * @func: called for each point, the earliest first if @timespan is 0,
+ * otherwise the most recent first
+ *
+ * Gets the same points as up_history_get_data(), without creating an
+ * object for each of them.
+ *
+ * Return value: %FALSE if there is no data at all
  **/
-GPtrArray *
-up_history_get_profile_data (UpHistory *history, gboolean charging)
+gboolean
+up_history_foreach_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution,
+			 UpHistoryDataFunc func, gpointer user_data)
 {
+	UpHistorySeries *series;
+	g_autoptr(GArray) points = NULL;
 	guint i;
-	guint non_zero_accuracy = 0;
-	gfloat average = 0.0f;
-	guint bin;
-	guint oldbin = 999;
-	UpHistoryItem *item_last = NULL;
-	UpHistoryItem *item;
-	UpHistoryItem *item_old = NULL;
-	UpStatsItem *stats;
-	GPtrArray *array;
-	GPtrArray *data;
-	guint time_s;
-	gdouble value;
-	gdouble total_value = 0.0f;
 
-	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
-	/* create 100 item list and set to zero */
-	data = g_ptr_array_new_full (101, g_object_unref);
-	for (i=0; i<101; i++) {
-		stats = up_stats_item_new ();
-		g_ptr_array_add (data, stats);
-	}
+	if (history->priv->id == NULL)
+		return FALSE;
 
-	array = history->priv->data_charge;
-	for (i=0; i<array->len; i++) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		if (item_last == NULL ||
-		    up_history_item_get_state (item) != up_history_item_get_state (item_last)) {
-			item_old = NULL;
-			goto cont;
-		}
+	/* not recognized */
+	if (type >= UP_HISTORY_TYPE_UNKNOWN)
+		return FALSE;
+	series = &history->priv->series[type];
 
-		/* round to the nearest int */
-		bin = rint (up_history_item_get_value (item));
-
-		/* ensure bin is in range */
-		if (bin >= data->len)
-			bin = data->len - 1;
-
-		/* different */
-		if (oldbin != bin) {
-			oldbin = bin;
-			if (item_old != NULL) {
-				/* not enough or too much difference */
-				value = fabs (up_history_item_get_value (item) - up_history_item_get_value (item_old));
-				if (value < 0.01f) {
-					item_old = NULL;
-					goto cont;
-				}
-				if (value > 3.0f) {
-					item_old = NULL;
-					goto cont;
-				}
-
-				time_s = up_history_item_get_time (item) - up_history_item_get_time (item_old);
-				/* use the accuracy field as a counter for now */
-				if ((charging && up_history_item_get_state (item) == UP_DEVICE_STATE_CHARGING) ||
-				    (!charging && up_history_item_get_state (item) == UP_DEVICE_STATE_DISCHARGING)) {
-					stats = (UpStatsItem *) g_ptr_array_index (data, bin);
-					up_stats_item_set_value (stats, up_stats_item_get_value (stats) + time_s);
-					up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) + 1);
-				}
-			}
-			item_old = item;
-		}
-cont:
-		item_last = item;
-	}
+	/* no data */
+	if (up_history_series_get_length (series) == 0)
+		return FALSE;
+
+	if (timespan > 0) {
+		up_history_series_foreach (series, timespan, resolution, func, user_data);
+		return TRUE;
+	}
+
+	/* the whole history is passed in the order it was recorded */
+	points = g_array_new (FALSE, FALSE, sizeof (UpHistoryPoint));
+	up_history_series_foreach (series, 0, resolution, up_history_add_point_cb, points);
+	for (i = points->len; i > 0; i--) {
+		UpHistoryPoint *point = &g_array_index (points, UpHistoryPoint, i - 1);
+
+		func (point->time, point->value, point->state, user_data);
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_add_item_cb:
+ **/
+static void
+up_history_add_item_cb (guint time, gdouble value, UpDeviceState state, gpointer user_data)
+{
+	g_ptr_array_add (user_data, up_history_new_item (time, value, state));
+}
+
+/**
+ * up_history_get_data:
+ *
+ * Return value: the points as #UpHistoryItem, ordered like the ones of
+ * up_history_foreach_data(), or %NULL if there is no data
+ **/
+GPtrArray *
+up_history_get_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution)
+{
+	g_autoptr(GPtrArray) array = NULL;
+
+	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	if (!up_history_foreach_data (history, type, timespan, resolution,
+				      up_history_add_item_cb, array))
+		return NULL;
+	return g_steal_pointer (&array);
+}
 
-	/* divide the value by the number of samples to make the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) != 0)
-			up_stats_item_set_value (stats, up_stats_item_get_value (stats) / up_stats_item_get_accuracy (stats));
+/**
+ * up_history_profile_reset:
+ **/
+static void
+up_history_profile_reset (UpHistoryProfile *profile)
+{
+	memset (profile, 0, sizeof (UpHistoryProfile));
+	profile->oldbin = 999;
+}
+
+/**
+ * up_history_profile_add:
+ *
+ * Adds a charge sample to the profile; a step is only counted when the
+ * percentage moved to a different bin by a plausible amount without a
+ * change of state in between.
+ **/
+static void
+up_history_profile_add (UpHistoryProfile *profile, guint time, gdouble value, UpDeviceState state)
+{
+	UpHistoryProfileBin *bins = NULL;
+	gdouble diff;
+	guint bin;
+
+	if (!profile->have_last || state != profile->last_state) {
+		profile->have_old = FALSE;
+		goto out;
 	}
 
+	/* round to the nearest int */
+	bin = rint (value);
+
+	/* ensure bin is in range */
+	if (bin >= UP_HISTORY_PROFILE_BINS)
+		bin = UP_HISTORY_PROFILE_BINS - 1;
+
+	/* same */
+	if (profile->oldbin == bin)
+		goto out;
+	profile->oldbin = bin;
+
+	if (profile->have_old) {
+		/* not enough or too much difference */
+		diff = fabs (value - profile->old_value);
+		if (diff < 0.01f || diff > 3.0f) {
+			profile->have_old = FALSE;
+			goto out;
+		}
+
+		if (state == UP_DEVICE_STATE_CHARGING)
+			bins = profile->charging;
+		else if (state == UP_DEVICE_STATE_DISCHARGING)
+			bins = profile->discharging;
+		if (bins != NULL) {
+			bins[bin].time_sum += time - profile->old_time;
+			bins[bin].count++;
+			bins[bin].changed = TRUE;
+		}
+	}
+	profile->have_old = TRUE;
+	profile->old_time = time;
+	profile->old_value = value;
+out:
+	profile->have_last = TRUE;
+	profile->last_state = state;
+}
+
+/**
+ * up_history_get_profile_data:
+ **/
+GPtrArray *
+up_history_get_profile_data (UpHistory *history, gboolean charging)
+{
+	guint i;
+	guint non_zero_accuracy = 0;
+	gfloat average = 0.0f;
+	const UpHistoryProfileBin *bins;
+	UpStatsItem *stats;
+	GPtrArray *data;
+	gdouble total_value = 0.0f;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	if (charging)
+		bins = history->priv->profile.charging;
+	else
+		bins = history->priv->profile.discharging;
+
 	/* find non-zero accuracy values for the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) > 0) {
-			total_value += up_stats_item_get_value (stats);
+	for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++) {
+		if (bins[i].count > 0) {
+			total_value += (gdouble) bins[i].time_sum / bins[i].count;
 			non_zero_accuracy++;
 		}
 	}
@@ -372,234 +1086,1039 @@ cont:
 		average = total_value / non_zero_accuracy;
 	g_debug ("average is %f", average);
 
-	/* make the values a factor of 0, so that 1.0 is twice the
-	 * average, and -1.0 is half the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) > 0)
-			up_stats_item_set_value (stats, (up_stats_item_get_value (stats) - average) / average);
+	data = g_ptr_array_new_full (UP_HISTORY_PROFILE_BINS, g_object_unref);
+	for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++) {
+		stats = up_stats_item_new ();
+
+		/* make the values a factor of 0, so that 1.0 is twice the
+		 * average, and -1.0 is half the average */
+		if (bins[i].count > 0) {
+			gdouble value = (gdouble) bins[i].time_sum / bins[i].count;
+			up_stats_item_set_value (stats, (value - average) / average);
+		}
+
+		/* accuracy is a percentage scale, where each cycle = 20% */
+		up_stats_item_set_accuracy (stats, bins[i].count * 20.0f);
+		g_ptr_array_add (data, stats);
+	}
+
+	return data;
+}
+
+/**
+ * up_history_build_filename:
+ * @type: (nullable): the series, or %NULL for the file of the device
+ **/
+static gchar *
+up_history_build_filename (const gchar *dir, const gchar *id, const gchar *type, const gchar *suffix)
+{
+	gchar *path;
+	gchar *filename;
+
+	if (type == NULL)
+		filename = g_strdup_printf ("history-%s.%s", id, suffix);
+	else
+		filename = g_strdup_printf ("history-%s-%s.%s", type, id, suffix);
+	path = g_build_filename (dir, filename, NULL);
+	g_free (filename);
+	return path;
+}
+
+/**
+ * up_history_get_filename:
+ **/
+static gchar *
+up_history_get_filename (UpHistory *history, const gchar *type, const gchar *suffix)
+{
+	return up_history_build_filename (history->priv->dir, history->priv->id, type, suffix);
+}
+
+/**
+ * up_history_set_directory:
+ **/
+void
+up_history_set_directory (UpHistory *history, const gchar *dir)
+{
+	g_free (history->priv->dir);
+	history->priv->dir = g_strdup (dir);
+	g_mkdir_with_parents (dir, 0755);
+}
+
+/**
+ * up_history_set_writer:
+ * @writer: (nullable): a #UpHistoryWriter
+ *
+ * Lets @writer save the history together with the ones of other devices,
+ * instead of the history scheduling its own saves.
+ **/
+void
+up_history_set_writer (UpHistory *history, UpHistoryWriter *writer)
+{
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	if (history->priv->writer != NULL)
+		up_history_writer_remove (history->priv->writer, history);
+	g_set_object (&history->priv->writer, writer);
+}
+
+/**
+ * up_history_map_file:
+ * @header: the expected file header
+ *
+ * Maps a file into memory, the records are used straight from the mapping.
+ **/
+static GMappedFile *
+up_history_map_file (const gchar *filename, const gchar *header, GError **error)
+{
+	GMappedFile *mapped;
+
+	mapped = g_mapped_file_new (filename, FALSE, error);
+	if (mapped == NULL)
+		return NULL;
+
+	if (g_mapped_file_get_length (mapped) < UP_HISTORY_FILE_HEADER_SIZE ||
+	    memcmp (g_mapped_file_get_contents (mapped), header,
+		    UP_HISTORY_FILE_HEADER_SIZE) != 0) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			     "invalid history file %s", filename);
+		g_mapped_file_unref (mapped);
+		return NULL;
+	}
+	return mapped;
+}
+
+/**
+ * up_history_append_to_file:
+ **/
+static gboolean
+up_history_append_to_file (const gchar *filename, gconstpointer data, gsize len, GError **error)
+{
+	g_autoptr(GFile) file = NULL;
+	g_autoptr(GFileOutputStream) stream = NULL;
+
+	file = g_file_new_for_path (filename);
+	stream = g_file_append_to (file, G_FILE_CREATE_NONE, NULL, error);
+	if (stream == NULL)
+		return FALSE;
+	if (!g_output_stream_write_all (G_OUTPUT_STREAM (stream),
+					data, len, NULL, NULL, error))
+		return FALSE;
+	return g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, error);
+}
+
+/**
+ * up_history_chunk_add:
+ * @buffer: the #GByteArray to append to
+ * @type: a #UpHistoryType or %UP_HISTORY_CHUNK_PROFILE
+ * @len: the number of records that follow
+ **/
+static void
+up_history_chunk_add (GByteArray *buffer, guint type, guint len)
+{
+	UpHistoryChunk chunk;
+
+	chunk.type = GUINT32_TO_LE (type);
+	chunk.len = GUINT32_TO_LE (len);
+	g_byte_array_append (buffer, (const guint8 *) &chunk, sizeof (chunk));
+}
+
+/**
+ * up_history_series_to_chunk:
+ * @start: the first record to write
+ *
+ * Appends a chunk with the records of @series from @start onwards.
+ **/
+static void
+up_history_series_to_chunk (UpHistorySeries *series, UpHistoryType type, guint start, GByteArray *buffer)
+{
+	guint start_data = 0;
+
+	if (start >= up_history_series_get_length (series))
+		return;
+
+	up_history_chunk_add (buffer, type, up_history_series_get_length (series) - start);
+	if (start < series->mapped_len) {
+		g_byte_array_append (buffer, (const guint8 *) &series->mapped_data[start],
+				     (series->mapped_len - start) * sizeof (UpHistoryRecord));
+	} else {
+		start_data = start - series->mapped_len;
+	}
+	up_history_ring_to_records (&series->data, start_data, buffer);
+}
+
+/**
+ * up_history_profile_to_chunk:
+ * @type: %UP_HISTORY_CHUNK_PROFILE or %UP_HISTORY_CHUNK_PROFILE_DELTA
+ * @all: %TRUE to write all bins, %FALSE for the ones changed since
+ *
+ * Appends a chunk with the bins of the profile. The bins in a profile
+ * chunk override the ones of the earlier chunks, while the ones in a delta
+ * chunk are added to them and are cleared once written.
+ **/
+static void
+up_history_profile_to_chunk (UpHistoryProfile *profile, guint type, gboolean all, GByteArray *buffer)
+{
+	UpHistoryProfileBin *bins[] = { profile->charging, profile->discharging };
+	UpHistoryProfileRecord record;
+	guint offset;
+	guint len = 0;
+	guint i, j;
+
+	offset = buffer->len;
+	up_history_chunk_add (buffer, type, 0);
+	for (j = 0; j < G_N_ELEMENTS (bins); j++) {
+		for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++) {
+			UpHistoryProfileBin *bin = &bins[j][i];
+
+			if (all ? bin->count == 0 : !bin->changed)
+				continue;
+			record.bin = GUINT32_TO_LE (j * UP_HISTORY_PROFILE_BINS + i);
+			record.count = GUINT32_TO_LE (bin->count);
+			record.time_sum = GUINT64_TO_LE (bin->time_sum);
+			g_byte_array_append (buffer, (const guint8 *) &record, sizeof (record));
+			bin->changed = FALSE;
+			if (type == UP_HISTORY_CHUNK_PROFILE_DELTA) {
+				bin->time_sum = 0;
+				bin->count = 0;
+			}
+			len++;
+		}
+	}
+
+	/* nothing to write */
+	if (len == 0) {
+		g_byte_array_set_size (buffer, offset);
+		return;
+	}
+	((UpHistoryChunk *) (buffer->data + offset))->len = GUINT32_TO_LE (len);
+}
+
+/**
+ * up_history_profile_from_chunk:
+ * @delta: %TRUE to add the records to the bins
+ **/
+static void
+up_history_profile_from_chunk (UpHistoryProfile *profile, const UpHistoryProfileRecord *records, guint len, gboolean delta)
+{
+	guint i;
+
+	for (i = 0; i < len; i++) {
+		UpHistoryProfileBin *bin;
+		guint idx = GUINT32_FROM_LE (records[i].bin);
+
+		if (idx >= 2 * UP_HISTORY_PROFILE_BINS)
+			continue;
+		if (idx < UP_HISTORY_PROFILE_BINS)
+			bin = &profile->charging[idx];
 		else
-			up_stats_item_set_value (stats, 0.0f);
+			bin = &profile->discharging[idx - UP_HISTORY_PROFILE_BINS];
+		if (!delta) {
+			bin->count = 0;
+			bin->time_sum = 0;
+		}
+		bin->count += GUINT32_FROM_LE (records[i].count);
+		bin->time_sum += GUINT64_FROM_LE (records[i].time_sum);
+	}
+}
+
+/**
+ * up_history_profile_merge:
+ *
+ * Adds the bins of @other to @profile, the bins that have not been saved
+ * in either are not saved in @profile.
+ **/
+static void
+up_history_profile_merge (UpHistoryProfile *profile, const UpHistoryProfile *other)
+{
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++) {
+		profile->charging[i].time_sum += other->charging[i].time_sum;
+		profile->charging[i].count += other->charging[i].count;
+		profile->charging[i].changed |= other->charging[i].changed;
+		profile->discharging[i].time_sum += other->discharging[i].time_sum;
+		profile->discharging[i].count += other->discharging[i].count;
+		profile->discharging[i].changed |= other->discharging[i].changed;
 	}
+}
 
-	/* accuracy is a percentage scale, where each cycle = 20% */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) * 20.0f);
+/**
+ * up_history_load_new:
+ *
+ * The data on disk is read into a #UpHistoryLoad in a worker thread, and
+ * only handed to the series once it is complete.
+ **/
+static UpHistoryLoad *
+up_history_load_new (const gchar *dir, const gchar *id)
+{
+	UpHistoryLoad *load = g_new0 (UpHistoryLoad, 1);
+	guint i;
+
+	load->dir = g_strdup (dir);
+	load->id = g_strdup (id);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		load->records[i] = g_byte_array_new ();
+	up_history_profile_reset (&load->profile);
+	return load;
+}
+
+/**
+ * up_history_load_free:
+ **/
+static void
+up_history_load_free (UpHistoryLoad *load)
+{
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		g_clear_pointer (&load->mapped[i], g_mapped_file_unref);
+		g_byte_array_unref (load->records[i]);
+	}
+	g_free (load->dir);
+	g_free (load->id);
+	g_free (load);
+}
+
+/**
+ * up_history_load_get_length:
+ **/
+static guint
+up_history_load_get_length (UpHistoryLoad *load, UpHistoryType type)
+{
+	return load->mapped_len[type] + load->records[type]->len / sizeof (UpHistoryRecord);
+}
+
+/**
+ * up_history_load_get_record:
+ **/
+static const UpHistoryRecord *
+up_history_load_get_record (UpHistoryLoad *load, UpHistoryType type, guint idx)
+{
+	if (idx < load->mapped_len[type])
+		return &load->mapped_data[type][idx];
+	return &((const UpHistoryRecord *) load->records[type]->data)[idx - load->mapped_len[type]];
+}
+
+/**
+ * up_history_chunk_next:
+ * @offset: (inout): the offset of the chunk, moved past it
+ *
+ * Return value: the records of the chunk, or %NULL if it is incomplete
+ **/
+static const gchar *
+up_history_chunk_next (const gchar *contents, gsize length, gsize *offset, guint *type, guint *len)
+{
+	const UpHistoryChunk *chunk;
+	const gchar *data;
+
+	if (length - *offset < sizeof (UpHistoryChunk))
+		return NULL;
+	chunk = (const UpHistoryChunk *) (contents + *offset);
+	*type = GUINT32_FROM_LE (chunk->type);
+	*len = GUINT32_FROM_LE (chunk->len);
+
+	/* both kinds of records have the same size */
+	if ((length - *offset - sizeof (UpHistoryChunk)) / sizeof (UpHistoryRecord) < *len)
+		return NULL;
+	data = contents + *offset + sizeof (UpHistoryChunk);
+	*offset += sizeof (UpHistoryChunk) + (gsize) *len * sizeof (UpHistoryRecord);
+	return data;
+}
+
+/**
+ * up_history_load_file:
+ *
+ * Maps the history file of the device. The first chunk of each series is
+ * used straight from the mapping, the records of the chunks appended after
+ * it are copied.
+ **/
+static gboolean
+up_history_load_file (UpHistoryLoad *load, const gchar *filename, GError **error)
+{
+	GMappedFile *mapped;
+	const gchar *contents;
+	gsize length;
+	const gchar *data;
+	gsize offset = UP_HISTORY_FILE_HEADER_SIZE;
+	guint type;
+	guint len;
+
+	mapped = up_history_map_file (filename, UP_HISTORY_FILE_HEADER, error);
+	if (mapped == NULL)
+		return FALSE;
+	contents = g_mapped_file_get_contents (mapped);
+	length = g_mapped_file_get_length (mapped);
+
+	while ((data = up_history_chunk_next (contents, length, &offset, &type, &len)) != NULL) {
+		if (type < UP_HISTORY_TYPE_UNKNOWN) {
+			if (load->mapped[type] == NULL) {
+				load->mapped[type] = g_mapped_file_ref (mapped);
+				load->mapped_data[type] = (const UpHistoryRecord *) data;
+				load->mapped_len[type] = len;
+				continue;
+			}
+			g_byte_array_append (load->records[type], (const guint8 *) data,
+					     len * sizeof (UpHistoryRecord));
+		} else if (type == UP_HISTORY_CHUNK_PROFILE ||
+			   type == UP_HISTORY_CHUNK_PROFILE_DELTA) {
+			up_history_profile_from_chunk (&load->profile,
+						       (const UpHistoryProfileRecord *) data, len,
+						       type == UP_HISTORY_CHUNK_PROFILE_DELTA);
+		} else {
+			g_debug ("ignoring chunk of unknown type %u", type);
+		}
+	}
+	g_mapped_file_unref (mapped);
+
+	g_debug ("loaded data from %s", filename);
+	load->complete = offset == length;
+	return TRUE;
+}
+
+/**
+ * up_history_series_from_legacy_file:
+ * @records: the #GByteArray to append the records to
+ * @filename: a filename
+ *
+ * Appends the records from a text file written by older versions
+ **/
+static gboolean
+up_history_series_from_legacy_file (GByteArray *records, const gchar *filename)
+{
+	gboolean ret;
+	GError *error = NULL;
+	gchar *data = NULL;
+	gchar **parts = NULL;
+	guint i;
+	guint length;
+
+	/* get contents */
+	ret = g_file_get_contents (filename, &data, NULL, &error);
+	if (!ret) {
+		g_warning ("failed to get data: %s", error->message);
+		g_error_free (error);
+		goto out;
+	}
+
+	/* split by line ending */
+	parts = g_strsplit (data, "\n", 0);
+	length = g_strv_length (parts);
+	if (length == 0) {
+		g_debug ("no data in %s", filename);
+		goto out;
+	}
+
+	/* add valid entries */
+	g_debug ("loading %i items of data from %s", length, filename);
+	for (i=0; i<length-1; i++) {
+		g_auto(GStrv) fields = NULL;
+		UpHistoryRecord record;
+
+		/* split by tab */
+		fields = g_strsplit (parts[i], "\t", 0);
+		if (g_strv_length (fields) != 3) {
+			g_warning ("invalid string: '%s'", parts[i]);
+			continue;
+		}
+		up_history_record_set (&record,
+				       atoi (fields[0]),
+				       atof (fields[1]),
+				       up_device_state_from_string (fields[2]));
+		g_byte_array_append (records, (const guint8 *) &record, sizeof (record));
+	}
+
+out:
+	g_strfreev (parts);
+	g_free (data);
+	return ret;
+}
+
+/**
+ * up_history_series_from_log_file:
+ * @filename: a filename
+ *
+ * Maps a log of a single series written by older versions.
+ **/
+static gboolean
+up_history_series_from_log_file (UpHistoryLoad *load, UpHistoryType type, const gchar *filename)
+{
+	GMappedFile *mapped;
+	g_autoptr(GError) error = NULL;
+
+	mapped = up_history_map_file (filename, UP_HISTORY_SERIES_FILE_HEADER, &error);
+	if (mapped == NULL) {
+		g_warning ("failed to get data: %s", error->message);
+		return FALSE;
+	}
+
+	/* an incomplete record at the end is dropped */
+	load->mapped[type] = mapped;
+	load->mapped_data[type] = (const UpHistoryRecord *) (g_mapped_file_get_contents (mapped) + UP_HISTORY_FILE_HEADER_SIZE);
+	load->mapped_len[type] = (g_mapped_file_get_length (mapped) - UP_HISTORY_FILE_HEADER_SIZE) / sizeof (UpHistoryRecord);
+	g_debug ("loading %i items of data from %s", load->mapped_len[type], filename);
+	return TRUE;
+}
+
+/**
+ * up_history_profile_from_file:
+ *
+ * Return value: %FALSE if there is no usable profile written by older versions
+ **/
+static gboolean
+up_history_profile_from_file (UpHistoryProfile *profile, const gchar *filename)
+{
+	UpHistoryProfileBin *bins[] = { profile->charging, profile->discharging };
+	const guint8 *record;
+	g_autofree gchar *contents = NULL;
+	gsize length;
+	guint i, j;
+
+	if (!g_file_get_contents (filename, &contents, &length, NULL))
+		return FALSE;
+	if (length != UP_HISTORY_FILE_HEADER_SIZE + 2 * UP_HISTORY_PROFILE_BINS * 16 ||
+	    memcmp (contents, UP_HISTORY_PROFILE_FILE_HEADER, UP_HISTORY_FILE_HEADER_SIZE) != 0) {
+		g_warning ("ignoring invalid profile %s", filename);
+		return FALSE;
+	}
+
+	/* each bin is the sum of the times followed by the count */
+	record = (const guint8 *) contents + UP_HISTORY_FILE_HEADER_SIZE;
+	for (j = 0; j < G_N_ELEMENTS (bins); j++) {
+		for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++, record += 16) {
+			bins[j][i].time_sum = GUINT64_FROM_LE (*(const guint64 *) record);
+			bins[j][i].count = GUINT32_FROM_LE (*(const guint32 *) (record + 8));
+		}
+	}
+	g_debug ("loaded profile from %s", filename);
+	return TRUE;
+}
+
+/**
+ * up_history_load_legacy_files:
+ *
+ * Reads the files with one series each that older versions wrote, they are
+ * removed once the data has been written to the history file.
+ **/
+static void
+up_history_load_legacy_files (UpHistoryLoad *load)
+{
+	g_autofree gchar *filename_profile = NULL;
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		g_autofree gchar *filename = NULL;
+		g_autofree gchar *filename_legacy = NULL;
+
+		filename = up_history_build_filename (load->dir, load->id, up_history_type_names[i], "bin");
+		if (g_file_test (filename, G_FILE_TEST_EXISTS)) {
+			g_debug ("converting %s", filename);
+			up_history_series_from_log_file (load, i, filename);
+			continue;
+		}
+		filename_legacy = up_history_build_filename (load->dir, load->id, up_history_type_names[i], "dat");
+		if (g_file_test (filename_legacy, G_FILE_TEST_EXISTS)) {
+			g_debug ("converting %s", filename_legacy);
+			up_history_series_from_legacy_file (load->records[i], filename_legacy);
+			continue;
+		}
+		g_debug ("failed to get data from %s as file does not exist", filename);
+	}
+
+	/* the profile only has to be rebuilt when it has not been written yet */
+	filename_profile = up_history_build_filename (load->dir, load->id, "profile", "bin");
+	if (!up_history_profile_from_file (&load->profile, filename_profile)) {
+		for (i = 0; i < up_history_load_get_length (load, UP_HISTORY_TYPE_CHARGE); i++) {
+			const UpHistoryRecord *record = up_history_load_get_record (load, UP_HISTORY_TYPE_CHARGE, i);
+
+			up_history_profile_add (&load->profile,
+						up_history_record_get_time (record),
+						up_history_record_get_value (record),
+						up_history_record_get_state (record));
+		}
+	}
+	load->legacy = TRUE;
+}
+
+/**
+ * up_history_get_legacy_files:
+ **/
+static GStrv
+up_history_get_legacy_files (UpHistory *history)
+{
+	g_autoptr(GPtrArray) filenames = g_ptr_array_new ();
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		g_ptr_array_add (filenames, up_history_get_filename (history, up_history_type_names[i], "bin"));
+		g_ptr_array_add (filenames, up_history_get_filename (history, up_history_type_names[i], "dat"));
+	}
+	g_ptr_array_add (filenames, up_history_get_filename (history, "profile", "bin"));
+	g_ptr_array_add (filenames, NULL);
+	return (GStrv) g_ptr_array_free (g_steal_pointer (&filenames), FALSE);
+}
+
+/**
+ * up_history_apply_load:
+ * @pending: the number of the newest samples to keep for each series
+ *
+ * Replaces the samples of each series by the ones in @load, followed by
+ * the @pending samples that were added after @load was started.
+ **/
+static void
+up_history_apply_load (UpHistory *history, UpHistoryLoad *load, const guint *pending)
+{
+	guint i, j;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		UpHistorySeries *series = &history->priv->series[i];
+		g_autoptr(GByteArray) kept = g_byte_array_new ();
+		guint len;
+
+		up_history_ring_to_records (&series->data,
+					    series->data.len - MIN (pending[i], series->data.len),
+					    kept);
+		up_history_series_set_mapped (series, load->mapped[i],
+					      load->mapped_data[i], load->mapped_len[i]);
+
+		len = load->records[i]->len / sizeof (UpHistoryRecord);
+		for (j = 0; j < len; j++) {
+			const UpHistoryRecord *record = &((const UpHistoryRecord *) load->records[i]->data)[j];
+
+			up_history_series_add (series,
+					       up_history_record_get_time (record),
+					       up_history_record_get_value (record),
+					       up_history_record_get_state (record));
+		}
+		series->saved_len = series->data.len;
+
+		len = kept->len / sizeof (UpHistoryRecord);
+		for (j = 0; j < len; j++) {
+			const UpHistoryRecord *record = &((const UpHistoryRecord *) kept->data)[j];
+
+			up_history_series_add (series,
+					       up_history_record_get_time (record),
+					       up_history_record_get_value (record),
+					       up_history_record_get_state (record));
+		}
+	}
+}
+
+/**
+ * up_history_series_get_expired:
+ *
+ * Return value: the number of records older than @max_data_age
+ **/
+static guint
+up_history_series_get_expired (UpHistorySeries *series, gint64 time_now, guint max_data_age)
+{
+	guint length;
+	guint i;
+
+	/* the records are sorted, so the expired ones are at the start */
+	length = up_history_series_get_length (series);
+	for (i = 0; i < length; i++) {
+		if (time_now - up_history_series_get_time (series, i) <= max_data_age)
+			break;
+	}
+	return i;
+}
+
+/**
+ * up_history_save_free:
+ **/
+static void
+up_history_save_free (UpHistorySave *save)
+{
+	g_free (save->filename);
+	g_byte_array_unref (save->buffer);
+	g_strfreev (save->legacy_files);
+	g_clear_pointer (&save->load, up_history_load_free);
+	g_clear_error (&save->error);
+	g_free (save);
+}
+
+/**
+ * up_history_save_prepare:
+ *
+ * Takes a snapshot of the data to save, so that it can be written without
+ * looking at the series. That is one chunk for each series with records
+ * that are not on disk yet and one for the changed bins of the profile, to
+ * be appended in a single write. The file is only written from scratch
+ * when at least half of a series is older than the maximum data age, so
+ * that the cost of a save stays proportional to the number of new records.
+ *
+ * Return value: %NULL if there is nothing to save
+ **/
+static UpHistorySave *
+up_history_save_prepare (UpHistory *history)
+{
+	UpHistoryPrivate *priv = history->priv;
+	guint cull_count[UP_HISTORY_TYPE_UNKNOWN];
+	UpHistorySave *save;
+	gint64 time_now;
+	guint i;
+
+	save = g_new0 (UpHistorySave, 1);
+	save->filename = up_history_get_filename (history, NULL, "bin");
+	save->buffer = g_byte_array_new ();
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		save->added[i] = priv->series[i].added;
+
+	/* only the new records are known, append them to whatever is on disk */
+	if (!priv->loaded) {
+		save->unloaded = TRUE;
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+			UpHistorySeries *series = &priv->series[i];
+
+			up_history_series_to_chunk (series, i, series->saved_len, save->buffer);
+			save->max_size += 2 * series->capacity * sizeof (UpHistoryRecord);
+		}
+		save->profile_delta = priv->profile;
+		up_history_profile_to_chunk (&priv->profile, UP_HISTORY_CHUNK_PROFILE_DELTA,
+					     FALSE, save->buffer);
+		if (save->buffer->len == 0) {
+			up_history_save_free (save);
+			return NULL;
+		}
+		return save;
+	}
+
+	/* get current time */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		UpHistorySeries *series = &priv->series[i];
+		guint length = up_history_series_get_length (series);
+
+		cull_count[i] = up_history_series_get_expired (series, time_now, priv->max_data_age);
+		if (cull_count[i] > 0 && cull_count[i] * 2 >= length) {
+			g_debug ("culled %i of %i", cull_count[i], length);
+			priv->rewrite = TRUE;
+		}
+	}
+
+	/* someone removed the file behind our back */
+	if (!priv->rewrite && !g_file_test (save->filename, G_FILE_TEST_EXISTS))
+		priv->rewrite = TRUE;
+
+	save->rewrite = priv->rewrite;
+	if (save->rewrite) {
+		g_byte_array_append (save->buffer, (const guint8 *) UP_HISTORY_FILE_HEADER,
+				     UP_HISTORY_FILE_HEADER_SIZE);
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+			up_history_series_to_chunk (&priv->series[i], i, cull_count[i], save->buffer);
+		up_history_profile_to_chunk (&priv->profile, UP_HISTORY_CHUNK_PROFILE,
+					     TRUE, save->buffer);
+		if (priv->legacy)
+			save->legacy_files = up_history_get_legacy_files (history);
+		return save;
+	}
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		UpHistorySeries *series = &priv->series[i];
+
+		up_history_series_to_chunk (series, i,
+					    series->mapped_len + series->saved_len,
+					    save->buffer);
+	}
+	up_history_profile_to_chunk (&priv->profile, UP_HISTORY_CHUNK_PROFILE,
+				     FALSE, save->buffer);
+
+	/* nothing changed */
+	if (save->buffer->len == 0) {
+		up_history_save_free (save);
+		return NULL;
 	}
-
-	return data;
+	return save;
 }
 
 /**
- * up_history_get_filename:
+ * up_history_save_append_unloaded:
+ *
+ * Appends to a file that has not been loaded, after dropping an incomplete
+ * chunk at its end that would hide the ones appended after it.
  **/
-static gchar *
-up_history_get_filename (UpHistory *history, const gchar *type)
+static gboolean
+up_history_save_append_unloaded (UpHistorySave *save, GError **error)
 {
-	gchar *path;
-	gchar *filename;
+	GMappedFile *mapped;
+	const gchar *contents;
+	gsize offset = UP_HISTORY_FILE_HEADER_SIZE;
+	guint type;
+	guint len;
+
+	mapped = up_history_map_file (save->filename, UP_HISTORY_FILE_HEADER, NULL);
+	if (mapped == NULL) {
+		g_autoptr(GByteArray) buffer = g_byte_array_new ();
+
+		/* nothing that can be kept */
+		g_byte_array_append (buffer, (const guint8 *) UP_HISTORY_FILE_HEADER,
+				     UP_HISTORY_FILE_HEADER_SIZE);
+		g_byte_array_append (buffer, save->buffer->data, save->buffer->len);
+		return g_file_set_contents (save->filename, (const gchar *) buffer->data, buffer->len, error);
+	}
 
-	filename = g_strdup_printf ("history-%s-%s.dat", type, history->priv->id);
-	path = g_build_filename (history->priv->dir, filename, NULL);
-	g_free (filename);
-	return path;
+	/* only the chunk headers are looked at */
+	contents = g_mapped_file_get_contents (mapped);
+	save->size = g_mapped_file_get_length (mapped);
+	while (up_history_chunk_next (contents, save->size, &offset, &type, &len) != NULL)
+		;
+	g_mapped_file_unref (mapped);
+
+	if (offset != save->size) {
+		g_warning ("ignoring incomplete chunk at the end of %s", save->filename);
+		if (truncate (save->filename, offset) < 0) {
+			int errsv = errno;
+
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+				     "failed to truncate %s: %s", save->filename, g_strerror (errsv));
+			return FALSE;
+		}
+	}
+	return up_history_append_to_file (save->filename, save->buffer->data, save->buffer->len, error);
 }
 
 /**
- * up_history_set_directory:
+ * up_history_save_write:
+ *
+ * Writes the snapshot, this does not touch the #UpHistory so that it can
+ * run in a worker thread.
  **/
-void
-up_history_set_directory (UpHistory *history, const gchar *dir)
+static gboolean
+up_history_save_write (UpHistorySave *save, GError **error)
 {
-	g_free (history->priv->dir);
-	history->priv->dir = g_strdup (dir);
-	g_mkdir_with_parents (dir, 0755);
+	guint i;
+
+	if (save->unloaded)
+		return up_history_save_append_unloaded (save, error);
+	if (!save->rewrite)
+		return up_history_append_to_file (save->filename, save->buffer->data, save->buffer->len, error);
+
+	if (!g_file_set_contents (save->filename, (const gchar *) save->buffer->data, save->buffer->len, error))
+		return FALSE;
+
+	/* the files of older versions have been converted */
+	for (i = 0; save->legacy_files != NULL && save->legacy_files[i] != NULL; i++)
+		g_unlink (save->legacy_files[i]);
+
+	/* use the new file as backing store */
+	save->load = up_history_load_new (NULL, NULL);
+	return up_history_load_file (save->load, save->filename, error);
 }
 
 /**
- * up_history_array_to_file:
- * @list: a valid #GPtrArray instance
- * @filename: a filename
+ * up_history_save_complete:
  *
- * Saves a copy of the list to a file
+ * Updates the series once the snapshot has been written.
  **/
 static gboolean
-up_history_array_to_file (UpHistory *history, GPtrArray *list, const gchar *filename)
+up_history_save_complete (UpHistory *history, UpHistorySave *save, const GError *error)
 {
+	UpHistoryPrivate *priv = history->priv;
+	guint pending[UP_HISTORY_TYPE_UNKNOWN];
 	guint i;
-	UpHistoryItem *item;
-	gchar *part;
-	GString *string;
-	gboolean ret = TRUE;
-	GError *error = NULL;
-	gint64 time_now;
-	guint time_item;
-	guint cull_count = 0;
 
-	/* get current time */
-	time_now = g_get_real_time ();
+	if (error != NULL) {
+		g_warning ("failed to set data: %s", error->message);
+		/* we do not know how much ended up on disk */
+		priv->rewrite = TRUE;
+		if (save->unloaded)
+			up_history_profile_merge (&priv->profile, &save->profile_delta);
+		return FALSE;
+	}
 
-	/* generate data */
-	string = g_string_new ("");
-	for (i=0; i<list->len; i++) {
-		item = g_ptr_array_index (list, i);
+	/* samples can be added while the snapshot is written */
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		pending[i] = priv->series[i].added - save->added[i];
 
-		/* only save entries for the last 24 hours */
-		time_item = up_history_item_get_time (item);
-		if ((time_now / 1000000) - time_item > history->priv->max_data_age) {
-			cull_count++;
-			continue;
-		}
-		part = up_history_item_to_string (item);
-		if (part == NULL) {
-			ret = FALSE;
-			break;
+	if (save->rewrite) {
+		up_history_apply_load (history, save->load, pending);
+		priv->rewrite = FALSE;
+		priv->legacy = FALSE;
+	} else {
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+			UpHistorySeries *series = &priv->series[i];
+
+			series->saved_len = series->data.len - MIN (pending[i], series->data.len);
 		}
-		g_string_append_printf (string, "%s\n", part);
-		g_free (part);
 	}
-	part = g_string_free (string, FALSE);
-
-	/* how many did we kill? */
-	g_debug ("culled %i of %i", cull_count, list->len);
+	g_debug ("saved %s", save->filename);
 
-	/* we failed to convert to string */
-	if (!ret) {
-		g_warning ("failed to convert");
-		goto out;
+	/* the expired records are only culled once the file is loaded */
+	if (save->unloaded && save->size > save->max_size) {
+		g_debug ("loading %s to cull it", save->filename);
+		up_history_request_load (history);
 	}
+	return TRUE;
+}
 
-	/* save to disk */
-	ret = g_file_set_contents (filename, part, -1, &error);
-	if (!ret) {
-		g_warning ("failed to set data: %s", error->message);
-		g_error_free (error);
-		goto out;
-	}
-	g_debug ("saved %s", filename);
+/**
+ * up_history_run_task:
+ *
+ * Runs the load or save of @task in a thread, only one at a time.
+ **/
+static void
+up_history_run_task (UpHistory *history, GTask *task, GTaskThreadFunc func)
+{
+	g_assert (history->priv->task == NULL);
 
-out:
-	g_free (part);
-	return ret;
+	history->priv->task = g_object_ref (task);
+	history->priv->task_done = FALSE;
+	g_task_run_in_thread (task, func);
 }
 
 /**
- * up_history_array_from_file:
- * @list: a valid #GPtrArray instance
- * @filename: a filename
+ * up_history_task_done:
  *
- * Appends the list from a file
+ * Called in the thread once it is done with the task data.
  **/
-static gboolean
-up_history_array_from_file (GPtrArray *list, const gchar *filename)
+static void
+up_history_task_done (UpHistory *history)
 {
-	gboolean ret;
-	GError *error = NULL;
-	gchar *data = NULL;
-	gchar **parts = NULL;
-	guint i;
-	guint length;
-	UpHistoryItem *item;
-
-	/* do we exist */
-	ret = g_file_test (filename, G_FILE_TEST_EXISTS);
-	if (!ret) {
-		g_debug ("failed to get data from %s as file does not exist", filename);
-		goto out;
-	}
+	g_mutex_lock (&history->priv->task_lock);
+	history->priv->task_done = TRUE;
+	g_cond_signal (&history->priv->task_cond);
+	g_mutex_unlock (&history->priv->task_lock);
+}
 
-	/* get contents */
-	ret = g_file_get_contents (filename, &data, NULL, &error);
-	if (!ret) {
-		g_warning ("failed to get data: %s", error->message);
-		g_error_free (error);
-		goto out;
-	}
+/**
+ * up_history_task_cb:
+ **/
+static void
+up_history_task_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	UpHistory *history = UP_HISTORY (source_object);
 
-	/* split by line ending */
-	parts = g_strsplit (data, "\n", 0);
-	length = g_strv_length (parts);
-	if (length == 0) {
-		g_debug ("no data in %s", filename);
-		goto out;
-	}
+	/* already finished by up_history_wait_task() */
+	if (history->priv->task != G_TASK (res))
+		return;
+	up_history_finish_task (history);
+}
 
-	/* add valid entries */
-	g_debug ("loading %i items of data from %s", length, filename);
-	for (i=0; i<length-1; i++) {
-		item = up_history_item_new ();
-		ret = up_history_item_set_from_string (item, parts[i]);
-		if (ret)
-			g_ptr_array_add (list, item);
-		else
-			g_object_unref (item);
+/**
+ * up_history_wait_task:
+ *
+ * Blocks until the load or save running in a thread is done and applies
+ * its result right away. The main context is not iterated, as that could
+ * dispatch anything, including the finalization of other histories.
+ **/
+static void
+up_history_wait_task (UpHistory *history)
+{
+	UpHistoryPrivate *priv = history->priv;
+
+	while (priv->task != NULL) {
+		g_mutex_lock (&priv->task_lock);
+		while (!priv->task_done)
+			g_cond_wait (&priv->task_cond, &priv->task_lock);
+		g_mutex_unlock (&priv->task_lock);
+		up_history_finish_task (history);
 	}
-
-out:
-	g_strfreev (parts);
-	g_free (data);
-	return ret;
 }
 
 /**
  * up_history_save_data:
+ *
+ * Saves the data right away, waiting for a load or save that is under way.
  **/
 gboolean
 up_history_save_data (UpHistory *history)
 {
-	gboolean ret = FALSE;
-	gchar *filename_rate = NULL;
-	gchar *filename_charge = NULL;
-	gchar *filename_time_full = NULL;
-	gchar *filename_time_empty = NULL;
-	gchar *filename_voltage = NULL;
+	UpHistorySave *save;
+	g_autoptr(GError) error = NULL;
+	gboolean ret;
 
 	/* we have an ID? */
 	if (history->priv->id == NULL) {
 		g_warning ("no ID, cannot save");
-		goto out;
+		return FALSE;
 	}
 
-	/* get filenames */
-	filename_rate = up_history_get_filename (history, "rate");
-	filename_charge = up_history_get_filename (history, "charge");
-	filename_time_full = up_history_get_filename (history, "time-full");
-	filename_time_empty = up_history_get_filename (history, "time-empty");
-	filename_voltage = up_history_get_filename (history, "voltage");
+	up_history_wait_task (history);
 
-	/* save to disk */
-	ret = up_history_array_to_file (history, history->priv->data_rate, filename_rate);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_charge, filename_charge);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_time_full, filename_time_full);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_time_empty, filename_time_empty);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_voltage, filename_voltage);
-	if (!ret)
-		goto out;
-out:
-	g_free (filename_rate);
-	g_free (filename_charge);
-	g_free (filename_time_full);
-	g_free (filename_time_empty);
-	g_free (filename_voltage);
+	save = up_history_save_prepare (history);
+	if (save == NULL)
+		return TRUE;
+	up_history_save_write (save, &error);
+	ret = up_history_save_complete (history, save, error);
+	up_history_save_free (save);
 	return ret;
 }
 
+/**
+ * up_history_save_thread:
+ **/
+static void
+up_history_save_thread (GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+	UpHistorySave *save = task_data;
+
+	up_history_save_write (save, &save->error);
+	up_history_task_done (UP_HISTORY (source_object));
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * up_history_save_done:
+ **/
+static void
+up_history_save_done (UpHistory *history, UpHistorySave *save)
+{
+	up_history_save_complete (history, save, save->error);
+	history->priv->saving = FALSE;
+
+	/* more was asked for in the meantime */
+	if (history->priv->load_pending)
+		up_history_request_load (history);
+	if (history->priv->save_again)
+		up_history_start_save (history);
+}
+
+/**
+ * up_history_start_save:
+ *
+ * Saves the data in a worker thread. Only the snapshot of the data to save
+ * is taken here, so that the main loop is not blocked by the disk.
+ **/
+void
+up_history_start_save (UpHistory *history)
+{
+	g_autoptr(GTask) task = NULL;
+	UpHistorySave *save;
+
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	/* we have an ID? */
+	if (history->priv->id == NULL) {
+		g_warning ("no ID, cannot save");
+		return;
+	}
+
+	/* one at a time, and only once the data on disk is known */
+	if (history->priv->loading || history->priv->saving) {
+		history->priv->save_again = TRUE;
+		return;
+	}
+	history->priv->save_again = FALSE;
+
+	save = up_history_save_prepare (history);
+	if (save == NULL)
+		return;
+
+	history->priv->saving = TRUE;
+	task = g_task_new (history, NULL, up_history_task_cb, NULL);
+	g_task_set_source_tag (task, up_history_start_save);
+	g_task_set_task_data (task, save, (GDestroyNotify) up_history_save_free);
+	up_history_run_task (history, task, up_history_save_thread);
+}
+
 /**
  * up_history_schedule_save_cb:
  **/
 static gboolean
 up_history_schedule_save_cb (UpHistory *history)
 {
-	up_history_save_data (history);
+	up_history_start_save (history);
 	g_clear_pointer (&history->priv->save_source, g_source_destroy);
 	return FALSE;
 }
@@ -610,25 +2129,25 @@ up_history_schedule_save_cb (UpHistory *history)
 static gboolean
 up_history_is_low_power (UpHistory *history)
 {
+	UpHistorySeries *series;
 	guint length;
-	UpHistoryItem *item;
 
 	/* current status is always up to date */
 	if (history->priv->state != UP_DEVICE_STATE_DISCHARGING)
 		return FALSE;
 
 	/* have we got any data? */
-	length = history->priv->data_charge->len;
+	series = &history->priv->series[UP_HISTORY_TYPE_CHARGE];
+	length = up_history_series_get_length (series);
 	if (length == 0)
 		return FALSE;
 
 	/* get the last saved charge object */
-	item = (UpHistoryItem *) g_ptr_array_index (history->priv->data_charge, length-1);
-	if (up_history_item_get_state (item) != UP_DEVICE_STATE_DISCHARGING)
+	if (up_history_series_get_state (series, length-1) != UP_DEVICE_STATE_DISCHARGING)
 		return FALSE;
 
 	/* high enough */
-	if (up_history_item_get_value (item) > UP_HISTORY_LOW_POWER_PERCENT)
+	if (up_history_series_get_value (series, length-1) > UP_HISTORY_LOW_POWER_PERCENT)
 		return FALSE;
 
 	/* we are low power */
@@ -651,6 +2170,12 @@ up_history_schedule_save (UpHistory *history)
 		timeout = UP_HISTORY_SAVE_INTERVAL_LOW_POWER;
 	}
 
+	/* saved together with the other devices */
+	if (history->priv->writer != NULL) {
+		up_history_writer_queue (history->priv->writer, history, timeout);
+		return TRUE;
+	}
+
 	/* we already have one saved, clear it if it will fire earlier */
 	if (history->priv->save_source) {
 		guint64 ready = g_source_get_ready_time (history->priv->save_source);
@@ -675,48 +2200,185 @@ up_history_schedule_save (UpHistory *history)
 }
 
 /**
- * up_history_load_data:
+ * up_history_load_thread:
  **/
-static gboolean
-up_history_load_data (UpHistory *history)
+static void
+up_history_load_thread (GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
 {
-	gchar *filename;
-	UpHistoryItem *item;
+	UpHistoryLoad *load = task_data;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *filename = NULL;
+
+	filename = up_history_build_filename (load->dir, load->id, NULL, "bin");
+	if (!g_file_test (filename, G_FILE_TEST_EXISTS)) {
+		up_history_load_legacy_files (load);
+	} else if (!up_history_load_file (load, filename, &error)) {
+		g_warning ("failed to get data: %s", error->message);
+	} else if (!load->complete) {
+		/* an interrupted append, appending after it would garble the file */
+		g_warning ("ignoring incomplete chunk at the end of %s", filename);
+	}
+	up_history_task_done (UP_HISTORY (source_object));
+	g_task_return_boolean (task, TRUE);
+}
 
-	/* load rate history from disk */
-	filename = up_history_get_filename (history, "rate");
-	up_history_array_from_file (history->priv->data_rate, filename);
-	g_free (filename);
+/**
+ * up_history_load_done:
+ **/
+static void
+up_history_load_done (UpHistory *history, UpHistoryLoad *load)
+{
+	UpHistoryPrivate *priv = history->priv;
+	guint pending[UP_HISTORY_TYPE_UNKNOWN];
+	guint i;
 
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "charge");
-	up_history_array_from_file (history->priv->data_charge, filename);
-	g_free (filename);
+	/* the samples recorded since are on disk already unless not saved yet,
+	 * and the bins of the profile only hold what has not been saved */
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		pending[i] = priv->series[i].data.len - priv->series[i].saved_len;
+	up_history_apply_load (history, load, pending);
+	up_history_profile_merge (&priv->profile, &load->profile);
+
+	/* the first save writes the file unless it can be appended to */
+	priv->rewrite |= load->legacy || !load->complete;
+	priv->legacy = load->legacy;
+	priv->loading = FALSE;
+	priv->loaded = TRUE;
+
+	for (i = 0; i < priv->load_waiters->len; i++)
+		g_task_return_boolean (g_ptr_array_index (priv->load_waiters, i), TRUE);
+	g_ptr_array_set_size (priv->load_waiters, 0);
+
+	if (priv->save_again)
+		up_history_start_save (history);
+}
 
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "time-full");
-	up_history_array_from_file (history->priv->data_time_full, filename);
-	g_free (filename);
+/**
+ * up_history_finish_task:
+ *
+ * Applies the result of the load or save, which may start the next one.
+ **/
+static void
+up_history_finish_task (UpHistory *history)
+{
+	g_autoptr(GTask) task = g_steal_pointer (&history->priv->task);
 
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "time-empty");
-	up_history_array_from_file (history->priv->data_time_empty, filename);
-	g_free (filename);
+	if (g_task_get_source_tag (task) == up_history_start_save)
+		up_history_save_done (history, g_task_get_task_data (task));
+	else
+		up_history_load_done (history, g_task_get_task_data (task));
+}
 
-	/* load voltage history from disk */
-	filename = up_history_get_filename (history, "voltage");
-	up_history_array_from_file (history->priv->data_voltage, filename);
-	g_free (filename);
+/**
+ * up_history_request_load:
+ *
+ * Reads the files of the device in a worker thread, once no save is
+ * appending to them.
+ **/
+static void
+up_history_request_load (UpHistory *history)
+{
+	g_autoptr(GTask) task = NULL;
+
+	if (history->priv->loaded || history->priv->loading)
+		return;
+	if (history->priv->saving) {
+		history->priv->load_pending = TRUE;
+		return;
+	}
+	history->priv->load_pending = FALSE;
+
+	history->priv->loading = TRUE;
+	task = g_task_new (history, NULL, up_history_task_cb, NULL);
+	g_task_set_source_tag (task, up_history_request_load);
+	g_task_set_task_data (task,
+			      up_history_load_new (history->priv->dir, history->priv->id),
+			      (GDestroyNotify) up_history_load_free);
+	up_history_run_task (history, task, up_history_load_thread);
+}
+
+/**
+ * up_history_load_async:
+ *
+ * Waits for the data on disk to be loaded. This is not done until it is
+ * asked for, as most histories are never looked at.
+ **/
+void
+up_history_load_async (UpHistory *history,
+		       GCancellable *cancellable,
+		       GAsyncReadyCallback callback,
+		       gpointer user_data)
+{
+	g_autoptr(GTask) task = NULL;
+
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	task = g_task_new (history, cancellable, callback, user_data);
+	g_task_set_source_tag (task, up_history_load_async);
+	if (history->priv->loaded || history->priv->id == NULL) {
+		g_task_return_boolean (task, TRUE);
+		return;
+	}
+	g_ptr_array_add (history->priv->load_waiters, g_steal_pointer (&task));
+	up_history_request_load (history);
+}
+
+/**
+ * up_history_load_finish:
+ **/
+gboolean
+up_history_load_finish (UpHistory *history, GAsyncResult *res, GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, history), FALSE);
+
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/**
+ * up_history_has_legacy_files:
+ **/
+static gboolean
+up_history_has_legacy_files (UpHistory *history)
+{
+	g_auto(GStrv) filenames = up_history_get_legacy_files (history);
+	guint i;
+
+	for (i = 0; filenames[i] != NULL; i++) {
+		if (g_file_test (filenames[i], G_FILE_TEST_EXISTS))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * up_history_load_data:
+ *
+ * Starts recording, the new samples are appended to the file without
+ * reading it until the history is asked for.
+ **/
+static gboolean
+up_history_load_data (UpHistory *history)
+{
+	g_autofree gchar *filename = NULL;
+	guint i;
+	guint time_now;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		up_history_series_set_mapped (&history->priv->series[i], NULL, NULL, 0);
+	up_history_profile_reset (&history->priv->profile);
+	history->priv->loaded = FALSE;
+
+	/* the files of older versions cannot be appended to, convert them */
+	filename = up_history_get_filename (history, NULL, "bin");
+	if (!g_file_test (filename, G_FILE_TEST_EXISTS) &&
+	    up_history_has_legacy_files (history))
+		up_history_request_load (history);
 
 	/* save a marker so we don't use incomplete percentages */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	g_ptr_array_add (history->priv->data_rate, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_charge, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_time_full, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_time_empty, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_voltage, g_object_ref (item));
-	g_object_unref (item);
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		up_history_series_add (&history->priv->series[i], time_now, 0, UP_DEVICE_STATE_UNKNOWN);
+	up_history_profile_add (&history->priv->profile, time_now, 0, UP_DEVICE_STATE_UNKNOWN);
 	up_history_schedule_save (history);
 
 	return TRUE;
@@ -739,7 +2401,7 @@ up_history_set_id (UpHistory *history, const gchar *id)
 
 	g_debug ("using id: %s", id);
 	history->priv->id = g_strdup (id);
-	/* load all previous data */
+	/* record from now on, previous data is loaded when needed */
 	ret = up_history_load_data (history);
 	return ret;
 }
@@ -758,14 +2420,32 @@ up_history_set_state (UpHistory *history, UpDeviceState state)
 	return TRUE;
 }
 
+/**
+ * up_history_add_data:
+ **/
+static void
+up_history_add_data (UpHistory *history, UpHistoryType type, gdouble value)
+{
+	guint time_now = g_get_real_time () / G_USEC_PER_SEC;
+
+	up_history_series_add (&history->priv->series[type],
+			       time_now,
+			       value,
+			       history->priv->state);
+	if (type == UP_HISTORY_TYPE_CHARGE)
+		up_history_profile_add (&history->priv->profile,
+					time_now,
+					value,
+					history->priv->state);
+	up_history_schedule_save (history);
+}
+
 /**
  * up_history_set_charge_data:
  **/
 gboolean
 up_history_set_charge_data (UpHistory *history, gdouble percentage)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -776,12 +2456,7 @@ up_history_set_charge_data (UpHistory *history, gdouble percentage)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, percentage);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_charge, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_CHARGE, percentage);
 
 	/* save last value */
 	history->priv->percentage_last = percentage;
@@ -795,8 +2470,6 @@ up_history_set_charge_data (UpHistory *history, gdouble percentage)
 gboolean
 up_history_set_rate_data (UpHistory *history, gdouble rate)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -807,12 +2480,7 @@ up_history_set_rate_data (UpHistory *history, gdouble rate)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, rate);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_rate, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_RATE, rate);
 
 	/* save last value */
 	history->priv->rate_last = rate;
@@ -826,8 +2494,6 @@ up_history_set_rate_data (UpHistory *history, gdouble rate)
 gboolean
 up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -840,12 +2506,7 @@ up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, (gdouble) time_s);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_time_full, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_TIME_FULL, (gdouble) time_s);
 
 	/* save last value */
 	history->priv->time_full_last = time_s;
@@ -859,8 +2520,6 @@ up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 gboolean
 up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -873,12 +2532,7 @@ up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, (gdouble) time_s);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_time_empty, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_TIME_EMPTY, (gdouble) time_s);
 
 	/* save last value */
 	history->priv->time_empty_last = time_s;
@@ -892,8 +2546,6 @@ up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 gboolean
 up_history_set_voltage_data (UpHistory *history, gdouble voltage)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -904,12 +2556,7 @@ up_history_set_voltage_data (UpHistory *history, gdouble voltage)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, voltage);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_voltage, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_VOLTAGE, voltage);
 
 	/* save last value */
 	history->priv->voltage_last = voltage;
@@ -950,12 +2597,11 @@ static void
 up_history_init (UpHistory *history)
 {
 	history->priv = up_history_get_instance_private (history);
-	history->priv->data_rate = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_charge = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_time_full = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_time_empty = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_voltage = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->max_data_age = UP_HISTORY_DEFAULT_MAX_DATA_AGE;
+	history->priv->load_waiters = g_ptr_array_new_with_free_func (g_object_unref);
+	g_mutex_init (&history->priv->task_lock);
+	g_cond_init (&history->priv->task_cond);
+	up_history_profile_reset (&history->priv->profile);
+	up_history_set_max_data_age (history, UP_HISTORY_DEFAULT_MAX_DATA_AGE);
 
 	if (g_getenv ("UPOWER_HISTORY_DIR"))
 		up_history_set_directory (history, g_getenv ("UPOWER_HISTORY_DIR"));
@@ -971,6 +2617,7 @@ static void
 up_history_finalize (GObject *object)
 {
 	UpHistory *history;
+	guint i;
 
 	g_return_if_fail (UP_IS_HISTORY (object));
 
@@ -978,15 +2625,21 @@ up_history_finalize (GObject *object)
 
 	/* save */
 	g_clear_pointer (&history->priv->save_source, g_source_destroy);
+	if (history->priv->writer != NULL)
+		up_history_writer_remove (history->priv->writer, history);
 	if (history->priv->id != NULL)
 		up_history_save_data (history);
+	g_clear_object (&history->priv->writer);
 
-	g_ptr_array_unref (history->priv->data_rate);
-	g_ptr_array_unref (history->priv->data_charge);
-	g_ptr_array_unref (history->priv->data_time_full);
-	g_ptr_array_unref (history->priv->data_time_empty);
-	g_ptr_array_unref (history->priv->data_voltage);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		g_clear_pointer (&history->priv->series[i].mapped, g_mapped_file_unref);
+		up_history_ring_clear (&history->priv->series[i].data);
+		up_history_series_levels_clear (&history->priv->series[i]);
+	}
 
+	g_ptr_array_unref (history->priv->load_waiters);
+	g_mutex_clear (&history->priv->task_lock);
+	g_cond_clear (&history->priv->task_cond);
 	g_free (history->priv->id);
 	g_free (history->priv->dir);
 
@@ -23,6 +23,7 @@
 #define __UP_HISTORY_H
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 #include "up-types.h"
 
@@ -50,6 +51,8 @@ typedef struct
 	GObjectClass		 parent_class;
 } UpHistoryClass;
 
+struct _UpHistoryWriter;
+
 typedef enum {
 	UP_HISTORY_TYPE_CHARGE,
 	UP_HISTORY_TYPE_RATE,
@@ -59,6 +62,11 @@ typedef enum {
 	UP_HISTORY_TYPE_UNKNOWN
 } UpHistoryType;
 
+typedef void	(*UpHistoryDataFunc)			(guint			 time,
+							 gdouble		 value,
+							 UpDeviceState		 state,
+							 gpointer		 user_data);
+
 
 GType		 up_history_get_type			(void);
 gboolean	 up_history_is_device_id_equal		(UpHistory *history,	 const gchar *id);
@@ -68,6 +76,12 @@ GPtrArray	*up_history_get_data			(UpHistory		*history,
 							 UpHistoryType		 type,
 							 guint			 timespan,
 							 guint			 resolution);
+gboolean	 up_history_foreach_data		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint			 timespan,
+							 guint			 resolution,
+							 UpHistoryDataFunc	 func,
+							 gpointer		 user_data);
 GPtrArray	*up_history_get_profile_data		(UpHistory		*history,
 							 gboolean		 charging);
 gboolean	 up_history_set_id			(UpHistory		*history,
@@ -87,9 +101,19 @@ gboolean	 up_history_set_voltage_data		(UpHistory		*history,
 void		 up_history_set_max_data_age		(UpHistory		*history,
 							 guint			 max_data_age);
 gboolean	 up_history_save_data			(UpHistory		*history);
+void		 up_history_start_save			(UpHistory		*history);
+void		 up_history_load_async			(UpHistory		*history,
+							 GCancellable		*cancellable,
+							 GAsyncReadyCallback	 callback,
+							 gpointer		 user_data);
+gboolean	 up_history_load_finish			(UpHistory		*history,
+							 GAsyncResult		*res,
+							 GError			**error);
 
 void		 up_history_set_directory		(UpHistory		*history,
 							 const gchar		*dir);
+void		 up_history_set_writer			(UpHistory		*history,
+							 struct _UpHistoryWriter *writer);
 
 G_END_DECLS
 
@@ -24,14 +24,17 @@
 #include <glib-object.h>
 #include <glib/gstdio.h>
 #include <up-history-item.h>
+#include <up-stats-item.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include "up-backend.h"
 #include "up-daemon.h"
 #include "up-device.h"
+#include "up-device-battery.h"
 #include "up-device-list.h"
 #include "up-history.h"
+#include "up-history-writer.h"
 #include "up-native.h"
 #include "up-polkit.h"
 
@@ -90,6 +93,46 @@ up_test_device_func (void)
 	g_object_unref (device);
 }
 
+static void
+up_test_battery_fit_func (void)
+{
+	gdouble x[13];
+	gdouble y[13];
+	gdouble slope;
+	gdouble confidence;
+	guint i;
+
+	/* a sample every 5 seconds of a battery discharging at 10W */
+	for (i = 0; i < G_N_ELEMENTS (x); i++) {
+		x[i] = (i * 5.0) / 3600;
+		y[i] = 50.0 - 10.0 * x[i];
+	}
+	g_assert (up_device_battery_fit_line (x, y, G_N_ELEMENTS (x), &slope, &confidence));
+	g_assert_cmpfloat_with_epsilon (slope, -10.0, 0.001);
+	g_assert_cmpfloat (confidence, >, 0.99);
+
+	/* noise lowers the confidence, but the samples still agree */
+	for (i = 0; i < G_N_ELEMENTS (x); i++)
+		y[i] += i % 2 ? 0.02 : -0.02;
+	g_assert (up_device_battery_fit_line (x, y, G_N_ELEMENTS (x), &slope, &confidence));
+	g_assert_cmpfloat_with_epsilon (slope, -10.0, 0.5);
+	g_assert_cmpfloat (confidence, >, 0.5);
+	g_assert_cmpfloat (confidence, <, 0.99);
+
+	/* the energy did not change at all */
+	for (i = 0; i < G_N_ELEMENTS (x); i++)
+		y[i] = 42.0;
+	g_assert (up_device_battery_fit_line (x, y, G_N_ELEMENTS (x), &slope, &confidence));
+	g_assert_cmpfloat (slope, ==, 0.0);
+	g_assert_cmpfloat (confidence, ==, 0.0);
+
+	/* too few samples, or all at the same time */
+	g_assert (!up_device_battery_fit_line (x, y, 2, &slope, &confidence));
+	for (i = 0; i < G_N_ELEMENTS (x); i++)
+		x[i] = 0.0;
+	g_assert (!up_device_battery_fit_line (x, y, G_N_ELEMENTS (x), &slope, &confidence));
+}
+
 static void
 up_test_device_list_func (void)
 {
@@ -97,6 +140,7 @@ up_test_device_list_func (void)
 	GObject *native;
 	UpDevice *device;
 	GObject *found;
+	GPtrArray *array;
 	gboolean ret;
 
 	list = up_device_list_new ();
@@ -113,9 +157,26 @@ up_test_device_list_func (void)
 	g_assert (found != NULL);
 	g_object_unref (found);
 
+	/* find device by kind and serial, also after they changed */
+	up_exported_device_set_type_ (UP_EXPORTED_DEVICE (device), UP_DEVICE_KIND_BATTERY);
+	up_exported_device_set_serial (UP_EXPORTED_DEVICE (device), "ABC123");
+	array = up_device_list_get_array_of_kind (list, UP_DEVICE_KIND_BATTERY);
+	g_assert_cmpuint (array->len, ==, 1);
+	g_ptr_array_unref (array);
+	array = up_device_list_get_array_of_kind (list, UP_DEVICE_KIND_UNKNOWN);
+	g_assert_cmpuint (array->len, ==, 0);
+	g_ptr_array_unref (array);
+	array = up_device_list_lookup_serial (list, "abc123");
+	g_assert_cmpuint (array->len, ==, 1);
+	g_assert (g_ptr_array_index (array, 0) == device);
+	g_ptr_array_unref (array);
+
 	/* remove device */
 	ret = up_device_list_remove (list, device);
 	g_assert (ret);
+	array = up_device_list_lookup_serial (list, "ABC123");
+	g_assert_cmpuint (array->len, ==, 0);
+	g_ptr_array_unref (array);
 
 	/* unref */
 	g_object_unref (native);
@@ -127,23 +188,49 @@ static void
 up_test_history_remove_temp_files (void)
 {
 	gchar *filename;
-	filename = g_build_filename (history_dir, "history-time-full-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-time-full-test.bin", NULL);
+	g_unlink (filename);
+	g_free (filename);
+	filename = g_build_filename (history_dir, "history-time-empty-test.bin", NULL);
+	g_unlink (filename);
+	g_free (filename);
+	filename = g_build_filename (history_dir, "history-charge-test.bin", NULL);
 	g_unlink (filename);
 	g_free (filename);
-	filename = g_build_filename (history_dir, "history-time-empty-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-rate-test.bin", NULL);
 	g_unlink (filename);
 	g_free (filename);
-	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-voltage-test.bin", NULL);
 	g_unlink (filename);
 	g_free (filename);
-	filename = g_build_filename (history_dir, "history-rate-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-profile-test.bin", NULL);
 	g_unlink (filename);
 	g_free (filename);
-	filename = g_build_filename (history_dir, "history-voltage-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
 	g_unlink (filename);
 	g_free (filename);
 }
 
+static void
+up_test_history_loaded_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	gboolean *loaded = user_data;
+
+	g_assert (up_history_load_finish (UP_HISTORY (source_object), res, NULL));
+	*loaded = TRUE;
+}
+
+/* the data on disk is read in a thread */
+static void
+up_test_history_wait_loaded (UpHistory *history)
+{
+	gboolean loaded = FALSE;
+
+	up_history_load_async (history, NULL, up_test_history_loaded_cb, &loaded);
+	while (!loaded)
+		g_main_context_iteration (NULL, TRUE);
+}
+
 static void
 up_test_history_func (void)
 {
@@ -168,11 +255,12 @@ up_test_history_func (void)
 	/* setup fresh environment */
 	ret = up_history_set_id (history, "test");
 	g_assert (ret);
+	up_test_history_wait_loaded (history);
 
 	/* get nonexistent data */
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 0);
+	g_assert_cmpint (array->len, ==, 1); /* only the unknown inserted on load */
 	g_ptr_array_unref (array);
 
 	/* setup some fake device and three data points */
@@ -200,7 +288,7 @@ up_test_history_func (void)
 	/* get data for last 10 seconds */
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 3);
+	g_assert_cmpint (array->len, ==, 4); /* including the unknown inserted on load */
 
 	/* get the first item, which should be the most recent */
 	item = g_ptr_array_index (array, 0);
@@ -224,10 +312,10 @@ up_test_history_func (void)
 
         /* request fewer items than we have in our history; should have the
          * same order: first one is the most recent, and the data gets
-         * interpolated */
+         * interpolated, apart from the unknown inserted on load */
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 2);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 2);
+	g_assert_cmpint (array->len, ==, 3);
 
 	item = g_ptr_array_index (array, 0);
 	g_assert (item != NULL);
@@ -246,7 +334,7 @@ up_test_history_func (void)
 	g_object_unref (history);
 
 	/* ensure the file was created */
-	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
 	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
 	g_free (filename);
 
@@ -254,11 +342,12 @@ up_test_history_func (void)
 	history = up_history_new ();
 	up_history_set_directory (history, history_dir);
 	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
 
 	/* get data for last 10 seconds */
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 4); /* we have inserted an unknown as the first entry */
+	g_assert_cmpint (array->len, ==, 5); /* we have inserted an unknown as the first entry */
 	item = g_ptr_array_index (array, 1);
 	g_assert (item != NULL);
 	g_assert_cmpint (up_history_item_get_value (item), ==, 95);
@@ -270,13 +359,14 @@ up_test_history_func (void)
 	g_usleep (1100 * G_USEC_PER_SEC / 1000);
 	g_object_unref (history);
 
-	/* ensure only 2 points are returned */
+	/* ensure only 3 points are returned */
 	history = up_history_new ();
 	up_history_set_directory (history, history_dir);
 	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 2);
+	g_assert_cmpint (array->len, ==, 3);
 	g_ptr_array_unref (array);
 
 	/* unref */
@@ -287,6 +377,423 @@ up_test_history_func (void)
 	rmdir (history_dir);
 }
 
+static void
+up_test_history_legacy_func (void)
+{
+	UpHistory *history;
+	gboolean ret;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	gchar *filename;
+	gchar *filename_legacy;
+	gchar *data;
+	gint64 time_now;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* write a text file like older versions did */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_strdup_printf ("%" G_GINT64_FORMAT "\t50.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t49.000\tdischarging\n",
+				time_now - 100, time_now - 50);
+	filename_legacy = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	ret = g_file_set_contents (filename_legacy, data, -1, NULL);
+	g_assert (ret);
+	g_free (data);
+
+	/* it gets picked up */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 1000, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 3); /* including the unknown inserted on load */
+	item = g_ptr_array_index (array, 1);
+	g_assert_cmpint (up_history_item_get_value (item), ==, 49);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_DISCHARGING);
+	g_ptr_array_unref (array);
+
+	/* and is converted on the first save */
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_object_unref (history);
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_assert (!g_file_test (filename_legacy, G_FILE_TEST_EXISTS));
+	g_free (filename);
+	g_free (filename_legacy);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_clock_func (void)
+{
+	UpHistory *history;
+	gboolean ret;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	gchar *filename_legacy;
+	gchar *data;
+	gint64 time_now;
+	guint i;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* the clock was ahead for one sample and then set back */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_strdup_printf ("%" G_GINT64_FORMAT "\t50.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t50.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t50.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t50.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t49.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t48.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t47.000\tdischarging\n",
+				time_now - 4000, time_now - 3900, time_now - 3800, time_now - 3700,
+				time_now - 10, time_now - 3000, time_now - 100);
+	filename_legacy = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	ret = g_file_set_contents (filename_legacy, data, -1, NULL);
+	g_assert (ret);
+	g_free (data);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+
+	/* only the samples since the clock was set back are recent */
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 1000, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 2); /* including the unknown inserted on load */
+	for (i = 0; i < array->len; i++) {
+		item = g_ptr_array_index (array, i);
+		g_assert_cmpint (up_history_item_get_time (item), >=, time_now - 1000);
+	}
+	item = g_ptr_array_index (array, 1);
+	g_assert_cmpint (up_history_item_get_value (item), ==, 47);
+	g_ptr_array_unref (array);
+
+	/* the whole history is in the order it was recorded */
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 0);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 8);
+	item = g_ptr_array_index (array, 0);
+	g_assert_cmpint (up_history_item_get_time (item), ==, time_now - 4000);
+	item = g_ptr_array_index (array, 4);
+	g_assert_cmpint (up_history_item_get_time (item), ==, time_now - 10);
+	item = g_ptr_array_index (array, 7);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_UNKNOWN);
+	g_ptr_array_unref (array);
+
+	g_object_unref (history);
+	g_unlink (filename_legacy);
+	g_free (filename_legacy);
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_write_log (guint n_samples, guint interval, gdouble value)
+{
+	GByteArray *data;
+	gboolean ret;
+	gchar *filename;
+	gint64 time_now;
+	guint32 type_le;
+	guint32 len_le;
+	guint i;
+	union {
+		gdouble	 d;
+		guint64	 u;
+	} value_le;
+
+	/* one sample every @interval seconds up to now */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	value_le.d = value;
+	value_le.u = GUINT64_TO_LE (value_le.u);
+	data = g_byte_array_sized_new (16 + n_samples * 16);
+	g_byte_array_append (data, (const guint8 *) "UPHDEV01", 8);
+	type_le = GUINT32_TO_LE (UP_HISTORY_TYPE_CHARGE);
+	g_byte_array_append (data, (const guint8 *) &type_le, 4);
+	len_le = GUINT32_TO_LE (n_samples);
+	g_byte_array_append (data, (const guint8 *) &len_le, 4);
+	for (i = 0; i < n_samples; i++) {
+		guint32 time_le = GUINT32_TO_LE (time_now - (n_samples - i) * interval);
+		guint32 state_le = GUINT32_TO_LE (UP_DEVICE_STATE_DISCHARGING);
+
+		g_byte_array_append (data, (const guint8 *) &time_le, 4);
+		g_byte_array_append (data, (const guint8 *) &state_le, 4);
+		g_byte_array_append (data, (const guint8 *) &value_le.u, 8);
+	}
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	ret = g_file_set_contents (filename, (const gchar *) data->data, data->len, NULL);
+	g_assert (ret);
+	g_byte_array_unref (data);
+	g_free (filename);
+}
+
+static void
+up_test_history_levels_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	guint time_last = G_MAXUINT;
+	guint i;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	up_test_history_write_log (2000, 60, 42);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+
+	/* a day of data at a low resolution is answered from the buckets,
+	 * which are the same as the samples as they do not change */
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 24 * 60 * 60, 20);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, >, 1);
+	g_assert_cmpint (array->len, <=, 2 * 20);
+	for (i = 0; i < array->len; i++) {
+		item = g_ptr_array_index (array, i);
+		g_assert_cmpint (up_history_item_get_time (item), <, time_last);
+		time_last = up_history_item_get_time (item);
+		if (up_history_item_get_state (item) == UP_DEVICE_STATE_UNKNOWN)
+			continue;
+		g_assert_cmpfloat (up_history_item_get_value (item), ==, 42);
+	}
+	g_ptr_array_unref (array);
+
+	g_object_unref (history);
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_profile_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	UpStatsItem *stats;
+	gboolean ret;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+
+	/* the first sample after a state change only starts a step */
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50);
+	up_history_set_charge_data (history, 49);
+	up_history_set_charge_data (history, 48);
+	array = up_history_get_profile_data (history, FALSE);
+	g_assert_cmpint (array->len, ==, 101);
+	stats = g_ptr_array_index (array, 48);
+	g_assert_cmpfloat (up_stats_item_get_accuracy (stats), ==, 20);
+	stats = g_ptr_array_index (array, 49);
+	g_assert_cmpfloat (up_stats_item_get_accuracy (stats), ==, 0);
+	g_ptr_array_unref (array);
+	array = up_history_get_profile_data (history, TRUE);
+	stats = g_ptr_array_index (array, 48);
+	g_assert_cmpfloat (up_stats_item_get_accuracy (stats), ==, 0);
+	g_ptr_array_unref (array);
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_object_unref (history);
+
+	/* the profile outlives the samples it was made from */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_max_data_age (history, 0);
+	g_usleep (1100 * G_USEC_PER_SEC / 1000);
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_object_unref (history);
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
+	g_assert_cmpint (array->len, ==, 1); /* the unknown inserted on load */
+	g_ptr_array_unref (array);
+	array = up_history_get_profile_data (history, FALSE);
+	stats = g_ptr_array_index (array, 48);
+	g_assert_cmpfloat (up_stats_item_get_accuracy (stats), ==, 20);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_writer_func (void)
+{
+	UpHistoryWriter *writer;
+	UpHistory *history;
+	UpHistory *history2;
+	gchar *filename;
+	gchar *filename2;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	filename2 = g_build_filename (history_dir, "history-test2.bin", NULL);
+
+	writer = up_history_writer_new ();
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_writer (history, writer);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	history2 = up_history_new ();
+	up_history_set_directory (history2, history_dir);
+	up_history_set_writer (history2, writer);
+	up_history_set_id (history2, "test2");
+
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50);
+	up_history_set_state (history2, UP_DEVICE_STATE_CHARGING);
+	up_history_set_charge_data (history2, 60);
+
+	/* both are saved in one go */
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_assert (!g_file_test (filename2, G_FILE_TEST_EXISTS));
+	up_history_writer_flush (writer);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_assert (g_file_test (filename2, G_FILE_TEST_EXISTS));
+
+	g_object_unref (history);
+	g_object_unref (history2);
+	g_object_unref (writer);
+
+	g_unlink (filename2);
+	g_free (filename);
+	g_free (filename2);
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_lazy_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	UpStatsItem *stats;
+	gboolean ret;
+	guint i;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* two runs that only record, without ever reading the file */
+	for (i = 0; i < 2; i++) {
+		history = up_history_new ();
+		up_history_set_directory (history, history_dir);
+		up_history_set_id (history, "test");
+		up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+		up_history_set_charge_data (history, 50);
+		up_history_set_charge_data (history, 49);
+		up_history_set_charge_data (history, 48);
+		ret = up_history_save_data (history);
+		g_assert (ret);
+		g_object_unref (history);
+	}
+
+	/* both are there once asked for */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
+	g_assert_cmpint (array->len, ==, 9); /* including the unknowns inserted on load */
+	g_ptr_array_unref (array);
+	array = up_history_get_profile_data (history, FALSE);
+	stats = g_ptr_array_index (array, 48);
+	g_assert_cmpfloat (up_stats_item_get_accuracy (stats), ==, 40);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_perf_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	GTimer *timer;
+	gdouble elapsed_span;
+	gdouble elapsed_all;
+	guint i;
+	const guint n_samples = 1000000;
+	const guint n_queries = 100;
+
+	if (!g_test_perf ()) {
+		g_test_skip ("only run in performance mode");
+		return;
+	}
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	up_test_history_write_log (n_samples, 10, 50);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_max_data_age (history, G_MAXUINT);
+
+	/* the last ten minutes, as graphing clients ask for */
+	timer = g_timer_new ();
+	for (i = 0; i < n_queries; i++) {
+		array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 600, 100);
+		g_assert_cmpint (array->len, <, 100);
+		g_ptr_array_unref (array);
+	}
+	elapsed_span = g_timer_elapsed (timer, NULL) / n_queries;
+
+	/* the whole history */
+	g_timer_start (timer);
+	for (i = 0; i < n_queries; i++) {
+		array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+		g_ptr_array_unref (array);
+	}
+	elapsed_all = g_timer_elapsed (timer, NULL) / n_queries;
+	g_timer_destroy (timer);
+
+	g_test_minimized_result (elapsed_span,
+				 "last 10 minutes of %u samples: %.6f s per query",
+				 n_samples, elapsed_span);
+	g_test_minimized_result (elapsed_all,
+				 "all %u samples: %.6f s per query",
+				 n_samples, elapsed_all);
+
+	g_object_unref (history);
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
 static void
 up_test_polkit_func (void)
 {
@@ -319,7 +826,15 @@ main (int argc, char **argv)
 	g_test_add_func ("/power/backend", up_test_backend_func);
 	g_test_add_func ("/power/device", up_test_device_func);
 	g_test_add_func ("/power/device_list", up_test_device_list_func);
+	g_test_add_func ("/power/battery_fit", up_test_battery_fit_func);
 	g_test_add_func ("/power/history", up_test_history_func);
+	g_test_add_func ("/power/history_legacy", up_test_history_legacy_func);
+	g_test_add_func ("/power/history_clock", up_test_history_clock_func);
+	g_test_add_func ("/power/history_levels", up_test_history_levels_func);
+	g_test_add_func ("/power/history_profile", up_test_history_profile_func);
+	g_test_add_func ("/power/history_writer", up_test_history_writer_func);
+	g_test_add_func ("/power/history_lazy", up_test_history_lazy_func);
+	g_test_add_func ("/power/history_perf", up_test_history_perf_func);
 	g_test_add_func ("/power/native", up_test_native_func);
 	g_test_add_func ("/power/polkit", up_test_polkit_func);
 	g_test_add_func ("/power/daemon", up_test_daemon_func);